@@ -0,0 +1,65 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef AudioBus_h
+#define AudioBus_h
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// Planar float storage for one decoded channel.
+class AudioChannel {
+public:
+    explicit AudioChannel(size_t length)
+        : m_data(length, 0)
+    {
+    }
+
+    size_t length() const { return m_data.size(); }
+    const float* data() const { return m_data.empty() ? 0 : &m_data[0]; }
+    float* mutableData() { return m_data.empty() ? 0 : &m_data[0]; }
+
+private:
+    std::vector<float> m_data;
+};
+
+// Decoded result of an AudioStreamChannelsReader: one AudioChannel
+// per output channel, all of the same length.
+class AudioBus {
+public:
+    static std::unique_ptr<AudioBus> create(unsigned numberOfChannels, size_t length);
+
+    unsigned numberOfChannels() const { return m_channels.size(); }
+    size_t length() const { return m_length; }
+
+    AudioChannel* channel(unsigned index) { return &m_channels[index]; }
+    const AudioChannel* channel(unsigned index) const { return &m_channels[index]; }
+
+    float sampleRate() const { return m_sampleRate; }
+    void setSampleRate(float sampleRate) { m_sampleRate = sampleRate; }
+
+private:
+    AudioBus(unsigned numberOfChannels, size_t length);
+
+    std::vector<AudioChannel> m_channels;
+    size_t m_length;
+    float m_sampleRate;
+};
+
+#endif // AudioBus_h
@@ -0,0 +1,307 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "AudioMixer.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <thread>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "AudioStreamChannelsReader.h"
+#include "AudioStreamProbe.h"
+
+// Output frames per chunk and channel, about 1.5 s at 44.1 kHz.
+static const size_t gChunkFrames = 1 << 16;
+
+// Timestamps closer than this to where the previous buffer of the
+// source ended are taken as contiguous, as audiobasesink does, so that
+// rounding never opens gaps or overlaps of a frame.
+static const GstClockTime gAlignmentThreshold = 40 * GST_MSECOND;
+
+struct AudioMixer::Chunk {
+    explicit Chunk(unsigned numberOfChannels)
+        : samples(numberOfChannels * gChunkFrames, 0)
+    {
+    }
+
+    float* channel(unsigned index) { return &samples[index * gChunkFrames]; }
+
+    // Sources at the same position add to the same chunk from their
+    // own streaming threads.
+    std::mutex mutex;
+    std::vector<float> samples;
+};
+
+struct AudioMixer::SourceState {
+    SourceState()
+        : gain(1)
+        , offsetFrames(0)
+        , lengthFrames(G_MAXUINT64)
+        , fadeInFrames(0)
+        , fadeOutFrames(0)
+        , startFrame(0)
+    {
+        std::fill(nextFrame, nextFrame + 2, 0);
+        std::fill(synced, synced + 2, false);
+    }
+
+    float gain;
+    guint64 offsetFrames;
+    // G_MAXUINT64 when neither stop nor the duration are known.
+    guint64 lengthFrames;
+    guint64 fadeInFrames;
+    guint64 fadeOutFrames;
+    guint64 startFrame;
+    // Source frame the next buffer of each channel is expected at. Each
+    // is only touched by the streaming thread of its channel.
+    guint64 nextFrame[2];
+    bool synced[2];
+};
+
+// destination[i] += source[i] * (gain + i * gainStep)
+static void mixInto(float* destination, const float* source, size_t frames, float gain, float gainStep)
+{
+    size_t i = 0;
+#ifdef __SSE__
+    __m128 gains = _mm_setr_ps(gain, gain + gainStep, gain + 2 * gainStep, gain + 3 * gainStep);
+    __m128 step = _mm_set1_ps(4 * gainStep);
+    for (; i + 4 <= frames; i += 4) {
+        __m128 sum = _mm_add_ps(_mm_loadu_ps(destination + i), _mm_mul_ps(_mm_loadu_ps(source + i), gains));
+        _mm_storeu_ps(destination + i, sum);
+        gains = _mm_add_ps(gains, step);
+    }
+#endif
+    for (; i < frames; ++i)
+        destination[i] += source[i] * (gain + i * gainStep);
+}
+
+static guint64 toFrames(GstClockTime time, float sampleRate)
+{
+    return gst_util_uint64_scale_round(time, static_cast<guint64>(sampleRate), GST_SECOND);
+}
+
+AudioMixer::AudioMixer(const std::vector<MixerSource>& sources, const AudioMixerConfig& config)
+    : m_sources(sources)
+    , m_config(config)
+    , m_numberOfChannels(config.mixToMono ? 1 : 2)
+    , m_readers(sources.size())
+    , m_nextToStart(0)
+    , m_running(0)
+    , m_length(0)
+{
+    if (!m_config.concurrentDecodes)
+        m_config.concurrentDecodes = std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+AudioMixer::~AudioMixer()
+{
+}
+
+std::unique_ptr<AudioBus> AudioMixer::mix(GError** error)
+{
+    ASSERT(!m_context);
+    float rate = m_config.sampleRate;
+    guint64 expectedLength = 0;
+    for (auto& source : m_sources) {
+        std::unique_ptr<SourceState> state(new SourceState);
+        state->gain = source.gain;
+        state->offsetFrames = toFrames(source.offset, rate);
+        state->startFrame = toFrames(source.start, rate);
+        state->fadeInFrames = toFrames(source.fadeIn, rate);
+        state->fadeOutFrames = toFrames(source.fadeOut, rate);
+
+        GstClockTime stop = source.stop;
+        AudioStreamInfo info;
+        // Probing is cached, and only needed to place the fade out.
+        if (!GST_CLOCK_TIME_IS_VALID(stop) && source.fadeOut && probeAudioFile(source.filePath.c_str(), info))
+            stop = info.duration;
+        if (GST_CLOCK_TIME_IS_VALID(stop)) {
+            guint64 stopFrame = toFrames(stop, rate);
+            state->lengthFrames = stopFrame > state->startFrame ? stopFrame - state->startFrame : 0;
+            expectedLength = std::max(expectedLength, state->offsetFrames + state->lengthFrames);
+        }
+        state->fadeOutFrames = std::min(state->fadeOutFrames, state->lengthFrames == G_MAXUINT64 ? 0 : state->lengthFrames);
+        m_states.push_back(std::move(state));
+    }
+    m_chunks.reserve((expectedLength + gChunkFrames - 1) / gChunkFrames);
+
+    m_context = adoptGRef(g_main_context_new());
+    m_loop = adoptGRef(g_main_loop_new(m_context.get(), FALSE));
+    for (unsigned i = 0; i < m_config.concurrentDecodes; ++i)
+        startNextDecode();
+    if (m_running)
+        g_main_loop_run(m_loop.get());
+
+    if (m_error.get()) {
+        g_propagate_error(error, m_error.release());
+        return std::unique_ptr<AudioBus>();
+    }
+    return takeOutput();
+}
+
+void AudioMixer::startNextDecode()
+{
+    if (m_error.get() || m_nextToStart >= m_sources.size())
+        return;
+    size_t index = m_nextToStart++;
+    const MixerSource& source = m_sources[index];
+
+    AudioStreamChannelsReader* reader = new AudioStreamChannelsReader(source.filePath.c_str());
+    m_readers[index].reset(reader);
+    reader->setCollectsBuffers(false);
+    if (source.start || GST_CLOCK_TIME_IS_VALID(source.stop))
+        reader->setSegment(source.start, source.stop);
+    reader->setSampleObserver([this, index](unsigned channel, const float* samples, size_t frames, GstClockTime timestamp) {
+        accumulate(index, channel, samples, frames, timestamp);
+    });
+    ++m_running;
+    reader->start(m_config.sampleRate, m_config.mixToMono, m_context.get(), [this, index](std::unique_ptr<AudioBus>, const GError* error) {
+        didFinishDecode(index, error);
+    });
+}
+
+void AudioMixer::didFinishDecode(size_t index, const GError* error)
+{
+    if (error && !m_error.get()) {
+        GError* sourceError = g_error_copy(error);
+        g_prefix_error(&sourceError, "%s: ", m_sources[index].filePath.c_str());
+        m_error.set(sourceError);
+        // A partial mix is of no use.
+        for (auto& reader : m_readers) {
+            if (reader)
+                reader->cancel();
+        }
+    }
+
+    --m_running;
+    startNextDecode();
+    m_readers[index].reset();
+    if (!m_running)
+        g_main_loop_quit(m_loop.get());
+}
+
+// Called on the streaming thread of channel.
+void AudioMixer::accumulate(size_t index, unsigned channel, const float* samples, size_t frames, GstClockTime timestamp)
+{
+    if (channel >= m_numberOfChannels)
+        return;
+    SourceState& state = *m_states[index];
+
+    // Where the buffer starts relative to the source start, negative
+    // for leftovers from before the segment seek.
+    gint64 position = state.nextFrame[channel];
+    if (GST_CLOCK_TIME_IS_VALID(timestamp)) {
+        gint64 timestampPosition = static_cast<gint64>(toFrames(timestamp, m_config.sampleRate)) - static_cast<gint64>(state.startFrame);
+        gint64 threshold = toFrames(gAlignmentThreshold, m_config.sampleRate);
+        if (!state.synced[channel] || std::abs(timestampPosition - position) > threshold) {
+            position = timestampPosition;
+            state.synced[channel] = true;
+        }
+    }
+    state.nextFrame[channel] = std::max<gint64>(position + frames, 0);
+
+    if (position < 0) {
+        if (static_cast<guint64>(-position) >= frames)
+            return;
+        samples += -position;
+        frames -= -position;
+        position = 0;
+    }
+    guint64 sourceFrame = position;
+    if (sourceFrame >= state.lengthFrames)
+        return;
+    frames = std::min<guint64>(frames, state.lengthFrames - sourceFrame);
+    accumulateRun(state, channel, samples, frames, sourceFrame);
+}
+
+// Splits the run where the gain stops being linear and at chunk
+// boundaries.
+void AudioMixer::accumulateRun(const SourceState& state, unsigned channel, const float* samples, size_t frames, guint64 sourceFrame)
+{
+    guint64 fadeOutStart = state.fadeOutFrames ? state.lengthFrames - state.fadeOutFrames : G_MAXUINT64;
+    while (frames) {
+        guint64 outputFrame = state.offsetFrames + sourceFrame;
+        size_t chunkOffset = outputFrame % gChunkFrames;
+        size_t run = std::min(frames, gChunkFrames - chunkOffset);
+        bool fadingIn = sourceFrame < state.fadeInFrames;
+        bool fadingOut = sourceFrame >= fadeOutStart;
+        if (fadingIn)
+            run = std::min<guint64>(run, state.fadeInFrames - sourceFrame);
+        if (!fadingOut && fadeOutStart != G_MAXUINT64)
+            run = std::min<guint64>(run, fadeOutStart - sourceFrame);
+
+        float fadeIn = fadingIn ? static_cast<float>(sourceFrame) / state.fadeInFrames : 1;
+        float fadeInStep = fadingIn ? 1.0f / state.fadeInFrames : 0;
+        float fadeOut = fadingOut ? static_cast<float>(state.lengthFrames - sourceFrame) / state.fadeOutFrames : 1;
+        float fadeOutStep = fadingOut ? -1.0f / state.fadeOutFrames : 0;
+
+        Chunk* chunk = chunkAt(outputFrame / gChunkFrames);
+        {
+            std::lock_guard<std::mutex> lock(chunk->mutex);
+            float* destination = chunk->channel(channel) + chunkOffset;
+            if (fadingIn && fadingOut) {
+                // Overlapping fades multiply, which is not linear anymore.
+                for (size_t i = 0; i < run; ++i)
+                    destination[i] += samples[i] * state.gain * (fadeIn + i * fadeInStep) * (fadeOut + i * fadeOutStep);
+            } else
+                mixInto(destination, samples, run, state.gain * fadeIn * fadeOut, state.gain * (fadeInStep + fadeOutStep));
+        }
+
+        guint64 end = outputFrame + run;
+        guint64 length = m_length.load();
+        while (length < end && !m_length.compare_exchange_weak(length, end)) { }
+
+        samples += run;
+        frames -= run;
+        sourceFrame += run;
+    }
+}
+
+AudioMixer::Chunk* AudioMixer::chunkAt(size_t index)
+{
+    std::lock_guard<std::mutex> lock(m_chunksMutex);
+    if (index >= m_chunks.size())
+        m_chunks.resize(index + 1);
+    if (!m_chunks[index])
+        m_chunks[index].reset(new Chunk(m_numberOfChannels));
+    return m_chunks[index].get();
+}
+
+// Chunks are released as they are copied, so the mix is only about
+// once in memory.
+std::unique_ptr<AudioBus> AudioMixer::takeOutput()
+{
+    guint64 length = m_length;
+    std::unique_ptr<AudioBus> bus = AudioBus::create(m_numberOfChannels, length);
+    bus->setSampleRate(m_config.sampleRate);
+    for (size_t index = 0; index < m_chunks.size(); ++index) {
+        std::unique_ptr<Chunk> chunk = std::move(m_chunks[index]);
+        guint64 first = index * gChunkFrames;
+        if (!chunk || first >= length)
+            continue;
+        size_t frames = std::min<guint64>(gChunkFrames, length - first);
+        for (unsigned channel = 0; channel < m_numberOfChannels; ++channel)
+            std::copy(chunk->channel(channel), chunk->channel(channel) + frames, bus->channel(channel)->mutableData() + first);
+    }
+    m_chunks.clear();
+    return bus;
+}
@@ -0,0 +1,118 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef AudioMixer_h
+#define AudioMixer_h
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <gst/gst.h>
+
+#include "AudioBus.h"
+#include "GOwnPtr.h"
+#include "GRefPtr.h"
+
+class AudioStreamChannelsReader;
+
+// One stem of a mix. [start, stop) of filePath, in stream time, lands at
+// offset in the output, scaled by gain and faded in and out linearly
+// over the given durations.
+struct MixerSource {
+    MixerSource(const char* filePath, float gain = 1, GstClockTime offset = 0)
+        : filePath(filePath)
+        , gain(gain)
+        , offset(offset)
+        , start(0)
+        , stop(GST_CLOCK_TIME_NONE)
+        , fadeIn(0)
+        , fadeOut(0)
+    {
+    }
+
+    std::string filePath;
+    float gain;
+    GstClockTime offset;
+    GstClockTime start;
+    GstClockTime stop;
+    GstClockTime fadeIn;
+    // Needs stop, or a duration the file can be probed for.
+    GstClockTime fadeOut;
+};
+
+struct AudioMixerConfig {
+    AudioMixerConfig()
+        : sampleRate(44100)
+        , mixToMono(false)
+        , concurrentDecodes(0)
+    {
+    }
+
+    float sampleRate;
+    bool mixToMono;
+    // Pipelines in flight, 0 for one per CPU.
+    unsigned concurrentDecodes;
+};
+
+// Sums many sources into one bus. Every source is decoded by its own
+// AudioStreamChannelsReader, several at once, and its buffers are
+// accumulated into the output straight from the streaming threads at
+// the position given by their timestamps, so no source is ever held in
+// memory in full. The output is kept in chunks allocated as the mix
+// grows. Samples are summed without any clipping.
+class AudioMixer {
+public:
+    AudioMixer(const std::vector<MixerSource>&, const AudioMixerConfig& = AudioMixerConfig());
+    ~AudioMixer();
+
+    // Blocks until every source has been mixed in. Returns 0 and sets
+    // error if any of them failed, the remaining ones are cancelled.
+    std::unique_ptr<AudioBus> mix(GError** = 0);
+
+    struct Chunk;
+    struct SourceState;
+
+private:
+    void startNextDecode();
+    void didFinishDecode(size_t index, const GError*);
+    void accumulate(size_t index, unsigned channel, const float* samples, size_t frames, GstClockTime timestamp);
+    void accumulateRun(const SourceState&, unsigned channel, const float* samples, size_t frames, guint64 sourceFrame);
+    Chunk* chunkAt(size_t index);
+    std::unique_ptr<AudioBus> takeOutput();
+
+    std::vector<MixerSource> m_sources;
+    AudioMixerConfig m_config;
+    unsigned m_numberOfChannels;
+    std::vector<std::unique_ptr<SourceState> > m_states;
+    std::vector<std::unique_ptr<AudioStreamChannelsReader> > m_readers;
+
+    GRefPtr<GMainContext> m_context;
+    GRefPtr<GMainLoop> m_loop;
+    size_t m_nextToStart;
+    size_t m_running;
+    GOwnPtr<GError> m_error;
+
+    std::mutex m_chunksMutex;
+    std::vector<std::unique_ptr<Chunk> > m_chunks;
+    std::atomic<guint64> m_length;
+};
+
+#endif // AudioMixer_h
@@ -17,11 +17,15 @@
  *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include "AudioStreamChannelsReader.h"
+
+#include <algorithm>
 #include <cassert>
 #include <cstdio>
+#include <cstring>
+#include <stdexcept>
 
-#include <gst/app/gstappsink.h>
-#include <gst/gst.h>
+#include <gio/gio.h>
 #include <gst/pbutils/pbutils.h>
 
 #ifdef GST_API_VERSION_1
@@ -30,9 +34,13 @@
 #include <gst/audio/multichannel.h>
 #endif
 
-#include "GOwnPtr.h"
-#include "GRefPtr.h"
+#include "AudioStreamProbe.h"
 #include "GStreamerUtilities.h"
+#include "LoudnessMeter.h"
+#include "PipelineTracer.h"
+#include "PolyphaseResampler.h"
+#include "SharedAudioRing.h"
+#include "StreamingThreadPool.h"
 
 #ifdef GST_API_VERSION_1
 static const char* gDecodebinName = "decodebin";
@@ -51,98 +59,50 @@ GstBus* webkitGstPipelineGetBus(GstPipeline* pipeline)
 #endif
 }
 
-GstCaps* getGstAudioCaps(int channels, float sampleRate)
-{
-#ifdef GST_API_VERSION_1
-    return gst_caps_new_simple("audio/x-raw", "rate", G_TYPE_INT, static_cast<int>(sampleRate),
-        "channels", G_TYPE_INT, channels,
-        "format", G_TYPE_STRING, gst_audio_format_to_string(GST_AUDIO_FORMAT_F32),
-        "layout", G_TYPE_STRING, "interleaved", NULL);
-#else
-    //return gst_caps_new_simple("audio/x-raw-float", "rate", G_TYPE_INT, static_cast<int>(sampleRate),
-    return gst_caps_new_simple("audio/x-raw-float", "rate", G_TYPE_INT, static_cast<int>(44100),
-        "channels", G_TYPE_INT, channels,
-        "endianness", G_TYPE_INT, G_BYTE_ORDER,
-        "width", G_TYPE_INT, 32, NULL);
-#endif
-}
-
-
-class AudioStreamChannelsReader {
-
-public:
-    AudioStreamChannelsReader(const char* filePath);
-    AudioStreamChannelsReader(const void* data, size_t dataSize);
-    ~AudioStreamChannelsReader();
-
-    void createBus(float sampleRate, bool mixToMono);
-
-#ifdef GST_API_VERSION_1
-    GstFlowReturn handleSample(GstAppSink*);
-#else
-    GstFlowReturn handleBuffer(GstAppSink*);
-#endif
-    gboolean handleMessage(GstMessage*);
-    void handleNewDeinterleavePad(GstPad*);
-    void deinterleavePadsConfigured();
-    void buildInputPipeline();
-    void plugDeinterleave(GstPad*);
-    void decodeAudioForBusCreation();
-
-private:
-    const void* m_data;
-    size_t m_dataSize;
-    const char* m_filePath;
-
-    float m_sampleRate;
-    GstBufferList* m_frontLeftBuffers;
-    GstBufferList* m_frontRightBuffers;
-
-#ifndef GST_API_VERSION_1
-    GstBufferListIterator* m_frontLeftBuffersIterator;
-    GstBufferListIterator* m_frontRightBuffersIterator;
-#endif
-
-    GstElement* m_pipeline;
-    unsigned m_channelSize;
-    GRefPtr<GstElement> m_decodebin;
-    GRefPtr<GstElement> m_deInterleave;
-    GRefPtr<GMainLoop> m_loop;
-    bool m_errorOccurred;
-};
-
-/*static void copyGstreamerBuffersToAudioChannel(GstBufferList* buffers, AudioChannel* audioChannel)
+static void copyGstreamerBuffersToAudioChannel(GstBufferList* buffers, AudioChannel* audioChannel)
 {
-#ifdef GST_API_VERSION_1
     float* destination = audioChannel->mutableData();
+    gsize remaining = audioChannel->length() * sizeof(float);
+#ifdef GST_API_VERSION_1
     unsigned bufferCount = gst_buffer_list_length(buffers);
-    for (unsigned i = 0; i < bufferCount; ++i) {
+    for (unsigned i = 0; i < bufferCount && remaining; ++i) {
         GstBuffer* buffer = gst_buffer_list_get(buffers, i);
         ASSERT(buffer);
-        gsize bufferSize = gst_buffer_get_size(buffer);
+        gsize bufferSize = std::min(gst_buffer_get_size(buffer), remaining);
         gst_buffer_extract(buffer, 0, destination, bufferSize);
         destination += bufferSize / sizeof(float);
+        remaining -= bufferSize;
     }
 #else
     GstBufferListIterator* iter = gst_buffer_list_iterate(buffers);
     gst_buffer_list_iterator_next_group(iter);
     GstBuffer* buffer = gst_buffer_list_iterator_merge_group(iter);
     if (buffer) {
-        memcpy(audioChannel->mutableData(), reinterpret_cast<float*>(GST_BUFFER_DATA(buffer)), GST_BUFFER_SIZE(buffer));
+        memcpy(destination, reinterpret_cast<float*>(GST_BUFFER_DATA(buffer)), std::min<gsize>(GST_BUFFER_SIZE(buffer), remaining));
         gst_buffer_unref(buffer);
     }
 
     gst_buffer_list_iterator_free(iter);
 #endif
-}*/
+}
 
 static GstFlowReturn onAppsinkPullRequiredCallback(GstAppSink* sink, gpointer userData)
 {
+    AudioStreamChannelsReader* reader = static_cast<AudioStreamChannelsReader*>(userData);
+    gint64 callbackStart = reader->tracer() ? g_get_monotonic_time() : 0;
 #ifdef GST_API_VERSION_1
-    return static_cast<AudioStreamChannelsReader*>(userData)->handleSample(sink);
+    GstFlowReturn result = reader->handleSample(sink);
 #else
-    return static_cast<AudioStreamChannelsReader*>(userData)->handleBuffer(sink);
+    GstFlowReturn result = reader->handleBuffer(sink);
 #endif
+    if (PipelineTracer* tracer = reader->tracer())
+        tracer->recordSpan(GST_OBJECT_NAME(sink), "appsink", callbackStart, g_get_monotonic_time());
+    return result;
+}
+
+static GstFlowReturn onLoudnessPullRequiredCallback(GstAppSink* sink, gpointer userData)
+{
+    return static_cast<AudioStreamChannelsReader*>(userData)->handleLoudnessSample(sink);
 }
 
 gboolean messageCallback(GstBus*, GstMessage* message, AudioStreamChannelsReader* reader)
@@ -162,7 +122,44 @@ static void onGStreamerDeinterleaveReadyCallback(GstElement*, AudioStreamChannel
 
 static void onGStreamerDecodebinPadAddedCallback(GstElement*, GstPad* pad, AudioStreamChannelsReader* reader)
 {
-    reader->plugDeinterleave(pad);
+    reader->handleNewDecodedPad(pad);
+}
+
+static void onGStreamerDecodebinNoMorePadsCallback(GstElement*, AudioStreamChannelsReader* reader)
+{
+    reader->decodedPadsComplete();
+}
+
+static bool isAudioCaps(GstCaps* caps)
+{
+    return caps && !gst_caps_is_empty(caps) && g_str_has_prefix(gst_structure_get_name(gst_caps_get_structure(caps, 0)), "audio/");
+}
+
+static bool isAudioPad(GstPad* pad)
+{
+#ifdef GST_API_VERSION_1
+    GRefPtr<GstCaps> caps = adoptGRef(gst_pad_query_caps(pad, 0));
+#else
+    GRefPtr<GstCaps> caps = adoptGRef(gst_pad_get_caps_reffed(pad));
+#endif
+    return isAudioCaps(caps.get());
+}
+
+// Containers and metadata wrappers, which have to be taken apart to
+// find the audio streams. Their caps are not always audio/*.
+static bool isDemuxableCaps(GstCaps* caps)
+{
+    GList* accepting = gst_element_factory_list_filter(demuxerFactories(), caps, GST_PAD_SINK, FALSE);
+    bool demuxable = accepting != 0;
+    gst_plugin_feature_list_free(accepting);
+    return demuxable;
+}
+
+static gboolean onGStreamerDecodebinAutoplugContinueCallback(GstElement*, GstPad*, GstCaps* caps, AudioStreamChannelsReader*)
+{
+    // Video, subtitles and the like are exposed as they are instead of
+    // being decoded for nothing.
+    return isAudioCaps(caps) || isDemuxableCaps(caps);
 }
 
 gboolean enteredMainLoopCallback(gpointer userData)
@@ -172,38 +169,262 @@ gboolean enteredMainLoopCallback(gpointer userData)
     return FALSE;
 }
 
+#ifdef GST_API_VERSION_1
+static GstPadProbeReturn countQueuedFramesProbe(GstPad*, GstPadProbeInfo* info, gpointer userData)
+{
+    AudioStreamChannelsReader::ChannelQueueState* state = static_cast<AudioStreamChannelsReader::ChannelQueueState*>(userData);
+    state->framesQueued += gst_buffer_get_size(GST_PAD_PROBE_INFO_BUFFER(info)) / sizeof(float);
+    return GST_PAD_PROBE_OK;
+}
+#endif
+
+static GstFlowReturn onAdditionalOutputPullRequiredCallback(GstAppSink* sink, gpointer userData)
+{
+    AudioStreamChannelsReader::AdditionalOutput* output = static_cast<AudioStreamChannelsReader::AdditionalOutput*>(userData);
+#ifdef GST_API_VERSION_1
+    GRefPtr<GstSample> sample = adoptGRef(gst_app_sink_pull_sample(sink));
+    if (!sample)
+        return GST_FLOW_ERROR;
+    GstBuffer* buffer = gst_sample_get_buffer(sample.get());
+    if (!buffer)
+        return GST_FLOW_ERROR;
+    output->buffers.push_back(buffer);
+#else
+    GstBuffer* buffer = gst_app_sink_pull_buffer(sink);
+    if (!buffer)
+        return GST_FLOW_ERROR;
+    output->buffers.push_back(adoptGRef(buffer));
+#endif
+    return GST_FLOW_OK;
+}
+
+static std::unique_ptr<AudioBus> deinterleaveBuffers(const std::vector<GRefPtr<GstBuffer> >& buffers, unsigned channels, float sampleRate)
+{
+    size_t frameSize = channels * sizeof(float);
+    size_t totalFrames = 0;
+    for (auto& buffer : buffers) {
+#ifdef GST_API_VERSION_1
+        totalFrames += gst_buffer_get_size(buffer.get()) / frameSize;
+#else
+        totalFrames += GST_BUFFER_SIZE(buffer.get()) / frameSize;
+#endif
+    }
+
+    std::unique_ptr<AudioBus> audioBus = AudioBus::create(channels, totalFrames);
+    audioBus->setSampleRate(sampleRate);
+
+    size_t offset = 0;
+    for (auto& buffer : buffers) {
+#ifdef GST_API_VERSION_1
+        GstMapInfo mapInfo;
+        if (!gst_buffer_map(buffer.get(), &mapInfo, GST_MAP_READ))
+            continue;
+        const float* source = reinterpret_cast<const float*>(mapInfo.data);
+        size_t frames = mapInfo.size / frameSize;
+#else
+        const float* source = reinterpret_cast<const float*>(GST_BUFFER_DATA(buffer.get()));
+        size_t frames = GST_BUFFER_SIZE(buffer.get()) / frameSize;
+#endif
+        for (unsigned channel = 0; channel < channels; ++channel) {
+            float* destination = audioBus->channel(channel)->mutableData() + offset;
+            for (size_t frame = 0; frame < frames; ++frame)
+                destination[frame] = source[frame * channels + channel];
+        }
+        offset += frames;
+#ifdef GST_API_VERSION_1
+        gst_buffer_unmap(buffer.get(), &mapInfo);
+#endif
+    }
+
+    return audioBus;
+}
+
+static GstBusSyncReply busSyncHandler(GstBus*, GstMessage* message, gpointer userData)
+{
+    // Runs on the posting thread, so traced messages line up with the
+    // buffer flow instead of with the bus watch dispatch.
+    AudioStreamChannelsReader* reader = static_cast<AudioStreamChannelsReader*>(userData);
+    if (PipelineTracer* tracer = reader->tracer())
+        tracer->recordMessage(message);
+
+    GstTaskPool* pool = sharedStreamingThreadPool();
+    if (!pool || GST_MESSAGE_TYPE(message) != GST_MESSAGE_STREAM_STATUS)
+        return GST_BUS_PASS;
+
+    GstStreamStatusType status;
+    GstElement* owner;
+    gst_message_parse_stream_status(message, &status, &owner);
+    if (status != GST_STREAM_STATUS_TYPE_CREATE)
+        return GST_BUS_PASS;
+
+    // The task isn't started yet, so it will run on the shared pool.
+    const GValue* value = gst_message_get_stream_status_object(message);
+    if (value && G_VALUE_HOLDS(value, GST_TYPE_TASK))
+        gst_task_set_pool(GST_TASK(g_value_get_object(value)), pool);
+    return GST_BUS_PASS;
+}
+
+GQuark audioReaderErrorQuark()
+{
+    return g_quark_from_static_string("audio-reader-error-quark");
+}
+
+static gboolean checkDeadlinesCallback(gpointer userData)
+{
+    return reinterpret_cast<AudioStreamChannelsReader*>(userData)->checkDeadlines();
+}
+
+static gboolean seekToSegmentCallback(gpointer userData)
+{
+    reinterpret_cast<AudioStreamChannelsReader*>(userData)->seekToSegment();
+    return FALSE;
+}
+
+static gboolean cancelDecodingCallback(gpointer userData)
+{
+    AudioStreamChannelsReader* reader = reinterpret_cast<AudioStreamChannelsReader*>(userData);
+    GOwnPtr<GError> error(g_error_new_literal(G_IO_ERROR, G_IO_ERROR_CANCELLED, "Decoding was cancelled"));
+    reader->didFinishDecoding(error.get());
+    return FALSE;
+}
+
+// Everything the completion callback needs, detached from the reader
+// so that the callback is free to destroy it.
+struct DecodeCompletion {
+    AudioStreamChannelsReader::CompletionCallback callback;
+    std::unique_ptr<AudioBus> bus;
+    GError* error;
+};
+
+static gboolean decodeCompletionCallback(gpointer userData)
+{
+    DecodeCompletion* completion = static_cast<DecodeCompletion*>(userData);
+    completion->callback(std::move(completion->bus), completion->error);
+    return FALSE;
+}
+
+static void destroyDecodeCompletion(gpointer userData)
+{
+    DecodeCompletion* completion = static_cast<DecodeCompletion*>(userData);
+    if (completion->error)
+        g_error_free(completion->error);
+    delete completion;
+}
+
 AudioStreamChannelsReader::AudioStreamChannelsReader(const char* filePath)
     : m_data(0)
     , m_dataSize(0)
-    , m_filePath(filePath)
+    , m_filePath(g_strdup(filePath))
+    , m_sampleRate(0)
+    , m_mixToMono(false)
     , m_channelSize(0)
+    , m_hasSegment(false)
+    , m_segmentStart(0)
+    , m_segmentStop(GST_CLOCK_TIME_NONE)
+    , m_destination(0)
+    , m_destinationStart(0)
+    , m_destinationEnd(0)
+    , m_destinationOffset(0)
+    , m_sharedOutput(0)
+    , m_hasCompactStorage(false)
+    , m_compactFormat(CompactFloat16)
+    , m_inputFd(-1)
+    , m_collectsBuffers(true)
+    , m_hasDeadlines(false)
+    , m_phase(PhasePrerolling)
+    , m_phaseStartTime(0)
+    , m_lastBufferTime(0)
+    , m_hasQueueLimits(false)
+    , m_hasResampler(false)
+    , m_resamplerQuality(ResamplerMedium)
+    , m_decodedRate(0)
+    , m_hasLoudnessMeasurement(false)
+    , m_hasOnsetDetection(false)
+    , m_audioTrack(0)
+    , m_audioTracksSeen(0)
     , m_errorOccurred(false)
+    , m_paused(false)
+    , m_readyToPlay(false)
+    , m_playStateRequests(0)
+    , m_applyingPlayState(false)
+    , m_cancelRequested(false)
+    , m_finished(false)
 {
 }
 
 AudioStreamChannelsReader::AudioStreamChannelsReader(const void* data, size_t dataSize)
     : m_data(data)
     , m_dataSize(dataSize)
-    , m_filePath(0)
+    , m_sampleRate(0)
+    , m_mixToMono(false)
     , m_channelSize(0)
+    , m_hasSegment(false)
+    , m_segmentStart(0)
+    , m_segmentStop(GST_CLOCK_TIME_NONE)
+    , m_destination(0)
+    , m_destinationStart(0)
+    , m_destinationEnd(0)
+    , m_destinationOffset(0)
+    , m_sharedOutput(0)
+    , m_hasCompactStorage(false)
+    , m_compactFormat(CompactFloat16)
+    , m_inputFd(-1)
+    , m_collectsBuffers(true)
+    , m_hasDeadlines(false)
+    , m_phase(PhasePrerolling)
+    , m_phaseStartTime(0)
+    , m_lastBufferTime(0)
+    , m_hasQueueLimits(false)
+    , m_hasResampler(false)
+    , m_resamplerQuality(ResamplerMedium)
+    , m_decodedRate(0)
+    , m_hasLoudnessMeasurement(false)
+    , m_hasOnsetDetection(false)
+    , m_audioTrack(0)
+    , m_audioTracksSeen(0)
     , m_errorOccurred(false)
+    , m_paused(false)
+    , m_readyToPlay(false)
+    , m_playStateRequests(0)
+    , m_applyingPlayState(false)
+    , m_cancelRequested(false)
+    , m_finished(false)
 {
 }
 
 AudioStreamChannelsReader::~AudioStreamChannelsReader()
 {
-    if (m_pipeline) {
-        GRefPtr<GstBus> bus = webkitGstPipelineGetBus(GST_PIPELINE(m_pipeline));
-        ASSERT(bus);
-        g_signal_handlers_disconnect_by_func(bus.get(), reinterpret_cast<gpointer>(messageCallback), this);
-        gst_bus_remove_signal_watch(bus.get());
+    if (m_startSource)
+        g_source_destroy(m_startSource.get());
+    {
+        // Streaming threads run until the pipeline goes to NULL below,
+        // and cancel() from one of them must not attach a new source.
+        std::lock_guard<std::mutex> lock(m_cancelMutex);
+        m_cancelRequested = true;
+        if (m_cancelSource)
+            g_source_destroy(m_cancelSource.get());
+    }
+    if (m_seekSource)
+        g_source_destroy(m_seekSource.get());
+    if (m_completionSource)
+        g_source_destroy(m_completionSource.get());
+    if (m_watchdogSource)
+        g_source_destroy(m_watchdogSource.get());
+    if (m_busWatch)
+        g_source_destroy(m_busWatch.get());
+
+    if (m_sharedOutput && !m_finished)
+        m_sharedOutput->close(true);
 
-        gst_element_set_state(m_pipeline, GST_STATE_NULL);
-        gst_object_unref(GST_OBJECT(m_pipeline));
+    if (m_pipeline) {
+        gst_element_set_state(m_pipeline.get(), GST_STATE_NULL);
+        m_pipeline.clear();
     }
 
     if (m_decodebin) {
         g_signal_handlers_disconnect_by_func(m_decodebin.get(), reinterpret_cast<gpointer>(onGStreamerDecodebinPadAddedCallback), this);
+        g_signal_handlers_disconnect_by_func(m_decodebin.get(), reinterpret_cast<gpointer>(onGStreamerDecodebinNoMorePadsCallback), this);
+        g_signal_handlers_disconnect_by_func(m_decodebin.get(), reinterpret_cast<gpointer>(onGStreamerDecodebinAutoplugContinueCallback), this);
         m_decodebin.clear();
     }
 
@@ -214,65 +435,122 @@ AudioStreamChannelsReader::~AudioStreamChannelsReader()
     }
 
 #ifndef GST_API_VERSION_1
-    gst_buffer_list_iterator_free(m_frontLeftBuffersIterator);
-    gst_buffer_list_iterator_free(m_frontRightBuffersIterator);
+    if (m_frontLeftBuffers) {
+        gst_buffer_list_iterator_free(m_frontLeftBuffersIterator);
+        gst_buffer_list_iterator_free(m_frontRightBuffersIterator);
+    }
 #endif
-    gst_buffer_list_unref(m_frontLeftBuffers);
-    gst_buffer_list_unref(m_frontRightBuffers);
 }
 
 #ifdef GST_API_VERSION_1
 GstFlowReturn AudioStreamChannelsReader::handleSample(GstAppSink* sink)
 {
-    GstSample* sample = gst_app_sink_pull_sample(sink);
+    GRefPtr<GstSample> sample = adoptGRef(gst_app_sink_pull_sample(sink));
     if (!sample)
         return GST_FLOW_ERROR;
 
-    GstBuffer* buffer = gst_sample_get_buffer(sample);
-    if (!buffer) {
-        gst_sample_unref(sample);
+    // Both are owned by the sample, only the buffers we keep get an
+    // extra reference.
+    GstBuffer* buffer = gst_sample_get_buffer(sample.get());
+    if (!buffer)
         return GST_FLOW_ERROR;
-    }
 
-    GstCaps* caps = gst_sample_get_caps(sample);
-    if (!caps) {
-        gst_sample_unref(sample);
+    GstCaps* caps = gst_sample_get_caps(sample.get());
+    if (!caps)
         return GST_FLOW_ERROR;
-    }
+
+    didReceiveBuffer();
 
     GstAudioInfo info;
     gst_audio_info_from_caps(&info, caps);
-    int frames = GST_CLOCK_TIME_TO_FRAMES(GST_BUFFER_DURATION(buffer), GST_AUDIO_INFO_RATE(&info));
+    // Count frames from the payload rather than from the buffer
+    // duration so the final copy never runs past the channel.
+    int frames = gst_buffer_get_size(buffer) / GST_AUDIO_INFO_BPF(&info);
+    m_decodedRate = GST_AUDIO_INFO_RATE(&info);
+
+    // The ring carries the rate of what is written to it, which is only
+    // known once negotiated.
+    if (m_sharedOutput && !m_sharedOutput->setSampleRate(GST_AUDIO_INFO_RATE(&info)))
+        return GST_FLOW_NOT_NEGOTIATED;
+
+    if (m_sampleObserver || m_onsetDetector || m_stereoCorrelator || m_sharedOutput || m_compactBus) {
+        GstMapInfo map;
+        if (gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+            unsigned channel = GST_AUDIO_INFO_POSITION(&info, 0) == GST_AUDIO_CHANNEL_POSITION_FRONT_RIGHT ? 1 : 0;
+            const float* samples = reinterpret_cast<const float*>(map.data);
+            if (m_onsetDetector)
+                m_onsetDetector->process(channel, samples, frames, GST_AUDIO_INFO_RATE(&info), GST_BUFFER_PTS(buffer));
+            if (m_stereoCorrelator)
+                m_stereoCorrelator->process(channel, samples, frames, GST_AUDIO_INFO_RATE(&info), GST_BUFFER_PTS(buffer));
+            if (m_sampleObserver)
+                m_sampleObserver(channel, samples, frames, GST_BUFFER_PTS(buffer));
+            if (m_sharedOutput)
+                m_sharedOutput->writeChannel(channel, samples, frames);
+            if (m_compactBus && channel < m_compactBus->numberOfChannels())
+                m_compactBus->append(channel, samples, frames);
+            gst_buffer_unmap(buffer, &map);
+        }
+    }
 
     // Check the first audio channel. The buffer is supposed to store
     // data of a single channel anyway.
     switch (GST_AUDIO_INFO_POSITION(&info, 0)) {
+    case GST_AUDIO_CHANNEL_POSITION_MONO:
     case GST_AUDIO_CHANNEL_POSITION_FRONT_LEFT:
-        gst_buffer_list_add(m_frontLeftBuffers, gst_buffer_ref(buffer));
+        m_queueStates[0].framesConsumed += frames;
+        if (!collectsBuffers())
+            break;
+        if (m_destination) {
+            copyBufferToDestination(buffer, 0, GST_AUDIO_INFO_RATE(&info));
+            break;
+        }
+        gst_buffer_list_add(m_frontLeftBuffers.get(), gst_buffer_ref(buffer));
         m_channelSize += frames;
         break;
     case GST_AUDIO_CHANNEL_POSITION_FRONT_RIGHT:
-        gst_buffer_list_add(m_frontRightBuffers, gst_buffer_ref(buffer));
+        m_queueStates[1].framesConsumed += frames;
+        if (!collectsBuffers())
+            break;
+        if (m_destination) {
+            copyBufferToDestination(buffer, 1, GST_AUDIO_INFO_RATE(&info));
+            break;
+        }
+        gst_buffer_list_add(m_frontRightBuffers.get(), gst_buffer_ref(buffer));
         break;
     default:
         break;
     }
 
-    gst_sample_unref(sample);
     return GST_FLOW_OK;
 
 }
+
+void AudioStreamChannelsReader::copyBufferToDestination(GstBuffer* buffer, unsigned channelIndex, int rate)
+{
+    if (channelIndex >= m_destination->numberOfChannels() || !GST_BUFFER_PTS_IS_VALID(buffer))
+        return;
+
+    // Samples are placed by timestamp, and everything outside the
+    // destination range (the overlap around a segment) is dropped.
+    guint64 firstFrame = gst_util_uint64_scale_round(GST_BUFFER_PTS(buffer), rate, GST_SECOND);
+    guint64 frameCount = gst_buffer_get_size(buffer) / sizeof(float);
+    guint64 begin = std::max(firstFrame, m_destinationStart);
+    guint64 end = std::min(firstFrame + frameCount, std::min<guint64>(m_destinationEnd, m_destinationOffset + m_destination->length()));
+    if (begin >= end)
+        return;
+
+    float* destination = m_destination->channel(channelIndex)->mutableData() + (begin - m_destinationOffset);
+    gst_buffer_extract(buffer, (begin - firstFrame) * sizeof(float), destination, (end - begin) * sizeof(float));
+}
 #endif
 
 #ifndef GST_API_VERSION_1
 GstFlowReturn AudioStreamChannelsReader::handleBuffer(GstAppSink* sink)
 {
-    static int leftBuffersCount = 0;
-    static int rightBuffersCount = 0;
-
     GstBuffer* buffer = gst_app_sink_pull_buffer(sink);
     if (!buffer)
         return GST_FLOW_ERROR;
+    didReceiveBuffer();
 
     GstCaps* caps = gst_buffer_get_caps(buffer);
     GstStructure* structure = gst_caps_get_structure(caps, 0);
@@ -298,21 +576,52 @@ GstFlowReturn AudioStreamChannelsReader::handleBuffer(GstAppSink* sink)
         return GST_FLOW_ERROR;
     }
 
+    m_decodedRate = sampleRate;
+    if (m_sharedOutput && !m_sharedOutput->setSampleRate(sampleRate)) {
+        gst_caps_unref(caps);
+        gst_buffer_unref(buffer);
+        return GST_FLOW_NOT_NEGOTIATED;
+    }
+
     GstClockTime duration = (static_cast<guint64>(GST_BUFFER_SIZE(buffer)) * 8 * GST_SECOND) / (sampleRate * channels * width);
     int frames = GST_CLOCK_TIME_TO_FRAMES(duration, sampleRate);
 
     // Check the first audio channel. The buffer is supposed to store
     // data of a single channel anyway.
     GstAudioChannelPosition* positions = gst_audio_get_channel_positions(structure);
+    unsigned channel = positions[0] == GST_AUDIO_CHANNEL_POSITION_FRONT_RIGHT ? 1 : 0;
+    if (m_sampleObserver || m_onsetDetector || m_stereoCorrelator || m_sharedOutput || m_compactBus) {
+        const float* samples = reinterpret_cast<const float*>(GST_BUFFER_DATA(buffer));
+        if (m_onsetDetector)
+            m_onsetDetector->process(channel, samples, frames, sampleRate, GST_BUFFER_TIMESTAMP(buffer));
+        if (m_stereoCorrelator)
+            m_stereoCorrelator->process(channel, samples, frames, sampleRate, GST_BUFFER_TIMESTAMP(buffer));
+        if (m_sampleObserver)
+            m_sampleObserver(channel, samples, frames, GST_BUFFER_TIMESTAMP(buffer));
+        if (m_sharedOutput)
+            m_sharedOutput->writeChannel(channel, samples, frames);
+        if (m_compactBus && channel < m_compactBus->numberOfChannels())
+            m_compactBus->append(channel, samples, frames);
+    }
+
+    if (!collectsBuffers()) {
+        m_queueStates[channel].framesConsumed += frames;
+        g_free(positions);
+        gst_caps_unref(caps);
+        gst_buffer_unref(buffer);
+        return GST_FLOW_OK;
+    }
+
     switch (positions[0]) {
+    case GST_AUDIO_CHANNEL_POSITION_FRONT_MONO:
     case GST_AUDIO_CHANNEL_POSITION_FRONT_LEFT:
-        printf("buffer %d [LEFT]  - rate: %d - size %d\n", ++leftBuffersCount, sampleRate, GST_BUFFER_SIZE(buffer));
         gst_buffer_list_iterator_add(m_frontLeftBuffersIterator, buffer);
         m_channelSize += frames;
+        m_queueStates[0].framesConsumed += frames;
         break;
     case GST_AUDIO_CHANNEL_POSITION_FRONT_RIGHT:
-        printf("buffer %d [RIGHT] - rate: %d - size %d\n", ++rightBuffersCount, sampleRate, GST_BUFFER_SIZE(buffer));
         gst_buffer_list_iterator_add(m_frontRightBuffersIterator, buffer);
+        m_queueStates[1].framesConsumed += frames;
         break;
     default:
         gst_buffer_unref(buffer);
@@ -325,6 +634,101 @@ GstFlowReturn AudioStreamChannelsReader::handleBuffer(GstAppSink* sink)
 }
 #endif
 
+// BS.1770 channel weights: the surrounds count for +1.5 dB and the LFE
+// channels are left out of the loudness, but not of the peaks.
+static float loudnessWeight(GstAudioChannelPosition position)
+{
+    switch (position) {
+    case GST_AUDIO_CHANNEL_POSITION_REAR_LEFT:
+    case GST_AUDIO_CHANNEL_POSITION_REAR_RIGHT:
+    case GST_AUDIO_CHANNEL_POSITION_SIDE_LEFT:
+    case GST_AUDIO_CHANNEL_POSITION_SIDE_RIGHT:
+        return 1.41;
+#ifdef GST_API_VERSION_1
+    case GST_AUDIO_CHANNEL_POSITION_LFE1:
+    case GST_AUDIO_CHANNEL_POSITION_LFE2:
+#else
+    case GST_AUDIO_CHANNEL_POSITION_LFE:
+#endif
+        return 0;
+    default:
+        return 1;
+    }
+}
+
+GstFlowReturn AudioStreamChannelsReader::handleLoudnessSample(GstAppSink* sink)
+{
+#ifdef GST_API_VERSION_1
+    GRefPtr<GstSample> sample = adoptGRef(gst_app_sink_pull_sample(sink));
+    if (!sample)
+        return GST_FLOW_ERROR;
+    GstBuffer* buffer = gst_sample_get_buffer(sample.get());
+    GstCaps* caps = gst_sample_get_caps(sample.get());
+    if (!buffer || !caps)
+        return GST_FLOW_ERROR;
+
+    GstAudioInfo info;
+    if (!gst_audio_info_from_caps(&info, caps))
+        return GST_FLOW_ERROR;
+    unsigned channels = GST_AUDIO_INFO_CHANNELS(&info);
+    unsigned rate = GST_AUDIO_INFO_RATE(&info);
+
+    // The meter is sized and weighted on the first buffer, after the
+    // source's own layout.
+    if (!m_loudnessMeter) {
+        std::vector<float> weights(channels);
+        for (unsigned i = 0; i < channels; ++i)
+            weights[i] = loudnessWeight(GST_AUDIO_INFO_POSITION(&info, i));
+        m_loudnessMeter.reset(new LoudnessMeter(weights));
+    }
+
+    GstMapInfo map;
+    if (!gst_buffer_map(buffer, &map, GST_MAP_READ))
+        return GST_FLOW_ERROR;
+    const float* data = reinterpret_cast<const float*>(map.data);
+    size_t frames = map.size / (channels * sizeof(float));
+#else
+    GRefPtr<GstBuffer> buffer = adoptGRef(gst_app_sink_pull_buffer(sink));
+    if (!buffer)
+        return GST_FLOW_ERROR;
+    GRefPtr<GstCaps> caps = adoptGRef(gst_buffer_get_caps(buffer.get()));
+    if (!caps)
+        return GST_FLOW_ERROR;
+
+    GstStructure* structure = gst_caps_get_structure(caps.get(), 0);
+    gint channels = 0;
+    gint rate = 0;
+    if (!gst_structure_get_int(structure, "channels", &channels) || !channels
+        || !gst_structure_get_int(structure, "rate", &rate) || !rate)
+        return GST_FLOW_ERROR;
+
+    if (!m_loudnessMeter) {
+        std::vector<float> weights(channels, 1);
+        if (GstAudioChannelPosition* positions = gst_audio_get_channel_positions(structure)) {
+            for (gint i = 0; i < channels; ++i)
+                weights[i] = loudnessWeight(positions[i]);
+            g_free(positions);
+        }
+        m_loudnessMeter.reset(new LoudnessMeter(weights));
+    }
+
+    const float* data = reinterpret_cast<const float*>(GST_BUFFER_DATA(buffer.get()));
+    size_t frames = GST_BUFFER_SIZE(buffer.get()) / (channels * sizeof(float));
+#endif
+
+    m_loudnessScratch.resize(frames);
+    for (unsigned channel = 0; channel < static_cast<unsigned>(channels); ++channel) {
+        for (size_t frame = 0; frame < frames; ++frame)
+            m_loudnessScratch[frame] = data[frame * channels + channel];
+        m_loudnessMeter->process(channel, m_loudnessScratch.data(), frames, rate);
+    }
+
+#ifdef GST_API_VERSION_1
+    gst_buffer_unmap(buffer, &map);
+#endif
+    return GST_FLOW_OK;
+}
+
 gboolean AudioStreamChannelsReader::handleMessage(GstMessage* message)
 {
     GOwnPtr<GError> error;
@@ -332,7 +736,7 @@ gboolean AudioStreamChannelsReader::handleMessage(GstMessage* message)
 
     switch (GST_MESSAGE_TYPE(message)) {
     case GST_MESSAGE_EOS:
-        g_main_loop_quit(m_loop.get());
+        didFinishDecoding(0);
         break;
     case GST_MESSAGE_WARNING:
         gst_message_parse_warning(message, &error.outPtr(), &debug.outPtr());
@@ -342,12 +746,12 @@ gboolean AudioStreamChannelsReader::handleMessage(GstMessage* message)
         gst_message_parse_error(message, &error.outPtr(), &debug.outPtr());
         g_warning("Error: %d, %s. Debug output: %s", error->code,  error->message, debug.get());
         m_errorOccurred = true;
-        g_main_loop_quit(m_loop.get());
+        didFinishDecoding(error.get());
         break;
     case GST_MESSAGE_STATE_CHANGED:
         GstState old_state, new_state;
         gst_message_parse_state_changed (message, &old_state, &new_state, NULL);
-        g_print ("Element %s changed state from %s to %s.\n",
+        g_debug("Element %s changed state from %s to %s",
            GST_OBJECT_NAME (message->src),
            gst_element_state_get_name (old_state),
            gst_element_state_get_name (new_state));
@@ -356,7 +760,7 @@ gboolean AudioStreamChannelsReader::handleMessage(GstMessage* message)
         GstStreamStatusType status;
         GstElement *owner;
         gst_message_parse_stream_status(message, &status, &owner);
-        g_print ("Element %s(%s) changed stream status to %d.\n",
+        g_debug("Element %s(%s) changed stream status to %d",
            GST_OBJECT_NAME (owner),
            GST_OBJECT_NAME (message->src), status);
         break;
@@ -373,8 +777,8 @@ void AudioStreamChannelsReader::handleNewDeinterleavePad(GstPad* pad)
     // in an appsink so we can pull the data from each
     // channel. Pipeline looks like:
     // ... deinterleave ! queue ! appsink.
-    GstElement* queue = gst_element_factory_make("queue", 0);
-    GstElement* sink = gst_element_factory_make("appsink", 0);
+    GstElement* queue = makeGStreamerElement("queue", 0);
+    GstElement* sink = makeGStreamerElement("appsink", 0);
 
     GstAppSinkCallbacks callbacks;
     callbacks.eos = 0;
@@ -388,60 +792,341 @@ void AudioStreamChannelsReader::handleNewDeinterleavePad(GstPad* pad)
     gst_app_sink_set_callbacks(GST_APP_SINK(sink), &callbacks, this, 0);
 
     g_object_set(sink, "sync", FALSE, NULL);
+    if (m_hasQueueLimits)
+        applyQueueLimits(queue, sink);
+
+    gst_bin_add_many(GST_BIN(m_pipeline.get()), queue, sink, NULL);
 
-    gst_bin_add_many(GST_BIN(m_pipeline), queue, sink, NULL);
+    GRefPtr<GstPad> sinkPad = adoptGRef(gst_element_get_static_pad(queue, "sink"));
+    gst_pad_link_full(pad, sinkPad.get(), GST_PAD_LINK_CHECK_NOTHING);
 
-    GstPad* sinkPad = gst_element_get_static_pad(queue, "sink");
-    gst_pad_link_full(pad, sinkPad, GST_PAD_LINK_CHECK_NOTHING);
-    gst_object_unref(GST_OBJECT(sinkPad));
+    // deinterleave names its pads after the channel index.
+    GOwnPtr<gchar> padName(gst_pad_get_name(pad));
+    unsigned channelIndex = 0;
+    if (sscanf(padName.get(), "src_%u", &channelIndex) == 1 && channelIndex < G_N_ELEMENTS(m_queueStates) && !m_queueStates[channelIndex].ready) {
+        m_queueStates[channelIndex].queue = queue;
+        m_queueStates[channelIndex].ready.store(true, std::memory_order_release);
+#ifdef GST_API_VERSION_1
+        gst_pad_add_probe(sinkPad.get(), GST_PAD_PROBE_TYPE_BUFFER, countQueuedFramesProbe, &m_queueStates[channelIndex], 0);
+#endif
+    }
 
     gst_element_link_pads_full(queue, "src", sink, "sink", GST_PAD_LINK_CHECK_NOTHING);
 
+    if (m_hasSegment) {
+        // The seek to the segment happens while prerolling, so the
+        // branch has to be able to preroll too.
+        gst_element_sync_state_with_parent(queue);
+        gst_element_sync_state_with_parent(sink);
+        return;
+    }
+
     gst_element_set_state(queue, GST_STATE_READY);
     gst_element_set_state(sink, GST_STATE_READY);
 }
 
+void AudioStreamChannelsReader::applyQueueLimits(GstElement* queue, GstElement* sink)
+{
+    // leaky: 0 blocks upstream, 1 drops incoming buffers, 2 drops the
+    // oldest queued ones.
+    int leaky = 0;
+    switch (m_queueLimits.policy) {
+    case AudioQueueLimits::BlockProducer:
+        leaky = 0;
+        break;
+    case AudioQueueLimits::DropNewest:
+        leaky = 1;
+        break;
+    case AudioQueueLimits::DropOldest:
+        leaky = 2;
+        break;
+    }
+
+    g_object_set(queue, "max-size-buffers", 0, "max-size-bytes", m_queueLimits.maxBytes,
+        "max-size-time", m_queueLimits.maxTime, "leaky", leaky, NULL);
+
+    // The callbacks drain appsink right away, its own queue only grows
+    // if they can't keep up.
+    g_object_set(sink, "max-buffers", 1, "drop", m_queueLimits.policy != AudioQueueLimits::BlockProducer, NULL);
+}
+
+bool AudioStreamChannelsReader::queueStats(unsigned channel, AudioChannelQueueStats& stats) const
+{
+    if (channel >= G_N_ELEMENTS(m_queueStates) || !m_queueStates[channel].ready.load(std::memory_order_acquire))
+        return false;
+
+    const ChannelQueueState& state = m_queueStates[channel];
+    guint currentLevelBytes = 0;
+    guint64 currentLevelTime = 0;
+    g_object_get(state.queue.get(), "current-level-bytes", &currentLevelBytes, "current-level-time", &currentLevelTime, NULL);
+
+    stats.framesQueued = state.framesQueued;
+    stats.framesConsumed = state.framesConsumed;
+    stats.currentLevelBytes = currentLevelBytes;
+    stats.currentLevelTime = currentLevelTime;
+
+    // Whatever entered the queue and is neither still in there nor
+    // was consumed got dropped by a leaky queue.
+    guint64 accountedFrames = stats.framesConsumed + currentLevelBytes / sizeof(float);
+    stats.framesDropped = stats.framesQueued > accountedFrames ? stats.framesQueued - accountedFrames : 0;
+    return true;
+}
+
 void AudioStreamChannelsReader::deinterleavePadsConfigured()
 {
+    enterPhase(PhaseWaitingForData);
+
+    if (m_hasSegment) {
+        // We're in a streaming thread, seeking from here would
+        // deadlock. Let the reader's context seek and start playback.
+        m_seekSource = adoptGRef(g_idle_source_new());
+        g_source_set_callback(m_seekSource.get(), seekToSegmentCallback, this, 0);
+        g_source_attach(m_seekSource.get(), m_context.get());
+        return;
+    }
+
     // All deinterleave src pads are now available, let's roll to
     // PLAYING so data flows towards the sinks and it can be retrieved.
-    gst_element_set_state(m_pipeline, GST_STATE_PLAYING);
+    {
+        std::lock_guard<std::mutex> lock(m_playStateMutex);
+        m_readyToPlay = true;
+    }
+    updatePlayState();
+}
+
+void AudioStreamChannelsReader::seekToSegment()
+{
+    m_seekSource.clear();
+    if (m_finished)
+        return;
+
+    GstSeekType stopType = GST_CLOCK_TIME_IS_VALID(m_segmentStop) ? GST_SEEK_TYPE_SET : GST_SEEK_TYPE_NONE;
+    GstSeekFlags flags = static_cast<GstSeekFlags>(GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_ACCURATE);
+    if (!gst_element_seek(m_pipeline.get(), 1.0, GST_FORMAT_TIME, flags, GST_SEEK_TYPE_SET, m_segmentStart, stopType, m_segmentStop)) {
+        GOwnPtr<GError> error(g_error_new_literal(GST_STREAM_ERROR, GST_STREAM_ERROR_FAILED, "Seeking to the segment failed"));
+        didFinishDecoding(error.get());
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_playStateMutex);
+        m_readyToPlay = true;
+    }
+    updatePlayState();
+}
+
+void AudioStreamChannelsReader::handleNewDecodedPad(GstPad* pad)
+{
+    // Left undecoded by autoplug-continue, and unlinked: the demuxer
+    // keeps going as long as the audio pad is linked.
+    if (!isAudioPad(pad))
+        return;
+
+    unsigned track = m_audioTracksSeen++;
+    if (track == m_audioTrack) {
+        plugDeinterleave(pad);
+        return;
+    }
+
+    if (GstElement* tee = plugTrackOutputs(pad, track))
+        gst_element_sync_state_with_parent(tee);
+    else
+        plugFakeSink(pad);
+}
+
+void AudioStreamChannelsReader::decodedPadsComplete()
+{
+    if (m_deInterleave)
+        return;
+
+    // Raised through the bus, the pipeline can't be torn down from the
+    // streaming thread we are on.
+    GOwnPtr<GError> error(g_error_new(AUDIO_READER_ERROR, AudioReaderErrorNoSuchTrack,
+        "Audio track %u requested but the stream has %u", m_audioTrack, m_audioTracksSeen));
+    gst_element_post_message(m_pipeline.get(), gst_message_new_error(GST_OBJECT(m_decodebin.get()), error.get(), 0));
+}
+
+// Tees pad into every additional output fed by track. Returns the tee,
+// still to be synced with the pipeline, or 0 when no output wants track.
+GstElement* AudioStreamChannelsReader::plugTrackOutputs(GstPad* pad, unsigned track)
+{
+    GstElement* tee = 0;
+    for (auto& output : m_additionalOutputs) {
+        bool wanted = output->track == static_cast<int>(track) || (output->track == AdditionalOutput::mainTrack && track == m_audioTrack);
+        if (!wanted)
+            continue;
+
+        if (!tee)
+            tee = plugTee(pad);
+        plugAdditionalOutput(tee, output.get());
+    }
+    return tee;
+}
+
+GstElement* AudioStreamChannelsReader::plugTee(GstPad* pad)
+{
+    GstElement* tee = makeGStreamerElement("tee", 0);
+    gst_bin_add(GST_BIN(m_pipeline.get()), tee);
+    GRefPtr<GstPad> teeSinkPad = adoptGRef(gst_element_get_static_pad(tee, "sink"));
+    gst_pad_link_full(pad, teeSinkPad.get(), GST_PAD_LINK_CHECK_NOTHING);
+    return tee;
+}
+
+void AudioStreamChannelsReader::plugLoudnessBranch(GstElement* tee)
+{
+    // The meter sees the decoded channels as they are, before the up or
+    // downmix of the main branch:
+    // ... tee ! queue ! audioconvert ! capsfilter ! appsink
+    GstElement* queue = makeGStreamerElement("queue", 0);
+    GstElement* audioConvert = makeGStreamerElement("audioconvert", 0);
+    GstElement* capsFilter = makeGStreamerElement("capsfilter", 0);
+    GstElement* sink = makeGStreamerElement("appsink", 0);
+
+    // Only the sample format is converted.
+    GstCaps* caps = getGstAudioCaps(1, m_sampleRate);
+    gst_structure_remove_fields(gst_caps_get_structure(caps, 0), "rate", "channels", NULL);
+    g_object_set(capsFilter, "caps", caps, NULL);
+    gst_caps_unref(caps);
+
+    GstAppSinkCallbacks callbacks;
+    memset(&callbacks, 0, sizeof(callbacks));
+#ifdef GST_API_VERSION_1
+    callbacks.new_sample = onLoudnessPullRequiredCallback;
+#else
+    callbacks.new_buffer = onLoudnessPullRequiredCallback;
+#endif
+    gst_app_sink_set_callbacks(GST_APP_SINK(sink), &callbacks, this, 0);
+    g_object_set(sink, "sync", FALSE, NULL);
+
+    gst_bin_add_many(GST_BIN(m_pipeline.get()), queue, audioConvert, capsFilter, sink, NULL);
+    gst_element_link(tee, queue);
+    gst_element_link_pads_full(queue, "src", audioConvert, "sink", GST_PAD_LINK_CHECK_NOTHING);
+    gst_element_link_pads_full(audioConvert, "src", capsFilter, "sink", GST_PAD_LINK_CHECK_NOTHING);
+    gst_element_link_pads_full(capsFilter, "src", sink, "sink", GST_PAD_LINK_CHECK_NOTHING);
+
+    gst_element_sync_state_with_parent(queue);
+    gst_element_sync_state_with_parent(audioConvert);
+    gst_element_sync_state_with_parent(capsFilter);
+    gst_element_sync_state_with_parent(sink);
+}
+
+void AudioStreamChannelsReader::plugFakeSink(GstPad* pad)
+{
+    // Audio tracks nobody asked for. decodebin can't tell them from the
+    // selected one, so they come out decoded and are dropped here.
+    GstElement* sink = makeGStreamerElement("fakesink", 0);
+    g_object_set(sink, "sync", FALSE, "async", FALSE, NULL);
+    gst_bin_add(GST_BIN(m_pipeline.get()), sink);
+
+    GRefPtr<GstPad> sinkPad = adoptGRef(gst_element_get_static_pad(sink, "sink"));
+    gst_pad_link_full(pad, sinkPad.get(), GST_PAD_LINK_CHECK_NOTHING);
+    gst_element_sync_state_with_parent(sink);
 }
 
 void AudioStreamChannelsReader::plugDeinterleave(GstPad* pad)
 {
-    printf("Pluging deinterleave...");
+    // With additional outputs or loudness measurement the decoded
+    // stream is split first:
+    // ... decodebin2 ! tee ! queue ! (main branch below)
+    //                      \
+    //                       `queue ! audioconvert ! audioresample ! capsfilter ! appsink
+    GRefPtr<GstPad> branchPad = pad;
+    GstElement* tee = plugTrackOutputs(pad, m_audioTrack);
+    if (m_hasLoudnessMeasurement) {
+        if (!tee)
+            tee = plugTee(pad);
+        plugLoudnessBranch(tee);
+    }
+    if (tee) {
+        GstElement* queue = makeGStreamerElement("queue", 0);
+        gst_bin_add(GST_BIN(m_pipeline.get()), queue);
+        gst_element_link(tee, queue);
+
+        gst_element_sync_state_with_parent(tee);
+        gst_element_sync_state_with_parent(queue);
+        branchPad = adoptGRef(gst_element_get_static_pad(queue, "src"));
+    }
 
     // A decodebin pad was added, plug in a deinterleave element to
     // separate each planar channel. Sub pipeline looks like
     // ... decodebin2 ! audioconvert ! audioresample ! capsfilter ! deinterleave.
-    GstElement* audioConvert  = gst_element_factory_make("audioconvert", 0);
-    GstElement* audioResample = gst_element_factory_make("audioresample", 0);
-    GstElement* capsFilter = gst_element_factory_make("capsfilter", 0);
-    m_deInterleave = gst_element_factory_make("deinterleave", "deinterleave");
+    GstElement* audioConvert  = makeGStreamerElement("audioconvert", 0);
+    GstElement* capsFilter = makeGStreamerElement("capsfilter", 0);
+    m_deInterleave = makeGStreamerElement("deinterleave", "deinterleave");
 
     g_object_set(m_deInterleave.get(), "keep-positions", TRUE, NULL);
     g_signal_connect(m_deInterleave.get(), "pad-added", G_CALLBACK(onGStreamerDeinterleavePadAddedCallback), this);
     g_signal_connect(m_deInterleave.get(), "no-more-pads", G_CALLBACK(onGStreamerDeinterleaveReadyCallback), this);
 
-    GstCaps* caps = getGstAudioCaps(2, m_sampleRate);
+    // With the in-process resampler the stream stays at its native
+    // rate until takeDecodedBus().
+    bool resampleInPipeline = !usesInProcessResampler();
+    // Mono is downmixed by audioconvert, like in the additional
+    // outputs, so every branch yields the same samples.
+    GstCaps* caps = getGstAudioCaps(m_mixToMono ? 1 : 2, m_sampleRate);
+    if (!resampleInPipeline)
+        gst_structure_remove_field(gst_caps_get_structure(caps, 0), "rate");
     g_object_set(capsFilter, "caps", caps, NULL);
     gst_caps_unref(caps);
 
-    gst_bin_add_many(GST_BIN(m_pipeline), audioConvert, audioResample, capsFilter, m_deInterleave.get(), NULL);
+    gst_bin_add_many(GST_BIN(m_pipeline.get()), audioConvert, capsFilter, m_deInterleave.get(), NULL);
 
-    GstPad* sinkPad = gst_element_get_static_pad(audioConvert, "sink");
-    gst_pad_link_full(pad, sinkPad, GST_PAD_LINK_CHECK_NOTHING);
-    gst_object_unref(GST_OBJECT(sinkPad));
+    GRefPtr<GstPad> sinkPad = adoptGRef(gst_element_get_static_pad(audioConvert, "sink"));
+    gst_pad_link_full(branchPad.get(), sinkPad.get(), GST_PAD_LINK_CHECK_NOTHING);
+
+    GstElement* audioResample = 0;
+    if (resampleInPipeline) {
+        audioResample = makeGStreamerElement("audioresample", 0);
+        gst_bin_add(GST_BIN(m_pipeline.get()), audioResample);
+        gst_element_link_pads_full(audioConvert, "src", audioResample, "sink", GST_PAD_LINK_CHECK_NOTHING);
+        gst_element_link_pads_full(audioResample, "src", capsFilter, "sink", GST_PAD_LINK_CHECK_NOTHING);
+    } else
+        gst_element_link_pads_full(audioConvert, "src", capsFilter, "sink", GST_PAD_LINK_CHECK_NOTHING);
+    gst_element_link_pads_full(capsFilter, "src", m_deInterleave.get(), "sink", GST_PAD_LINK_CHECK_NOTHING);
+
+    gst_element_sync_state_with_parent(audioConvert);
+    if (audioResample)
+        gst_element_sync_state_with_parent(audioResample);
+    gst_element_sync_state_with_parent(capsFilter);
+    gst_element_sync_state_with_parent(m_deInterleave.get());
+}
+
+void AudioStreamChannelsReader::plugAdditionalOutput(GstElement* tee, AdditionalOutput* output)
+{
+    // Additional outputs are pulled interleaved and only split into
+    // planar channels once decoding is done, no deinterleave needed.
+    GstElement* queue = makeGStreamerElement("queue", 0);
+    GstElement* audioConvert = makeGStreamerElement("audioconvert", 0);
+    GstElement* audioResample = makeGStreamerElement("audioresample", 0);
+    GstElement* capsFilter = makeGStreamerElement("capsfilter", 0);
+    GstElement* sink = makeGStreamerElement("appsink", 0);
+
+    GstCaps* caps = getGstAudioCaps(output->spec.mixToMono ? 1 : 2, output->spec.sampleRate);
+    g_object_set(capsFilter, "caps", caps, NULL);
+    gst_caps_unref(caps);
 
+    GstAppSinkCallbacks callbacks;
+    memset(&callbacks, 0, sizeof(callbacks));
+#ifdef GST_API_VERSION_1
+    callbacks.new_sample = onAdditionalOutputPullRequiredCallback;
+#else
+    callbacks.new_buffer = onAdditionalOutputPullRequiredCallback;
+#endif
+    gst_app_sink_set_callbacks(GST_APP_SINK(sink), &callbacks, output, 0);
+    g_object_set(sink, "sync", FALSE, NULL);
+
+    gst_bin_add_many(GST_BIN(m_pipeline.get()), queue, audioConvert, audioResample, capsFilter, sink, NULL);
+    gst_element_link(tee, queue);
+    gst_element_link_pads_full(queue, "src", audioConvert, "sink", GST_PAD_LINK_CHECK_NOTHING);
     gst_element_link_pads_full(audioConvert, "src", audioResample, "sink", GST_PAD_LINK_CHECK_NOTHING);
     gst_element_link_pads_full(audioResample, "src", capsFilter, "sink", GST_PAD_LINK_CHECK_NOTHING);
-    gst_element_link_pads_full(capsFilter, "src", m_deInterleave.get(), "sink", GST_PAD_LINK_CHECK_NOTHING);
+    gst_element_link_pads_full(capsFilter, "src", sink, "sink", GST_PAD_LINK_CHECK_NOTHING);
 
+    gst_element_sync_state_with_parent(queue);
     gst_element_sync_state_with_parent(audioConvert);
     gst_element_sync_state_with_parent(audioResample);
     gst_element_sync_state_with_parent(capsFilter);
-    gst_element_sync_state_with_parent(m_deInterleave.get());
+    gst_element_sync_state_with_parent(sink);
 }
 
 void AudioStreamChannelsReader::buildInputPipeline()
@@ -450,132 +1135,696 @@ void AudioStreamChannelsReader::buildInputPipeline()
     // separate each planar channel. Sub pipeline looks like
     // ... autoaudiosrc ! audioconvert ! audioresample ! capsfilter ! deinterleave.
 
-    printf("configuring audio input...\n");
-    GstElement *source = gst_element_factory_make("pulsesrc", 0);
+    GstElement* source = m_liveSource ? m_liveSource.get() : makeGStreamerElement("pulsesrc", 0);
     //GstElement *source = gst_element_factory_make("autoaudiosrc", 0);
-    GstElement* audioConvert  = gst_element_factory_make("audioconvert", 0);
+    GstElement* audioConvert  = makeGStreamerElement("audioconvert", 0);
 
-    GstElement* audioResample = gst_element_factory_make("audioresample", 0);
-    GstElement* capsFilter = gst_element_factory_make("capsfilter", 0);
-    m_deInterleave = gst_element_factory_make("deinterleave", "deinterleave");
+    GstElement* audioResample = makeGStreamerElement("audioresample", 0);
+    GstElement* capsFilter = makeGStreamerElement("capsfilter", 0);
+    m_deInterleave = makeGStreamerElement("deinterleave", "deinterleave");
 
     g_object_set(m_deInterleave.get(), "keep-positions", TRUE, NULL);
     g_signal_connect(m_deInterleave.get(), "pad-added", G_CALLBACK(onGStreamerDeinterleavePadAddedCallback), this);
     g_signal_connect(m_deInterleave.get(), "no-more-pads", G_CALLBACK(onGStreamerDeinterleaveReadyCallback), this);
 
-    GstCaps* caps = getGstAudioCaps(2, m_sampleRate);
+    GstCaps* caps = getGstAudioCaps(m_mixToMono ? 1 : 2, m_sampleRate);
     g_object_set(capsFilter, "caps", caps, NULL);
     gst_caps_unref(caps);
 
-    gst_bin_add_many(GST_BIN(m_pipeline), source, audioConvert, audioResample, capsFilter, m_deInterleave.get(), NULL);
-    gst_element_link_pads_full(source, "src", audioConvert, "sink", GST_PAD_LINK_CHECK_NOTHING);
+    gst_bin_add_many(GST_BIN(m_pipeline.get()), source, audioConvert, audioResample, capsFilter, m_deInterleave.get(), NULL);
+    GstElement* tee = 0;
+    if (m_hasLoudnessMeasurement) {
+        GRefPtr<GstPad> sourcePad = adoptGRef(gst_element_get_static_pad(source, "src"));
+        tee = plugTee(sourcePad.get());
+        plugLoudnessBranch(tee);
+        GstElement* queue = makeGStreamerElement("queue", 0);
+        gst_bin_add(GST_BIN(m_pipeline.get()), queue);
+        gst_element_link(tee, queue);
+        gst_element_link_pads_full(queue, "src", audioConvert, "sink", GST_PAD_LINK_CHECK_NOTHING);
+        gst_element_sync_state_with_parent(queue);
+    } else
+        gst_element_link_pads_full(source, "src", audioConvert, "sink", GST_PAD_LINK_CHECK_NOTHING);
     gst_element_link_pads_full(audioConvert, "src", audioResample, "sink", GST_PAD_LINK_CHECK_NOTHING);
     gst_element_link_pads_full(audioResample, "src", capsFilter, "sink", GST_PAD_LINK_CHECK_NOTHING);
     gst_element_link_pads_full(capsFilter, "src", m_deInterleave.get(), "sink", GST_PAD_LINK_CHECK_NOTHING);
 
     gst_element_sync_state_with_parent(source);
+    if (tee)
+        gst_element_sync_state_with_parent(tee);
     gst_element_sync_state_with_parent(audioConvert);
     gst_element_sync_state_with_parent(audioResample);
     gst_element_sync_state_with_parent(capsFilter);
     gst_element_sync_state_with_parent(m_deInterleave.get());
-    gst_element_set_state(m_pipeline, GST_STATE_PLAYING);
+    gst_element_set_state(m_pipeline.get(), GST_STATE_PLAYING);
 }
 
 void AudioStreamChannelsReader::decodeAudioForBusCreation()
 {
+    m_startSource.clear();
+    if (m_cancelRequested) {
+        cancelDecodingCallback(this);
+        return;
+    }
+
+    unsigned outputChannels = m_mixToMono ? 1 : 2;
+    if (m_sharedOutput && m_sharedOutput->numberOfChannels() != outputChannels) {
+        GOwnPtr<GError> error(g_error_new(AUDIO_READER_ERROR, AudioReaderErrorSharedOutputChannels,
+            "Shared output has %u channels, the output %u", m_sharedOutput->numberOfChannels(), outputChannels));
+        didFinishDecoding(error.get());
+        return;
+    }
+
+    if (m_hasDeadlines) {
+        enterPhase(PhasePrerolling);
+        // Checking a few times per deadline keeps the overshoot small
+        // without waking up too often.
+        GstClockTime shortest = std::min(std::min(m_deadlines.preroll, m_deadlines.firstBuffer), m_deadlines.stall);
+        guint interval = std::min<GstClockTime>(std::max<GstClockTime>(shortest / 4 / GST_MSECOND, 10), 1000);
+        m_watchdogSource = adoptGRef(g_timeout_source_new(interval));
+        g_source_set_callback(m_watchdogSource.get(), checkDeadlinesCallback, this, 0);
+        g_source_attach(m_watchdogSource.get(), m_context.get());
+    }
+
     // Build the pipeline (giostreamsrc | filesrc) ! decodebin2
     // A deinterleave element is added once a src pad becomes available in decodebin.
     m_pipeline = gst_pipeline_new(0);
 
-    GstBus* bus = webkitGstPipelineGetBus(GST_PIPELINE(m_pipeline));
+    // Bus messages are dispatched on the reader's context, not on
+    // whatever happens to be the thread default one.
+    GRefPtr<GstBus> bus = adoptGRef(webkitGstPipelineGetBus(GST_PIPELINE(m_pipeline.get())));
     ASSERT(bus);
-    gst_bus_add_signal_watch(bus);
-    g_signal_connect(bus, "message", G_CALLBACK(messageCallback), this);
+    m_busWatch = adoptGRef(gst_bus_create_watch(bus.get()));
+    g_source_set_callback(m_busWatch.get(), reinterpret_cast<GSourceFunc>(messageCallback), this, 0);
+    g_source_attach(m_busWatch.get(), m_context.get());
 
-    GstElement* source;
-    if (m_filePath) {
-        source = gst_element_factory_make("filesrc", 0);
-        g_object_set(source, "location", m_filePath, NULL);
+    if (m_tracePath) {
+        m_tracer.reset(new PipelineTracer(m_tracePath.get()));
+        m_tracer->attach(m_pipeline.get());
+    }
 
-        m_decodebin = gst_element_factory_make(gDecodebinName, "decodebin");
+    if (sharedStreamingThreadPool() || m_tracer) {
+#ifdef GST_API_VERSION_1
+        gst_bus_set_sync_handler(bus.get(), busSyncHandler, this, 0);
+#else
+        gst_bus_set_sync_handler(bus.get(), busSyncHandler, this);
+#endif
+    }
+
+    if (m_filePath || m_data || m_inputFd >= 0) {
+        GstElement* source;
+        if (m_filePath) {
+            source = makeGStreamerElement("filesrc", 0);
+            g_object_set(source, "location", m_filePath.get(), NULL);
+        } else if (m_inputFd >= 0) {
+            source = makeGStreamerElement("fdsrc", 0);
+            g_object_set(source, "fd", m_inputFd, NULL);
+        } else {
+            GRefPtr<GInputStream> memoryStream = adoptGRef(g_memory_input_stream_new_from_data(m_data, m_dataSize, 0));
+            source = makeGStreamerElement("giostreamsrc", 0);
+            g_object_set(source, "stream", memoryStream.get(), NULL);
+        }
+
+        m_decodebin = makeGStreamerElement(gDecodebinName, "decodebin");
         g_signal_connect(m_decodebin.get(), "pad-added", G_CALLBACK(onGStreamerDecodebinPadAddedCallback), this);
+        g_signal_connect(m_decodebin.get(), "no-more-pads", G_CALLBACK(onGStreamerDecodebinNoMorePadsCallback), this);
+        g_signal_connect(m_decodebin.get(), "autoplug-continue", G_CALLBACK(onGStreamerDecodebinAutoplugContinueCallback), this);
 
-        gst_bin_add_many(GST_BIN(m_pipeline), source, m_decodebin.get(), NULL);
+        gst_bin_add_many(GST_BIN(m_pipeline.get()), source, m_decodebin.get(), NULL);
         gst_element_link_pads_full(source, "src", m_decodebin.get(), "sink", GST_PAD_LINK_CHECK_NOTHING);
-        gst_element_set_state(m_pipeline, GST_STATE_PAUSED);
+        gst_element_set_state(m_pipeline.get(), GST_STATE_PAUSED);
     } else {
         buildInputPipeline();
     }
 
 }
 
-void AudioStreamChannelsReader::createBus(float sampleRate, bool mixToMono)
+void AudioStreamChannelsReader::didFinishDecoding(const GError* error)
+{
+    if (m_finished)
+        return;
+    m_finished = true;
+
+    if (m_startSource) {
+        g_source_destroy(m_startSource.get());
+        m_startSource.clear();
+    }
+
+    if (m_busWatch) {
+        g_source_destroy(m_busWatch.get());
+        m_busWatch.clear();
+    }
+
+    if (m_seekSource) {
+        g_source_destroy(m_seekSource.get());
+        m_seekSource.clear();
+    }
+
+    if (m_watchdogSource) {
+        g_source_destroy(m_watchdogSource.get());
+        m_watchdogSource.clear();
+    }
+
+    // Unblocks streaming threads waiting for room in the ring, which
+    // would otherwise never join.
+    if (m_sharedOutput)
+        m_sharedOutput->close(error != 0);
+
+    // Going to NULL joins the streaming threads, so the buffer lists
+    // are not touched anymore after this point.
+    if (m_pipeline)
+        gst_element_set_state(m_pipeline.get(), GST_STATE_NULL);
+
+    if (m_compactBus) {
+        if (error)
+            m_compactBus.reset();
+        else
+            m_compactBus->finish();
+    }
+
+    if (m_tracer)
+        m_tracer->write();
+
+    DecodeCompletion* completion = new DecodeCompletion;
+    completion->callback = m_completion;
+    completion->error = error ? g_error_copy(error) : 0;
+    if (!error && !m_destination && collectsBuffers())
+        completion->bus = takeDecodedBus();
+
+    // Kept so that the destructor can revoke it. Destroying it from the
+    // completion itself is fine, the dispatch holds on to completion.
+    m_completionSource = adoptGRef(g_idle_source_new());
+    g_source_set_callback(m_completionSource.get(), decodeCompletionCallback, completion, destroyDecodeCompletion);
+    g_source_attach(m_completionSource.get(), m_context.get());
+}
+
+void AudioStreamChannelsReader::enterPhase(DecodePhase phase)
+{
+    m_phaseStartTime = g_get_monotonic_time();
+    m_phase = phase;
+}
+
+// Called on the streaming threads.
+void AudioStreamChannelsReader::didReceiveBuffer()
+{
+    if (!m_hasDeadlines)
+        return;
+    m_lastBufferTime = g_get_monotonic_time();
+    if (m_phase != PhaseStreaming)
+        enterPhase(PhaseStreaming);
+}
+
+gboolean AudioStreamChannelsReader::checkDeadlines()
+{
+    if (m_finished)
+        return FALSE;
+    if (m_paused)
+        return TRUE;
+
+    gint64 now = g_get_monotonic_time();
+    GstClockTime deadline;
+    GstClockTime elapsed;
+    AudioReaderError code;
+    const char* what;
+    switch (m_phase) {
+    case PhasePrerolling:
+        deadline = m_deadlines.preroll;
+        elapsed = (now - m_phaseStartTime) * GST_USECOND;
+        code = AudioReaderErrorPrerollTimeout;
+        what = "Pipeline did not preroll";
+        break;
+    case PhaseWaitingForData:
+        deadline = m_deadlines.firstBuffer;
+        elapsed = (now - m_phaseStartTime) * GST_USECOND;
+        code = AudioReaderErrorFirstBufferTimeout;
+        what = "No decoded buffer";
+        break;
+    default:
+        deadline = m_deadlines.stall;
+        elapsed = (now - std::max<gint64>(m_lastBufferTime, m_phaseStartTime)) * GST_USECOND;
+        code = AudioReaderErrorStalled;
+        what = "Decoding stalled, no buffer";
+        break;
+    }
+
+    if (!GST_CLOCK_TIME_IS_VALID(deadline) || elapsed < deadline)
+        return TRUE;
+
+    // The source is being dispatched and goes away with the FALSE
+    // return, didFinishDecoding() must not destroy it.
+    m_watchdogSource.clear();
+    m_errorOccurred = true;
+    GOwnPtr<GError> error(g_error_new(AUDIO_READER_ERROR, code, "%s within %.1f s", what, static_cast<double>(deadline) / GST_SECOND));
+    didFinishDecoding(error.get());
+    return FALSE;
+}
+
+std::unique_ptr<AudioBus> AudioStreamChannelsReader::takeDecodedBus()
+{
+    unsigned channels = m_mixToMono ? 1 : 2;
+    std::unique_ptr<AudioBus> audioBus = AudioBus::create(channels, m_channelSize);
+    audioBus->setSampleRate(m_sampleRate);
+
+    copyGstreamerBuffersToAudioChannel(m_frontLeftBuffers.get(), audioBus->channel(0));
+    if (!m_mixToMono)
+        copyGstreamerBuffersToAudioChannel(m_frontRightBuffers.get(), audioBus->channel(1));
+
+    unsigned targetRate = static_cast<unsigned>(m_sampleRate);
+    if (!usesInProcessResampler() || !m_decodedRate || m_decodedRate == targetRate)
+        return audioBus;
+
+    PolyphaseResampler resampler(m_decodedRate, targetRate, m_resamplerQuality);
+    std::unique_ptr<AudioBus> resampledBus = AudioBus::create(channels, resampler.outputLength(m_channelSize));
+    resampledBus->setSampleRate(m_sampleRate);
+    for (unsigned i = 0; i < channels; ++i)
+        resampler.process(audioBus->channel(i)->data(), m_channelSize, resampledBus->channel(i)->mutableData());
+    return resampledBus;
+}
+
+bool AudioStreamChannelsReader::usesInProcessResampler() const
+{
+    // Samples written to a destination are placed by timestamp at the
+    // target rate as they arrive, so that mode keeps audioresample.
+    return m_hasResampler && !m_destination;
+}
+
+void AudioStreamChannelsReader::setSegment(GstClockTime start, GstClockTime stop)
+{
+    ASSERT(!m_context);
+    m_hasSegment = true;
+    m_segmentStart = start;
+    m_segmentStop = stop;
+}
+
+void AudioStreamChannelsReader::setDeadlines(const AudioReaderDeadlines& deadlines)
+{
+    ASSERT(!m_context);
+    m_deadlines = deadlines;
+    m_hasDeadlines = GST_CLOCK_TIME_IS_VALID(deadlines.preroll) || GST_CLOCK_TIME_IS_VALID(deadlines.firstBuffer)
+        || GST_CLOCK_TIME_IS_VALID(deadlines.stall);
+}
+
+void AudioStreamChannelsReader::setTraceFile(const char* path)
+{
+    ASSERT(!m_context);
+    m_tracePath.set(g_strdup(path));
+}
+
+void AudioStreamChannelsReader::setSharedOutput(SharedAudioRing* ring)
+{
+    ASSERT(!m_context);
+    m_sharedOutput = ring;
+}
+
+void AudioStreamChannelsReader::setCompactStorage(CompactSampleFormat format)
+{
+    ASSERT(!m_context);
+    m_hasCompactStorage = true;
+    m_compactFormat = format;
+}
+
+std::unique_ptr<CompactAudioBus> AudioStreamChannelsReader::takeCompactBus()
+{
+    ASSERT(m_finished);
+    return std::move(m_compactBus);
+}
+
+void AudioStreamChannelsReader::setLoudnessMeasurement(bool enabled)
+{
+    ASSERT(!m_context);
+    // The meter is created on the loudness branch, once the source's
+    // channel count is known.
+    m_hasLoudnessMeasurement = enabled;
+    m_loudnessMeter.reset();
+}
+
+bool AudioStreamChannelsReader::loudness(LoudnessInfo& info) const
+{
+    if (!m_loudnessMeter || !m_finished || m_errorOccurred)
+        return false;
+    info = m_loudnessMeter->result();
+    return true;
+}
+
+void AudioStreamChannelsReader::setOnsetDetection(const OnsetDetectorConfig& config)
+{
+    ASSERT(!m_context);
+    // The detector is created in start(), once the channel count is
+    // known.
+    m_hasOnsetDetection = true;
+    m_onsetConfig = config;
+}
+
+bool AudioStreamChannelsReader::onsets(OnsetInfo& info) const
+{
+    if (!m_onsetDetector || !m_finished || m_errorOccurred)
+        return false;
+    info = m_onsetDetector->result();
+    return true;
+}
+
+void AudioStreamChannelsReader::setStereoCorrelation(const StereoCorrelatorConfig& config, StereoCorrelator::ResultCallback callback)
+{
+    ASSERT(!m_context);
+    m_stereoCorrelator.reset(new StereoCorrelator(config, callback));
+}
+
+void AudioStreamChannelsReader::setResampler(ResamplerQuality quality)
+{
+    ASSERT(!m_context);
+    m_hasResampler = true;
+    m_resamplerQuality = quality;
+}
+
+void AudioStreamChannelsReader::setLiveSource(GstElement* source)
+{
+    ASSERT(!m_context);
+    ASSERT(!m_filePath && !m_data);
+    m_liveSource = source;
+}
+
+void AudioStreamChannelsReader::setInputFd(int fd)
+{
+    ASSERT(!m_context);
+    ASSERT(!m_filePath && !m_data);
+    m_inputFd = fd;
+}
+
+void AudioStreamChannelsReader::setCollectsBuffers(bool collectsBuffers)
+{
+    ASSERT(!m_context);
+    m_collectsBuffers = collectsBuffers;
+}
+
+bool AudioStreamChannelsReader::collectsBuffers() const
+{
+    return m_collectsBuffers && !m_sharedOutput && !m_compactBus;
+}
+
+void AudioStreamChannelsReader::setSampleObserver(SampleObserver observer)
+{
+    ASSERT(!m_context);
+    m_sampleObserver = observer;
+}
+
+void AudioStreamChannelsReader::setQueueLimits(const AudioQueueLimits& limits)
+{
+    ASSERT(!m_context);
+    m_hasQueueLimits = true;
+    m_queueLimits = limits;
+}
+
+unsigned AudioStreamChannelsReader::addOutput(const AudioOutputSpec& spec)
+{
+    ASSERT(!m_context);
+    std::unique_ptr<AdditionalOutput> output(new AdditionalOutput);
+    output->spec = spec;
+    output->track = AdditionalOutput::mainTrack;
+    m_additionalOutputs.push_back(std::move(output));
+    return m_additionalOutputs.size() - 1;
+}
+
+void AudioStreamChannelsReader::setAudioTrack(unsigned track)
+{
+    ASSERT(!m_context);
+    m_audioTrack = track;
+}
+
+unsigned AudioStreamChannelsReader::addTrackOutput(unsigned track, const AudioOutputSpec& spec)
+{
+    unsigned index = addOutput(spec);
+    m_additionalOutputs[index]->track = track;
+    return index;
+}
+
+std::unique_ptr<AudioBus> AudioStreamChannelsReader::takeOutputBus(unsigned index)
+{
+    if (!m_finished || index >= m_additionalOutputs.size())
+        return std::unique_ptr<AudioBus>();
+
+    AdditionalOutput* output = m_additionalOutputs[index].get();
+    std::unique_ptr<AudioBus> audioBus = deinterleaveBuffers(output->buffers, output->spec.mixToMono ? 1 : 2, output->spec.sampleRate);
+    output->buffers.clear();
+    return audioBus;
+}
+
+void AudioStreamChannelsReader::setDestination(AudioBus* destination, guint64 firstFrame, guint64 endFrame, guint64 frameOffset)
+{
+    ASSERT(!m_context);
+    ASSERT(frameOffset <= firstFrame);
+    m_destination = destination;
+    m_destinationStart = firstFrame;
+    m_destinationEnd = endFrame;
+    m_destinationOffset = frameOffset;
+}
+
+void AudioStreamChannelsReader::start(float sampleRate, bool mixToMono, GMainContext* context, CompletionCallback completion)
 {
+    ASSERT(!m_context);
     m_sampleRate = sampleRate;
+    m_mixToMono = mixToMono;
+    m_completion = completion;
+    m_context = context ? context : g_main_context_default();
 
-    m_frontLeftBuffers = gst_buffer_list_new();
-    m_frontRightBuffers = gst_buffer_list_new();
+    m_frontLeftBuffers = adoptGRef(gst_buffer_list_new());
+    m_frontRightBuffers = adoptGRef(gst_buffer_list_new());
+
+    if (m_hasCompactStorage && !m_destination && !m_sharedOutput && !usesInProcessResampler())
+        m_compactBus = CompactAudioBus::create(mixToMono ? 1 : 2, sampleRate, m_compactFormat);
+    if (m_hasOnsetDetection)
+        m_onsetDetector.reset(new OnsetDetector(mixToMono ? 1 : 2, m_onsetConfig));
 
 #ifndef GST_API_VERSION_1
-    m_frontLeftBuffersIterator = gst_buffer_list_iterate(m_frontLeftBuffers);
+    m_frontLeftBuffersIterator = gst_buffer_list_iterate(m_frontLeftBuffers.get());
     gst_buffer_list_iterator_add_group(m_frontLeftBuffersIterator);
 
-    m_frontRightBuffersIterator = gst_buffer_list_iterate(m_frontRightBuffers);
+    m_frontRightBuffersIterator = gst_buffer_list_iterate(m_frontRightBuffers.get());
     gst_buffer_list_iterator_add_group(m_frontRightBuffersIterator);
 #endif
 
-    /*GRefPtr<GMainContext> context = adoptGRef(g_main_context_new());
-    g_main_context_push_thread_default(context.get());
-    m_loop = adoptGRef(g_main_loop_new(context.get(), FALSE));
-
     // Start the pipeline processing just after the loop is started.
-    GRefPtr<GSource> timeoutSource = adoptGRef(g_timeout_source_new(0));
-    g_source_attach(timeoutSource.get(), context.get());
-    g_source_set_callback(timeoutSource.get(), reinterpret_cast<GSourceFunc>(enteredMainLoopCallback), this, 0);
+    m_startSource = adoptGRef(g_timeout_source_new(0));
+    g_source_set_callback(m_startSource.get(), reinterpret_cast<GSourceFunc>(enteredMainLoopCallback), this, 0);
+    g_source_attach(m_startSource.get(), m_context.get());
+}
 
-    g_main_loop_run(m_loop.get());
-    g_main_context_pop_thread_default(context.get());
-    */
+void AudioStreamChannelsReader::setPaused(bool paused)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_playStateMutex);
+        if (paused == m_paused || m_finished)
+            return;
+        m_paused = paused;
+    }
 
-    m_loop = adoptGRef(g_main_loop_new(NULL, FALSE));
-    enteredMainLoopCallback(this);
-    g_main_loop_run(m_loop.get());
-    printf("finished decoding loop!\n");
+    // The current phase starts over, time spent paused doesn't count
+    // against the deadlines.
+    if (!paused && m_hasDeadlines) {
+        gint64 now = g_get_monotonic_time();
+        m_phaseStartTime = now;
+        m_lastBufferTime = now;
+    }
 
-    /*if (m_errorOccurred)
-        return 0;
+    // Until deinterleave has all its pads the pipeline is only
+    // prerolling, the pause then just keeps it from going to PLAYING.
+    updatePlayState();
+}
 
-    unsigned channels = mixToMono ? 1 : 2;
-    RefPtr<AudioBus> audioBus = AudioBus::create(channels, m_channelSize, true);
-    audioBus->setSampleRate(m_sampleRate);
+void AudioStreamChannelsReader::updatePlayState()
+{
+    // The streaming thread and the reader's context may both get here.
+    // Only one of them sets the state at a time, the other just counts
+    // its request and leaves. The one setting it goes again until nobody
+    // asked meanwhile, so the state last asked for is the last one set.
+    {
+        std::lock_guard<std::mutex> lock(m_playStateMutex);
+        ++m_playStateRequests;
+        if (m_applyingPlayState)
+            return;
+        m_applyingPlayState = true;
+    }
 
-    copyGstreamerBuffersToAudioChannel(m_frontLeftBuffers, audioBus->channel(0));
-    if (!mixToMono)
-        copyGstreamerBuffersToAudioChannel(m_frontRightBuffers, audioBus->channel(1));
+    while (true) {
+        guint64 request;
+        bool canPlay;
+        GstState state;
+        {
+            std::lock_guard<std::mutex> lock(m_playStateMutex);
+            request = m_playStateRequests;
+            canPlay = m_readyToPlay && m_pipeline && !m_finished;
+            state = m_paused ? GST_STATE_PAUSED : GST_STATE_PLAYING;
+        }
+
+        if (canPlay)
+            gst_element_set_state(m_pipeline.get(), state);
+
+        std::lock_guard<std::mutex> lock(m_playStateMutex);
+        if (m_playStateRequests == request) {
+            m_applyingPlayState = false;
+            return;
+        }
+    }
+}
 
-    return audioBus;
-    */
+void AudioStreamChannelsReader::cancel()
+{
+    // Checked under the lock, so the destructor either sees the source
+    // or makes this a no-op.
+    std::lock_guard<std::mutex> lock(m_cancelMutex);
+    if (m_finished || m_cancelRequested.exchange(true) || !m_context)
+        return;
+
+    // Teardown has to happen where the bus messages are handled.
+    m_cancelSource = adoptGRef(g_idle_source_new());
+    g_source_set_priority(m_cancelSource.get(), G_PRIORITY_HIGH);
+    g_source_set_callback(m_cancelSource.get(), cancelDecodingCallback, this, 0);
+    g_source_attach(m_cancelSource.get(), m_context.get());
+}
+
+std::unique_ptr<AudioBus> AudioStreamChannelsReader::createBus(float sampleRate, bool mixToMono)
+{
+    GRefPtr<GMainContext> context = adoptGRef(g_main_context_new());
+    GRefPtr<GMainLoop> loop = adoptGRef(g_main_loop_new(context.get(), FALSE));
+    GMainLoop* loopPtr = loop.get();
+
+    std::unique_ptr<AudioBus> result;
+    start(sampleRate, mixToMono, context.get(), [&result, loopPtr](std::unique_ptr<AudioBus> bus, const GError*) {
+        result = std::move(bus);
+        g_main_loop_quit(loopPtr);
+    });
+
+    g_main_loop_run(loop.get());
+    return result;
 }
 
-void createBusFromAudioFile(const char* filePath, bool mixToMono, float sampleRate)
+std::unique_ptr<AudioBus> createBusFromAudioFile(const char* filePath, bool mixToMono, float sampleRate, LoudnessInfo* loudness)
 {
-    return AudioStreamChannelsReader(filePath).createBus(sampleRate, mixToMono);
+    AudioStreamChannelsReader reader(filePath);
+    reader.setLoudnessMeasurement(loudness != 0);
+    std::unique_ptr<AudioBus> bus = reader.createBus(sampleRate, mixToMono);
+    if (bus && loudness)
+        reader.loudness(*loudness);
+    return bus;
 }
 
-int main(int argc, char **argv)
+std::unique_ptr<CompactAudioBus> createCompactBusFromAudioFile(const char* filePath, bool mixToMono, float sampleRate, CompactSampleFormat format)
 {
-    const char *filePath = 0;
+    AudioStreamChannelsReader reader(filePath);
+    reader.setCompactStorage(format);
+    reader.createBus(sampleRate, mixToMono);
+    return reader.takeCompactBus();
+}
 
-    if (argc == 2) {
-        filePath = argv[1];
+std::unique_ptr<SharedAudioRing> createSharedBusFromAudioFile(const char* filePath, bool mixToMono, float sampleRate)
+{
+    // Decoded straight into a ring sized after the probed duration. The
+    // pages past the end are never touched, so the slack for a short
+    // estimate costs no memory.
+    AudioStreamInfo info;
+    if (probeAudioFile(filePath, info) && GST_CLOCK_TIME_IS_VALID(info.duration)) {
+        guint64 frames = gst_util_uint64_scale_ceil(info.duration, sampleRate, GST_SECOND);
+        std::unique_ptr<SharedAudioRing> ring = SharedAudioRing::create(mixToMono ? 1 : 2, frames + frames / 20 + sampleRate, 0);
+        if (!ring)
+            return ring;
+        ring->setFailsWhenFull(true);
+
+        bool succeeded = false;
+        {
+            AudioStreamChannelsReader reader(filePath);
+            reader.setSharedOutput(ring.get());
+            GRefPtr<GMainContext> context = adoptGRef(g_main_context_new());
+            GRefPtr<GMainLoop> loop = adoptGRef(g_main_loop_new(context.get(), FALSE));
+            GMainLoop* loopPtr = loop.get();
+            reader.start(sampleRate, mixToMono, context.get(), [&succeeded, loopPtr](std::unique_ptr<AudioBus>, const GError* error) {
+                succeeded = !error;
+                g_main_loop_quit(loopPtr);
+            });
+            g_main_loop_run(loop.get());
+        }
+        if (!ring->overflowed())
+            return succeeded ? std::move(ring) : std::unique_ptr<SharedAudioRing>();
     }
 
-    if (!initializeGStreamer()) {
-        fprintf(stderr, "Error trying to initialize gstreamer :(\n");
-        return -1;
+    // No usable duration, or more audio than it said: decode to memory
+    // and copy, which sizes the ring exactly.
+    std::unique_ptr<AudioBus> bus = createBusFromAudioFile(filePath, mixToMono, sampleRate);
+    if (!bus)
+        return std::unique_ptr<SharedAudioRing>();
+    return SharedAudioRing::createFromBus(*bus);
+}
+
+std::vector<std::unique_ptr<AudioBus> > createBusesFromAudioFile(const char* filePath, const std::vector<AudioOutputSpec>& outputs)
+{
+    std::vector<std::unique_ptr<AudioBus> > buses;
+    if (outputs.empty())
+        return buses;
+
+    AudioStreamChannelsReader reader(filePath);
+    for (size_t i = 1; i < outputs.size(); ++i)
+        reader.addOutput(outputs[i]);
+
+    std::unique_ptr<AudioBus> mainBus = reader.createBus(outputs[0].sampleRate, outputs[0].mixToMono);
+    if (!mainBus)
+        return buses;
+
+    buses.push_back(std::move(mainBus));
+    for (size_t i = 1; i < outputs.size(); ++i)
+        buses.push_back(reader.takeOutputBus(i - 1));
+    return buses;
+}
+
+std::vector<std::unique_ptr<AudioBus> > createBusesFromAudioTracks(const char* filePath, const std::vector<unsigned>& tracks, bool mixToMono, float sampleRate)
+{
+    std::vector<std::unique_ptr<AudioBus> > buses;
+    std::vector<unsigned> selected(tracks);
+    if (selected.empty()) {
+        // Only needed to know how many tracks there are.
+        AudioStreamInfo info;
+        GOwnPtr<GError> error;
+        if (!probeAudioFile(filePath, info, &error.outPtr())) {
+            fprintf(stderr, "Unsupported input %s: %s\n", filePath, error->message);
+            return buses;
+        }
+        for (unsigned track = 0; track < info.audioTracks; ++track)
+            selected.push_back(track);
     }
+    if (selected.empty())
+        return buses;
+
+    // The first track drives the main deinterleave branch, the others
+    // are teed off the same demuxer.
+    AudioStreamChannelsReader reader(filePath);
+    reader.setAudioTrack(selected[0]);
+    for (size_t i = 1; i < selected.size(); ++i)
+        reader.addTrackOutput(selected[i], AudioOutputSpec(sampleRate, mixToMono));
+
+    std::unique_ptr<AudioBus> mainBus = reader.createBus(sampleRate, mixToMono);
+    if (!mainBus)
+        return buses;
+
+    buses.push_back(std::move(mainBus));
+    for (size_t i = 1; i < selected.size(); ++i)
+        buses.push_back(reader.takeOutputBus(i - 1));
+    return buses;
+}
+
+std::unique_ptr<AudioStreamChannelsReader> decodeAudioFileAsync(const char* filePath, bool mixToMono, float sampleRate,
+    GMainContext* context, AudioStreamChannelsReader::CompletionCallback completion)
+{
+    std::unique_ptr<AudioStreamChannelsReader> reader(new AudioStreamChannelsReader(filePath));
+    reader->start(sampleRate, mixToMono, context, completion);
+    return reader;
+}
 
-    createBusFromAudioFile(filePath, false, 44100);
-    printf("finished main!\n");
-    return 0;
+std::unique_ptr<AudioStreamChannelsReader> decodeAudioFileAsync(const char* filePath, bool mixToMono, float sampleRate,
+    GMainContext* context, std::future<std::unique_ptr<AudioBus> >& result)
+{
+    std::shared_ptr<std::promise<std::unique_ptr<AudioBus> > > promise(new std::promise<std::unique_ptr<AudioBus> >());
+    result = promise->get_future();
+
+    return decodeAudioFileAsync(filePath, mixToMono, sampleRate, context, [promise](std::unique_ptr<AudioBus> bus, const GError* error) {
+        if (error)
+            promise->set_exception(std::make_exception_ptr(std::runtime_error(error->message)));
+        else
+            promise->set_value(std::move(bus));
+    });
 }
@@ -0,0 +1,459 @@
+/*
+ *  Copyright (C) 2011, 2012 Igalia S.L
+ *  Copyright (C) 2011 Zan Dobersek  <zandobersek@gmail.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef AudioStreamChannelsReader_h
+#define AudioStreamChannelsReader_h
+
+#include <atomic>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <gst/app/gstappsink.h>
+#include <gst/gst.h>
+
+#include "AudioBus.h"
+#include "CompactAudioBus.h"
+#include "GOwnPtr.h"
+#include "GRefPtr.h"
+#include "GRefPtrGStreamer.h"
+#include "OnsetDetector.h"
+#include "PolyphaseResampler.h"
+#include "StereoCorrelator.h"
+
+class LoudnessMeter;
+class PipelineTracer;
+class SharedAudioRing;
+struct LoudnessInfo;
+
+// Errors raised by the reader itself, as opposed to the ones posted by
+// the pipeline elements, which keep their GStreamer domains.
+#define AUDIO_READER_ERROR audioReaderErrorQuark()
+GQuark audioReaderErrorQuark();
+
+enum AudioReaderError {
+    // decodebin never exposed a pad, or deinterleave never announced
+    // its last one.
+    AudioReaderErrorPrerollTimeout,
+    // The pipeline was configured but no buffer reached the appsinks.
+    AudioReaderErrorFirstBufferTimeout,
+    // Buffers stopped reaching the appsinks before EOS.
+    AudioReaderErrorStalled,
+    // decodebin exposed all its pads without the audio track passed to
+    // setAudioTrack().
+    AudioReaderErrorNoSuchTrack,
+    // The ring passed to setSharedOutput() doesn't have as many
+    // channels as the output.
+    AudioReaderErrorSharedOutputChannels
+};
+
+// How long each decoding phase may take before the reader gives up
+// with the matching AudioReaderError. GST_CLOCK_TIME_NONE disables a
+// deadline, which is the default for all of them.
+struct AudioReaderDeadlines {
+    AudioReaderDeadlines()
+        : preroll(GST_CLOCK_TIME_NONE)
+        , firstBuffer(GST_CLOCK_TIME_NONE)
+        , stall(GST_CLOCK_TIME_NONE)
+    {
+    }
+
+    // From the start of the pipeline until deinterleave has all its pads.
+    GstClockTime preroll;
+    // From then until the first buffer reaches an appsink.
+    GstClockTime firstBuffer;
+    // Between two buffers afterwards. A consumer holding back the
+    // streaming threads, through a full shared ring for instance, counts
+    // as a stall too.
+    GstClockTime stall;
+};
+
+// Memory budget of the per-channel queue sitting between deinterleave
+// and each appsink. A zero limit means unlimited.
+struct AudioQueueLimits {
+    enum OverflowPolicy {
+        BlockProducer,
+        DropOldest,
+        DropNewest
+    };
+
+    AudioQueueLimits()
+        : maxBytes(0)
+        , maxTime(0)
+        , policy(BlockProducer)
+    {
+    }
+
+    guint maxBytes;
+    GstClockTime maxTime;
+    OverflowPolicy policy;
+};
+
+struct AudioChannelQueueStats {
+    guint64 framesQueued;
+    guint64 framesConsumed;
+    guint64 framesDropped;
+    guint currentLevelBytes;
+    GstClockTime currentLevelTime;
+};
+
+// Rate and channel layout of one decoded output. Outputs are always
+// delivered as planar float in an AudioBus.
+struct AudioOutputSpec {
+    AudioOutputSpec(float sampleRate = 44100, bool mixToMono = false)
+        : sampleRate(sampleRate)
+        , mixToMono(mixToMono)
+    {
+    }
+
+    float sampleRate;
+    bool mixToMono;
+};
+
+class AudioStreamChannelsReader {
+
+public:
+    // Invoked once on the reader's main context, either with the
+    // decoded bus or with the error that stopped decoding. The error
+    // is only valid for the duration of the call.
+    typedef std::function<void(std::unique_ptr<AudioBus>, const GError*)> CompletionCallback;
+
+    AudioStreamChannelsReader(const char* filePath);
+    AudioStreamChannelsReader(const void* data, size_t dataSize);
+    ~AudioStreamChannelsReader();
+
+    // Decodes synchronously, iterating a private main context until
+    // EOS or error. Returns 0 on error.
+    std::unique_ptr<AudioBus> createBus(float sampleRate, bool mixToMono);
+
+    // Schedules the pipeline construction on context and returns
+    // right away. Bus messages, and eventually the completion, are
+    // dispatched from whoever iterates context, so many decodes can
+    // share a single thread. The completion may destroy the reader.
+    // Destroying it before the completion was dispatched drops the
+    // completion.
+    void start(float sampleRate, bool mixToMono, GMainContext*, CompletionCallback);
+
+    // Safe to call from any thread. The pipeline is torn down on the
+    // reader's context and the completion receives G_IO_ERROR_CANCELLED.
+    void cancel();
+
+    // Holds a decode in PAUSED, keeping its pipeline and what it has
+    // decoded so far, until it is let go again. Deadlines don't run
+    // while paused. Call from the thread iterating the reader's context.
+    // If a streaming thread is changing the state at that moment, it
+    // applies the pause right after, not this call.
+    void setPaused(bool);
+    bool isPaused() const { return m_paused; }
+
+    bool isFinished() const { return m_finished; }
+
+    // Only decode [start, stop) of the stream, through an accurate
+    // seek once the pipeline is prerolled. stop can be
+    // GST_CLOCK_TIME_NONE to decode until EOS. Call before start().
+    void setSegment(GstClockTime start, GstClockTime stop);
+
+    // Write the samples of frames [firstFrame, endFrame) straight
+    // into destination at the position given by their timestamps,
+    // instead of collecting buffers. The completion then receives no
+    // bus. Frame f lands at index f - frameOffset of destination. Only
+    // supported with GStreamer 1.0. Call before start().
+    void setDestination(AudioBus*, guint64 firstFrame, guint64 endFrame, guint64 frameOffset = 0);
+
+    // Bounds the per-channel queues instead of using the queue element
+    // defaults. With BlockProducer a live source ends up dropping on
+    // its own once its ringbuffer overruns. Call before start().
+    void setQueueLimits(const AudioQueueLimits&);
+
+    // Occupancy and counters of the queue feeding channel. Returns
+    // false until the channel exists. Dropped frames are only
+    // accounted with GStreamer 1.0.
+    bool queueStats(unsigned channel, AudioChannelQueueStats&) const;
+
+    // Branches an extra output off right after decodebin, so one decode
+    // feeds several convert/resample chains. Returns the index to pass
+    // to takeOutputBus() once decoding has finished. Call before start().
+    unsigned addOutput(const AudioOutputSpec&);
+    std::unique_ptr<AudioBus> takeOutputBus(unsigned index);
+
+    // Audio tracks are numbered from 0 in the order decodebin exposes
+    // them, which is the container order. The main output decodes
+    // track, the first one by default. Call before start().
+    void setAudioTrack(unsigned track);
+    // Decodes another track of the same demux into its own branch.
+    // Shares the index space and takeOutputBus() with addOutput().
+    // Tracks nobody asked for are discarded. Call before start().
+    unsigned addTrackOutput(unsigned track, const AudioOutputSpec&);
+
+    // Stream the planar channels into ring as they are decoded, for a
+    // consumer in another process, instead of collecting them. Writes
+    // block while the ring is full. The ring is closed when decoding
+    // finishes, and the completion then receives no bus. The ring's
+    // sample rate is set from the negotiated caps. ring has to outlive
+    // the reader, and have one channel with mixToMono, two otherwise,
+    // or decoding fails right away. Call before start().
+    void setSharedOutput(SharedAudioRing*);
+
+    // Append the planar channels to a CompactAudioBus as they are
+    // decoded instead of holding on to the float buffers, so the full
+    // float result never sits in memory. The completion then receives
+    // no bus, take the compact one with takeCompactBus(). Ignored with
+    // setDestination(), setSharedOutput() and setResampler(). Call
+    // before start().
+    void setCompactStorage(CompactSampleFormat);
+    // Valid once decoding finished without error.
+    std::unique_ptr<CompactAudioBus> takeCompactBus();
+
+    // Measure EBU R128 loudness and true peak of the decoded stream on
+    // its own branch, with the source's channels and rate. Call before
+    // start().
+    void setLoudnessMeasurement(bool);
+    // Valid once decoding finished without error.
+    bool loudness(LoudnessInfo&) const;
+
+    // Detect onsets and follow the tempo of the decoded stream as it
+    // goes through the appsinks. Call before start().
+    void setOnsetDetection(const OnsetDetectorConfig&);
+    // Valid once decoding finished without error.
+    bool onsets(OnsetInfo&) const;
+
+    // Estimate the delay and coherence between front left and front
+    // right as the samples go through the appsinks, live captures
+    // included. callback runs on the streaming threads. Call before
+    // start().
+    void setStereoCorrelation(const StereoCorrelatorConfig&, StereoCorrelator::ResultCallback);
+
+    // Resample the main output with PolyphaseResampler once decoding is
+    // done instead of with audioresample in the pipeline. Ignored with
+    // setDestination(). Call before start().
+    void setResampler(ResamplerQuality);
+
+    // Called on the streaming thread with the samples of every buffer
+    // reaching an appsink, before the reader stores it. channel is 0
+    // for front left and 1 for front right. Call before start().
+    typedef std::function<void(unsigned channel, const float* samples, size_t frames, GstClockTime timestamp)> SampleObserver;
+    void setSampleObserver(SampleObserver);
+
+    // Captures from source instead of pulsesrc when the reader has
+    // neither a file nor data. Call before start().
+    void setLiveSource(GstElement*);
+
+    // Decodes the bytes read from fd (stdin, a pipe, a socket) through
+    // fdsrc when the reader has neither a file nor data. Decoding ends
+    // when the writer closes its end. fd stays owned by the caller.
+    // Call before start().
+    void setInputFd(int fd);
+
+    // Whether decoded buffers are kept for the bus handed to the
+    // completion, the default. Turn it off for unbounded streams that
+    // are consumed through the sample observer, the completion then
+    // receives no bus. Call before start().
+    void setCollectsBuffers(bool);
+
+    // Tear the pipeline down when a phase takes longer than its
+    // deadline. The deadlines are checked by a timeout source on the
+    // reader's context, so they hold even if decodebin or deinterleave
+    // never signal anything. Call before start().
+    void setDeadlines(const AudioReaderDeadlines&);
+
+    // Records buffer flow, bus messages and state changes, and writes
+    // them to path as Chrome trace JSON once decoding finishes. Call
+    // before start().
+    void setTraceFile(const char* path);
+    PipelineTracer* tracer() const { return m_tracer.get(); }
+
+    struct AdditionalOutput {
+        // Branched off whichever track the main output decodes.
+        static const int mainTrack = -1;
+
+        AudioOutputSpec spec;
+        int track;
+        std::vector<GRefPtr<GstBuffer> > buffers;
+    };
+
+    struct ChannelQueueState {
+        ChannelQueueState()
+            : ready(false)
+            , framesQueued(0)
+            , framesConsumed(0)
+        {
+        }
+
+        // Set once queue is assigned, from a streaming thread. queue
+        // must not be read before, nor written after.
+        std::atomic<bool> ready;
+        GRefPtr<GstElement> queue;
+        std::atomic<guint64> framesQueued;
+        std::atomic<guint64> framesConsumed;
+    };
+
+#ifdef GST_API_VERSION_1
+    GstFlowReturn handleSample(GstAppSink*);
+#else
+    GstFlowReturn handleBuffer(GstAppSink*);
+#endif
+    GstFlowReturn handleLoudnessSample(GstAppSink*);
+    gboolean handleMessage(GstMessage*);
+    void handleNewDeinterleavePad(GstPad*);
+    void deinterleavePadsConfigured();
+    void buildInputPipeline();
+    void handleNewDecodedPad(GstPad*);
+    void decodedPadsComplete();
+    void plugDeinterleave(GstPad*);
+    void decodeAudioForBusCreation();
+    void seekToSegment();
+    void didFinishDecoding(const GError*);
+    gboolean checkDeadlines();
+
+private:
+    enum DecodePhase {
+        PhasePrerolling,
+        PhaseWaitingForData,
+        PhaseStreaming
+    };
+
+    void enterPhase(DecodePhase);
+    void didReceiveBuffer();
+    void updatePlayState();
+    std::unique_ptr<AudioBus> takeDecodedBus();
+    bool usesInProcessResampler() const;
+    bool collectsBuffers() const;
+#ifdef GST_API_VERSION_1
+    void copyBufferToDestination(GstBuffer*, unsigned channelIndex, int rate);
+#endif
+    void applyQueueLimits(GstElement* queue, GstElement* sink);
+    void plugAdditionalOutput(GstElement* tee, AdditionalOutput*);
+    GstElement* plugTrackOutputs(GstPad*, unsigned track);
+    GstElement* plugTee(GstPad*);
+    void plugLoudnessBranch(GstElement* tee);
+    void plugFakeSink(GstPad*);
+
+    const void* m_data;
+    size_t m_dataSize;
+    GOwnPtr<gchar> m_filePath;
+
+    float m_sampleRate;
+    bool m_mixToMono;
+    GRefPtr<GstBufferList> m_frontLeftBuffers;
+    GRefPtr<GstBufferList> m_frontRightBuffers;
+
+#ifndef GST_API_VERSION_1
+    GstBufferListIterator* m_frontLeftBuffersIterator;
+    GstBufferListIterator* m_frontRightBuffersIterator;
+#endif
+
+    GRefPtr<GstElement> m_pipeline;
+    unsigned m_channelSize;
+    bool m_hasSegment;
+    GstClockTime m_segmentStart;
+    GstClockTime m_segmentStop;
+    AudioBus* m_destination;
+    guint64 m_destinationStart;
+    guint64 m_destinationEnd;
+    guint64 m_destinationOffset;
+    SharedAudioRing* m_sharedOutput;
+    bool m_hasCompactStorage;
+    CompactSampleFormat m_compactFormat;
+    std::unique_ptr<CompactAudioBus> m_compactBus;
+    int m_inputFd;
+    bool m_collectsBuffers;
+    bool m_hasDeadlines;
+    AudioReaderDeadlines m_deadlines;
+    std::atomic<unsigned> m_phase;
+    // Monotonic times, in microseconds. Written from the streaming
+    // threads, read by the watchdog.
+    std::atomic<gint64> m_phaseStartTime;
+    std::atomic<gint64> m_lastBufferTime;
+    GRefPtr<GSource> m_watchdogSource;
+    bool m_hasQueueLimits;
+    AudioQueueLimits m_queueLimits;
+    bool m_hasResampler;
+    ResamplerQuality m_resamplerQuality;
+    std::atomic<unsigned> m_decodedRate;
+    bool m_hasLoudnessMeasurement;
+    std::unique_ptr<LoudnessMeter> m_loudnessMeter;
+    std::vector<float> m_loudnessScratch;
+    std::unique_ptr<StereoCorrelator> m_stereoCorrelator;
+    bool m_hasOnsetDetection;
+    OnsetDetectorConfig m_onsetConfig;
+    std::unique_ptr<OnsetDetector> m_onsetDetector;
+    ChannelQueueState m_queueStates[2];
+    std::vector<std::unique_ptr<AdditionalOutput> > m_additionalOutputs;
+    unsigned m_audioTrack;
+    // Only touched from the thread decodebin exposes its pads from.
+    unsigned m_audioTracksSeen;
+    GRefPtr<GstElement> m_decodebin;
+    GRefPtr<GstElement> m_deInterleave;
+    GRefPtr<GMainContext> m_context;
+    GRefPtr<GSource> m_startSource;
+    GRefPtr<GSource> m_busWatch;
+    // Set by cancel(), from any thread.
+    std::mutex m_cancelMutex;
+    GRefPtr<GSource> m_cancelSource;
+    GRefPtr<GSource> m_seekSource;
+    GRefPtr<GSource> m_completionSource;
+    GRefPtr<GstElement> m_liveSource;
+    SampleObserver m_sampleObserver;
+    GOwnPtr<gchar> m_tracePath;
+    std::unique_ptr<PipelineTracer> m_tracer;
+    CompletionCallback m_completion;
+    bool m_errorOccurred;
+    // Guards the play state, which deinterleavePadsConfigured() moves on
+    // from a streaming thread, against setPaused(). Never held across
+    // gst_element_set_state().
+    std::mutex m_playStateMutex;
+    bool m_paused;
+    bool m_readyToPlay;
+    guint64 m_playStateRequests;
+    bool m_applyingPlayState;
+    std::atomic<bool> m_cancelRequested;
+    std::atomic<bool> m_finished;
+};
+
+// When loudness is given it is filled with the EBU R128 measurements
+// taken during the decode.
+std::unique_ptr<AudioBus> createBusFromAudioFile(const char* filePath, bool mixToMono, float sampleRate, LoudnessInfo* loudness = 0);
+
+// Whole-file variant for other processes: the complete decode in a
+// finished SharedAudioRing that consumers map in one go.
+std::unique_ptr<SharedAudioRing> createSharedBusFromAudioFile(const char* filePath, bool mixToMono, float sampleRate);
+
+// Same decode, stored in format as it goes. Returns 0 on error.
+std::unique_ptr<CompactAudioBus> createCompactBusFromAudioFile(const char* filePath, bool mixToMono, float sampleRate, CompactSampleFormat);
+
+// Decodes filePath once and returns one bus per output spec, in order.
+// Returns an empty vector on error.
+std::vector<std::unique_ptr<AudioBus> > createBusesFromAudioFile(const char* filePath, const std::vector<AudioOutputSpec>&);
+
+// Decodes the given audio tracks of filePath in a single demux pass and
+// returns one bus per track, in order. An empty tracks decodes all of
+// them. Returns an empty vector on error.
+std::vector<std::unique_ptr<AudioBus> > createBusesFromAudioTracks(const char* filePath, const std::vector<unsigned>& tracks, bool mixToMono, float sampleRate);
+
+// Non-blocking variants of createBusFromAudioFile(). The returned
+// reader is the handle of the in-flight decode: cancel() it to abort,
+// and only destroy it from the thread iterating context.
+std::unique_ptr<AudioStreamChannelsReader> decodeAudioFileAsync(const char* filePath, bool mixToMono, float sampleRate,
+    GMainContext*, AudioStreamChannelsReader::CompletionCallback);
+std::unique_ptr<AudioStreamChannelsReader> decodeAudioFileAsync(const char* filePath, bool mixToMono, float sampleRate,
+    GMainContext*, std::future<std::unique_ptr<AudioBus> >&);
+
+#endif // AudioStreamChannelsReader_h
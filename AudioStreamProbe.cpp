@@ -0,0 +1,400 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "AudioStreamProbe.h"
+
+#include <gio/gio.h>
+#include <gst/pbutils/pbutils.h>
+#include <list>
+#include <map>
+#include <mutex>
+#include <sys/stat.h>
+
+#include "GOwnPtr.h"
+#include "GRefPtr.h"
+#include "GRefPtrGStreamer.h"
+
+#ifdef GST_API_VERSION_1
+static const char* gDecodebinName = "decodebin";
+#else
+static const char* gDecodebinName = "decodebin2";
+#endif
+
+// Upper bound for a single probe. Anything slower than this is
+// considered broken input rather than a slow one.
+static const GstClockTime gProbeTimeout = 5 * GST_SECOND;
+
+struct FileIdentity {
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    time_t mtimeSeconds;
+    long mtimeNanoseconds;
+
+    bool operator<(const FileIdentity& o) const
+    {
+        if (device != o.device)
+            return device < o.device;
+        if (inode != o.inode)
+            return inode < o.inode;
+        if (size != o.size)
+            return size < o.size;
+        if (mtimeSeconds != o.mtimeSeconds)
+            return mtimeSeconds < o.mtimeSeconds;
+        return mtimeNanoseconds < o.mtimeNanoseconds;
+    }
+};
+
+struct CachedProbe {
+    bool supported;
+    AudioStreamInfo info;
+    GQuark errorDomain;
+    int errorCode;
+    std::string errorMessage;
+};
+
+typedef std::list<std::pair<FileIdentity, CachedProbe> > ProbeCacheList;
+
+// Most recently used first, gProbeCache indexes it.
+static std::mutex gProbeCacheMutex;
+static ProbeCacheList gProbeCacheEntries;
+static std::map<FileIdentity, ProbeCacheList::iterator> gProbeCache;
+static size_t gProbeCacheLimit = 256;
+
+// Called with gProbeCacheMutex held.
+static void trimProbeCache()
+{
+    while (gProbeCacheEntries.size() > gProbeCacheLimit) {
+        gProbeCache.erase(gProbeCacheEntries.back().first);
+        gProbeCacheEntries.pop_back();
+    }
+}
+
+static void ensurePbUtilsInitialized()
+{
+    static std::once_flag once;
+    std::call_once(once, gst_pb_utils_init);
+}
+
+static std::string codecDescriptionFromCaps(GstCaps* caps)
+{
+    if (!caps)
+        return std::string();
+
+    GOwnPtr<gchar> description(gst_pb_utils_get_codec_description(caps));
+    if (description)
+        return description.get();
+
+    return gst_structure_get_name(gst_caps_get_structure(caps, 0));
+}
+
+static bool fillInfoFromDiscoverer(GstDiscovererInfo* discovererInfo, AudioStreamInfo& info, GError** error)
+{
+    GList* audioStreams = gst_discoverer_info_get_audio_streams(discovererInfo);
+    if (!audioStreams) {
+        g_set_error_literal(error, GST_STREAM_ERROR, GST_STREAM_ERROR_WRONG_TYPE, "No audio stream found");
+        return false;
+    }
+
+    // The reader decodes the first audio stream decodebin exposes
+    // unless told otherwise.
+    GstDiscovererStreamInfo* streamInfo = static_cast<GstDiscovererStreamInfo*>(audioStreams->data);
+    GstDiscovererAudioInfo* audioInfo = GST_DISCOVERER_AUDIO_INFO(streamInfo);
+
+    info.duration = gst_discoverer_info_get_duration(discovererInfo);
+    info.seekable = gst_discoverer_info_get_seekable(discovererInfo);
+    info.audioTracks = g_list_length(audioStreams);
+    info.channels = gst_discoverer_audio_info_get_channels(audioInfo);
+    info.sampleRate = gst_discoverer_audio_info_get_sample_rate(audioInfo);
+
+    GstCaps* caps = gst_discoverer_stream_info_get_caps(streamInfo);
+    info.codec = codecDescriptionFromCaps(caps);
+    if (caps)
+        gst_caps_unref(caps);
+
+    gst_discoverer_stream_info_list_free(audioStreams);
+    return true;
+}
+
+static bool discoverAudioFile(const char* filePath, AudioStreamInfo& info, GError** error)
+{
+    ensurePbUtilsInitialized();
+
+    GOwnPtr<gchar> uri(gst_filename_to_uri(filePath, error));
+    if (!uri)
+        return false;
+
+    GstDiscoverer* discoverer = gst_discoverer_new(gProbeTimeout, error);
+    if (!discoverer)
+        return false;
+
+    GOwnPtr<GError> discoverError;
+    GstDiscovererInfo* discovererInfo = gst_discoverer_discover_uri(discoverer, uri.get(), &discoverError.outPtr());
+    g_object_unref(discoverer);
+
+    if (!discovererInfo) {
+        g_propagate_error(error, discoverError.release());
+        return false;
+    }
+
+    bool result = false;
+    switch (gst_discoverer_info_get_result(discovererInfo)) {
+    case GST_DISCOVERER_OK:
+        result = fillInfoFromDiscoverer(discovererInfo, info, error);
+        break;
+    case GST_DISCOVERER_MISSING_PLUGINS:
+        g_set_error_literal(error, GST_STREAM_ERROR, GST_STREAM_ERROR_CODEC_NOT_FOUND, "No decoder available for this input");
+        break;
+    case GST_DISCOVERER_TIMEOUT:
+        g_set_error_literal(error, GST_STREAM_ERROR, GST_STREAM_ERROR_FAILED, "Timed out while probing");
+        break;
+    default:
+        if (discoverError)
+            g_propagate_error(error, discoverError.release());
+        else
+            g_set_error_literal(error, GST_STREAM_ERROR, GST_STREAM_ERROR_TYPE_NOT_FOUND, "Could not determine the input type");
+        break;
+    }
+
+    gst_discoverer_info_unref(discovererInfo);
+    return result;
+}
+
+bool probeAudioFile(const char* filePath, AudioStreamInfo& info, GError** error)
+{
+    struct stat fileStat;
+    if (stat(filePath, &fileStat) == -1) {
+        g_set_error(error, GST_RESOURCE_ERROR, GST_RESOURCE_ERROR_NOT_FOUND, "Could not stat %s", filePath);
+        return false;
+    }
+
+    FileIdentity identity;
+    identity.device = fileStat.st_dev;
+    identity.inode = fileStat.st_ino;
+    identity.size = fileStat.st_size;
+    identity.mtimeSeconds = fileStat.st_mtim.tv_sec;
+    identity.mtimeNanoseconds = fileStat.st_mtim.tv_nsec;
+
+    {
+        std::lock_guard<std::mutex> lock(gProbeCacheMutex);
+        std::map<FileIdentity, ProbeCacheList::iterator>::const_iterator it = gProbeCache.find(identity);
+        if (it != gProbeCache.end()) {
+            gProbeCacheEntries.splice(gProbeCacheEntries.begin(), gProbeCacheEntries, it->second);
+            const CachedProbe& cached = it->second->second;
+            if (!cached.supported) {
+                g_set_error_literal(error, cached.errorDomain, cached.errorCode, cached.errorMessage.c_str());
+                return false;
+            }
+            info = cached.info;
+            return true;
+        }
+    }
+
+    // Probing happens outside the lock, concurrent probes of the
+    // same file just race to fill in the same entry.
+    CachedProbe entry;
+    GOwnPtr<GError> probeError;
+    entry.supported = discoverAudioFile(filePath, entry.info, &probeError.outPtr());
+    entry.errorDomain = probeError ? probeError->domain : 0;
+    entry.errorCode = probeError ? probeError->code : 0;
+    if (probeError)
+        entry.errorMessage = probeError->message;
+
+    {
+        std::lock_guard<std::mutex> lock(gProbeCacheMutex);
+        std::map<FileIdentity, ProbeCacheList::iterator>::iterator it = gProbeCache.find(identity);
+        if (it != gProbeCache.end()) {
+            it->second->second = entry;
+            gProbeCacheEntries.splice(gProbeCacheEntries.begin(), gProbeCacheEntries, it->second);
+        } else {
+            gProbeCacheEntries.push_front(std::make_pair(identity, entry));
+            gProbeCache[identity] = gProbeCacheEntries.begin();
+            trimProbeCache();
+        }
+    }
+
+    if (!entry.supported) {
+        g_propagate_error(error, probeError.release());
+        return false;
+    }
+
+    info = entry.info;
+    return true;
+}
+
+struct DataProbeContext {
+    GstElement* pipeline;
+    GstPad* audioPad;
+    unsigned audioTracks;
+};
+
+static void onProbeDecodebinPadAddedCallback(GstElement*, GstPad* pad, DataProbeContext* context)
+{
+#ifdef GST_API_VERSION_1
+    GstCaps* caps = gst_pad_query_caps(pad, 0);
+#else
+    GstCaps* caps = gst_pad_get_caps_reffed(pad);
+#endif
+    bool isAudio = caps && g_str_has_prefix(gst_structure_get_name(gst_caps_get_structure(caps, 0)), "audio/");
+    if (caps)
+        gst_caps_unref(caps);
+    if (!isAudio)
+        return;
+
+    // Every audio track gets a sink so that none of them holds the
+    // demuxer back, only the first one is described.
+    ++context->audioTracks;
+    GstElement* sink = gst_element_factory_make("fakesink", 0);
+    gst_bin_add(GST_BIN(context->pipeline), sink);
+
+    GstPad* sinkPad = gst_element_get_static_pad(sink, "sink");
+    gst_pad_link(pad, sinkPad);
+    gst_object_unref(GST_OBJECT(sinkPad));
+    gst_element_sync_state_with_parent(sink);
+
+    if (!context->audioPad)
+        context->audioPad = GST_PAD(gst_object_ref(GST_OBJECT(pad)));
+}
+
+bool probeAudioData(const void* data, size_t dataSize, AudioStreamInfo& info, GError** error)
+{
+    ensurePbUtilsInitialized();
+
+    // Preroll giostreamsrc ! decodebin ! fakesink. Only the first
+    // buffer gets decoded, which is enough to know the negotiated
+    // format.
+    DataProbeContext context;
+    context.pipeline = gst_pipeline_new(0);
+    context.audioPad = 0;
+    context.audioTracks = 0;
+
+    GRefPtr<GInputStream> memoryStream = adoptGRef(g_memory_input_stream_new_from_data(data, dataSize, 0));
+    GstElement* source = gst_element_factory_make("giostreamsrc", 0);
+    g_object_set(source, "stream", memoryStream.get(), NULL);
+
+    GstElement* decodebin = gst_element_factory_make(gDecodebinName, 0);
+    g_signal_connect(decodebin, "pad-added", G_CALLBACK(onProbeDecodebinPadAddedCallback), &context);
+
+    gst_bin_add_many(GST_BIN(context.pipeline), source, decodebin, NULL);
+    gst_element_link_pads_full(source, "src", decodebin, "sink", GST_PAD_LINK_CHECK_NOTHING);
+    gst_element_set_state(context.pipeline, GST_STATE_PAUSED);
+
+    GRefPtr<GstBus> bus = adoptGRef(gst_pipeline_get_bus(GST_PIPELINE(context.pipeline)));
+    GstMessageType types = static_cast<GstMessageType>(GST_MESSAGE_ASYNC_DONE | GST_MESSAGE_ERROR | GST_MESSAGE_TAG);
+    GOwnPtr<gchar> codec;
+    bool done = false;
+    bool result = false;
+
+    while (!done) {
+        GstMessage* message = gst_bus_timed_pop_filtered(bus.get(), gProbeTimeout, types);
+        if (!message) {
+            g_set_error_literal(error, GST_STREAM_ERROR, GST_STREAM_ERROR_FAILED, "Timed out while probing");
+            break;
+        }
+
+        switch (GST_MESSAGE_TYPE(message)) {
+        case GST_MESSAGE_TAG: {
+            GstTagList* tags = 0;
+            gst_message_parse_tag(message, &tags);
+            if (!codec)
+                gst_tag_list_get_string(tags, GST_TAG_AUDIO_CODEC, &codec.outPtr());
+#ifdef GST_API_VERSION_1
+            gst_tag_list_unref(tags);
+#else
+            gst_tag_list_free(tags);
+#endif
+            break;
+        }
+        case GST_MESSAGE_ERROR:
+            gst_message_parse_error(message, error, 0);
+            done = true;
+            break;
+        case GST_MESSAGE_ASYNC_DONE:
+            result = true;
+            done = true;
+            break;
+        default:
+            break;
+        }
+        gst_message_unref(message);
+    }
+
+    if (result && !context.audioPad) {
+        g_set_error_literal(error, GST_STREAM_ERROR, GST_STREAM_ERROR_WRONG_TYPE, "No audio stream found");
+        result = false;
+    }
+
+    if (result) {
+        info.audioTracks = context.audioTracks;
+#ifdef GST_API_VERSION_1
+        GstCaps* caps = gst_pad_get_current_caps(context.audioPad);
+#else
+        GstCaps* caps = gst_pad_get_negotiated_caps(context.audioPad);
+#endif
+        if (caps) {
+            GstStructure* structure = gst_caps_get_structure(caps, 0);
+            gint channels = 0;
+            gint sampleRate = 0;
+            gst_structure_get_int(structure, "channels", &channels);
+            gst_structure_get_int(structure, "rate", &sampleRate);
+            info.channels = channels;
+            info.sampleRate = sampleRate;
+            gst_caps_unref(caps);
+        }
+
+        gint64 duration = -1;
+#ifdef GST_API_VERSION_1
+        if (gst_element_query_duration(context.pipeline, GST_FORMAT_TIME, &duration) && duration >= 0)
+#else
+        GstFormat format = GST_FORMAT_TIME;
+        if (gst_element_query_duration(context.pipeline, &format, &duration) && duration >= 0)
+#endif
+            info.duration = duration;
+
+        GstQuery* query = gst_query_new_seeking(GST_FORMAT_TIME);
+        if (gst_element_query(context.pipeline, query)) {
+            gboolean seekable = FALSE;
+            gst_query_parse_seeking(query, 0, &seekable, 0, 0);
+            info.seekable = seekable;
+        }
+        gst_query_unref(query);
+
+        if (codec)
+            info.codec = codec.get();
+    }
+
+    gst_element_set_state(context.pipeline, GST_STATE_NULL);
+    if (context.audioPad)
+        gst_object_unref(GST_OBJECT(context.audioPad));
+    gst_object_unref(GST_OBJECT(context.pipeline));
+    return result;
+}
+
+void clearAudioStreamProbeCache()
+{
+    std::lock_guard<std::mutex> lock(gProbeCacheMutex);
+    gProbeCache.clear();
+    gProbeCacheEntries.clear();
+}
+
+void setAudioStreamProbeCacheLimit(size_t limit)
+{
+    std::lock_guard<std::mutex> lock(gProbeCacheMutex);
+    gProbeCacheLimit = limit;
+    trimProbeCache();
+}
@@ -0,0 +1,62 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef AudioStreamProbe_h
+#define AudioStreamProbe_h
+
+#include <gst/gst.h>
+#include <string>
+
+// Stream properties gathered without running the full
+// decode ! deinterleave ! appsink pipeline.
+struct AudioStreamInfo {
+    AudioStreamInfo()
+        : duration(GST_CLOCK_TIME_NONE)
+        , channels(0)
+        , sampleRate(0)
+        , seekable(false)
+        , audioTracks(0)
+    {
+    }
+
+    // Of the first audio track.
+    GstClockTime duration;
+    unsigned channels;
+    unsigned sampleRate;
+    std::string codec;
+    bool seekable;
+    // Audio streams in the container, the track numbers accepted by
+    // AudioStreamChannelsReader::setAudioTrack() go up to this.
+    unsigned audioTracks;
+};
+
+// Files are probed with GstDiscoverer and the result (including
+// failures) is cached by file identity (device, inode, size and
+// mtime), so asking again about an unchanged file costs one stat().
+// The cache keeps the most recently used entries, 256 by default.
+bool probeAudioFile(const char* filePath, AudioStreamInfo&, GError** = 0);
+
+// Memory blobs are prerolled through giostreamsrc ! decodebin ! fakesink
+// and are never cached.
+bool probeAudioData(const void* data, size_t dataSize, AudioStreamInfo&, GError** = 0);
+
+void clearAudioStreamProbeCache();
+// Evicts least recently used entries down to limit right away.
+void setAudioStreamProbeCacheLimit(size_t limit);
+
+#endif // AudioStreamProbe_h
@@ -0,0 +1,200 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "BatchDecoder.h"
+
+#include <algorithm>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "AudioStreamChannelsReader.h"
+#include "GOwnPtr.h"
+
+BatchDecoder::BatchDecoder(const std::vector<std::string>& filePaths, const BatchDecoderConfig& config)
+    : m_filePaths(filePaths)
+    , m_config(config)
+    , m_entries(filePaths.size())
+    , m_completed(0)
+    , m_nextToStart(0)
+    , m_stopping(false)
+{
+    m_config.concurrentDecodes = std::max(m_config.concurrentDecodes, 1u);
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+BatchDecoder::~BatchDecoder()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_readAheadCondition.notify_one();
+    if (m_readAheadThread.joinable())
+        m_readAheadThread.join();
+}
+
+void BatchDecoder::run(ResultCallback callback)
+{
+    ASSERT(!m_context);
+    m_callback = callback;
+    m_context = adoptGRef(g_main_context_new());
+    m_loop = adoptGRef(g_main_loop_new(m_context.get(), FALSE));
+    gint64 begin = g_get_monotonic_time();
+
+    // The first pipelines get going right away, read-ahead starts with
+    // the files after them.
+    for (unsigned i = 0; i < m_config.concurrentDecodes; ++i)
+        startNextDecode();
+    if (m_config.readAheadFiles)
+        m_readAheadThread = std::thread(&BatchDecoder::readAheadLoop, this);
+
+    if (m_completed < m_entries.size())
+        g_main_loop_run(m_loop.get());
+    m_stats.elapsedMicroseconds = g_get_monotonic_time() - begin;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_readAheadCondition.notify_one();
+    if (m_readAheadThread.joinable())
+        m_readAheadThread.join();
+}
+
+void BatchDecoder::startNextDecode()
+{
+    size_t index;
+    bool fromMemory;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_nextToStart >= m_entries.size())
+            return;
+        index = m_nextToStart++;
+        // A file still being loaded is decoded from its path, its reads
+        // warm the page cache all the same.
+        fromMemory = m_entries[index].state == EntryLoaded;
+        m_entries[index].state = EntryStarted;
+        if (fromMemory)
+            ++m_stats.filesDecodedFromMemory;
+    }
+    m_readAheadCondition.notify_one();
+
+    Entry& entry = m_entries[index];
+    if (fromMemory)
+        entry.reader.reset(new AudioStreamChannelsReader(entry.data.data(), entry.data.size()));
+    else
+        entry.reader.reset(new AudioStreamChannelsReader(m_filePaths[index].c_str()));
+    entry.reader->setDeadlines(m_config.deadlines);
+    entry.reader->start(m_config.sampleRate, m_config.mixToMono, m_context.get(), [this, index](std::unique_ptr<AudioBus> bus, const GError* error) {
+        didFinishDecode(index, std::move(bus), error);
+    });
+}
+
+void BatchDecoder::didFinishDecode(size_t index, std::unique_ptr<AudioBus> bus, const GError* error)
+{
+    if (error) {
+        ++m_stats.filesFailed;
+        if (error->domain == AUDIO_READER_ERROR && error->code != AudioReaderErrorNoSuchTrack)
+            ++m_stats.filesTimedOut;
+    } else
+        ++m_stats.filesDecoded;
+    m_callback(index, std::move(bus), error);
+
+    // This pipeline already went to NULL before the completion ran, only
+    // the reader and the file data are left to free, which the next
+    // decode doesn't need to wait for.
+    startNextDecode();
+
+    Entry& entry = m_entries[index];
+    entry.reader.reset();
+    std::vector<char>().swap(entry.data);
+
+    if (++m_completed == m_entries.size())
+        g_main_loop_quit(m_loop.get());
+}
+
+void BatchDecoder::readAheadLoop()
+{
+    for (size_t index = 0; index < m_entries.size(); ++index) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_readAheadCondition.wait(lock, [this, index] {
+                return m_stopping || index < m_nextToStart + m_config.readAheadFiles;
+            });
+            if (m_stopping)
+                return;
+            if (m_entries[index].state != EntryPending)
+                continue;
+            m_entries[index].state = EntryLoading;
+        }
+
+        std::vector<char> data;
+        ReadAheadResult result = readAhead(m_filePaths[index], data);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (result == ReadAheadLoaded) {
+            ++m_stats.filesPrefetched;
+            m_stats.bytesPrefetched += data.size();
+        } else if (result == ReadAheadAdvised)
+            ++m_stats.filesAdvised;
+        // Too late if the decode started meanwhile.
+        if (m_entries[index].state != EntryLoading)
+            continue;
+        // A file that can't be opened is left to the reader to fail on.
+        if (result == ReadAheadFailed)
+            m_entries[index].state = EntryPending;
+        else
+            m_entries[index].state = result == ReadAheadLoaded ? EntryLoaded : EntryAdvised;
+        m_entries[index].data.swap(data);
+    }
+}
+
+// Loads small files into data. Larger ones, or ones that can't be read
+// whole, only get their pages requested into the cache.
+BatchDecoder::ReadAheadResult BatchDecoder::readAhead(const std::string& filePath, std::vector<char>& data)
+{
+    int fd = open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return ReadAheadFailed;
+
+    struct stat status;
+    bool loaded = false;
+    if (!fstat(fd, &status) && S_ISREG(status.st_mode) && static_cast<size_t>(status.st_size) <= m_config.memoryPrefetchLimit) {
+        data.resize(status.st_size);
+        size_t offset = 0;
+        while (offset < data.size()) {
+            ssize_t bytesRead = pread(fd, &data[offset], data.size() - offset, offset);
+            if (bytesRead < 0 && errno == EINTR)
+                continue;
+            if (bytesRead <= 0)
+                break;
+            offset += bytesRead;
+        }
+        loaded = offset == data.size() && !data.empty();
+        if (!loaded)
+            std::vector<char>().swap(data);
+    }
+
+    if (!loaded)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+    return loaded ? ReadAheadLoaded : ReadAheadAdvised;
+}
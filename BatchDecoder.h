@@ -0,0 +1,147 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef BatchDecoder_h
+#define BatchDecoder_h
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gst/gst.h>
+
+#include "AudioBus.h"
+#include "AudioStreamChannelsReader.h"
+#include "GRefPtr.h"
+
+struct BatchDecoderConfig {
+    BatchDecoderConfig()
+        : sampleRate(44100)
+        , mixToMono(false)
+        , concurrentDecodes(2)
+        , readAheadFiles(2)
+        , memoryPrefetchLimit(64 << 20)
+    {
+        deadlines.preroll = 10 * GST_SECOND;
+        deadlines.firstBuffer = 10 * GST_SECOND;
+        deadlines.stall = 30 * GST_SECOND;
+    }
+
+    float sampleRate;
+    bool mixToMono;
+    // Pipelines in flight. With 2 the next file prerolls while the
+    // current one decodes and is torn down, 1 decodes strictly one
+    // after the other.
+    unsigned concurrentDecodes;
+    // Files past the ones being decoded whose bytes are requested
+    // ahead of time, 0 to disable read-ahead.
+    unsigned readAheadFiles;
+    // Read-ahead files up to this size are loaded into memory and
+    // decoded from there, which also helps storage that ignores
+    // posix_fadvise(). Larger files are only advised.
+    size_t memoryPrefetchLimit;
+    // A corrupt or unsupported file must not hold its pipeline slot
+    // forever.
+    AudioReaderDeadlines deadlines;
+};
+
+struct BatchDecoderStats {
+    unsigned filesDecoded;
+    unsigned filesFailed;
+    // Failed files that ran into one of the deadlines.
+    unsigned filesTimedOut;
+    // Files whose bytes were requested with POSIX_FADV_WILLNEED.
+    unsigned filesAdvised;
+    // Files loaded into memory ahead, and how many of them were
+    // actually decoded from there instead of from the path.
+    unsigned filesPrefetched;
+    unsigned filesDecodedFromMemory;
+    guint64 bytesPrefetched;
+    gint64 elapsedMicroseconds;
+};
+
+// Decodes a list of files while a background thread reads the next
+// ones ahead, so their disk reads are not stuck behind the EOS and
+// teardown of the current decode. Meant for cold caches on spinning or
+// network storage.
+class BatchDecoder {
+public:
+    // Called once per file, in completion order, on the thread running
+    // run(). The error is only valid for the duration of the call.
+    typedef std::function<void(size_t index, std::unique_ptr<AudioBus>, const GError*)> ResultCallback;
+
+    BatchDecoder(const std::vector<std::string>& filePaths, const BatchDecoderConfig& = BatchDecoderConfig());
+    ~BatchDecoder();
+
+    // Blocks until every file has been decoded or failed.
+    void run(ResultCallback);
+    const BatchDecoderStats& stats() const { return m_stats; }
+
+private:
+    enum EntryState {
+        EntryPending,
+        EntryLoading,
+        EntryLoaded,
+        EntryAdvised,
+        EntryStarted
+    };
+
+    enum ReadAheadResult {
+        ReadAheadFailed,
+        ReadAheadAdvised,
+        ReadAheadLoaded
+    };
+
+    struct Entry {
+        Entry()
+            : state(EntryPending)
+        {
+        }
+
+        EntryState state;
+        std::vector<char> data;
+        std::unique_ptr<AudioStreamChannelsReader> reader;
+    };
+
+    void startNextDecode();
+    void didFinishDecode(size_t index, std::unique_ptr<AudioBus>, const GError*);
+    void readAheadLoop();
+    ReadAheadResult readAhead(const std::string& filePath, std::vector<char>& data);
+
+    std::vector<std::string> m_filePaths;
+    BatchDecoderConfig m_config;
+    std::vector<Entry> m_entries;
+    BatchDecoderStats m_stats;
+    ResultCallback m_callback;
+
+    GRefPtr<GMainContext> m_context;
+    GRefPtr<GMainLoop> m_loop;
+    size_t m_completed;
+
+    std::mutex m_mutex;
+    std::condition_variable m_readAheadCondition;
+    size_t m_nextToStart;
+    bool m_stopping;
+    std::thread m_readAheadThread;
+};
+
+#endif // BatchDecoder_h
@@ -0,0 +1,511 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "CompactAudioBus.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_F16C_DISPATCH 1
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "GOwnPtr.h"
+
+const size_t CompactAudioBus::blockFrames;
+
+// Lossless blocks are read with unaligned 64 bit loads, which may run
+// this far past the last packed value.
+static const size_t gLosslessPadding = 8;
+
+// Every Lossless block starts with its predictor, shift and width.
+static const size_t gLosslessHeaderSize = 3;
+
+enum LosslessPredictor {
+    PredictFloatBits,
+    PredictIntegerFirstOrder,
+    PredictIntegerSecondOrder
+};
+
+// Integer samples are counted in units of 2^-24.
+static const float gIntegerScale = 16777216;
+
+static inline uint32_t floatBits(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static inline float bitsToFloat(uint32_t bits)
+{
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static uint16_t floatToHalf(float value)
+{
+    uint32_t bits = floatBits(value);
+    uint16_t sign = (bits >> 16) & 0x8000;
+    uint32_t magnitude = bits & 0x7fffffff;
+
+    if (magnitude >= 0x7f800000)
+        return sign | 0x7c00 | (magnitude > 0x7f800000 ? 0x200 : 0);
+    // 65520 and above round to infinity.
+    if (magnitude >= 0x477ff000)
+        return sign | 0x7c00;
+    // Below 2^-25 everything rounds to zero.
+    if (magnitude < 0x33000000)
+        return sign;
+
+    uint32_t result;
+    uint32_t remainder;
+    uint32_t halfway;
+    if (magnitude < 0x38800000) {
+        // Subnormal half, in units of 2^-24.
+        unsigned shift = 126 - (magnitude >> 23);
+        uint32_t mantissa = (magnitude & 0x7fffff) | 0x800000;
+        result = mantissa >> shift;
+        remainder = mantissa & ((1u << shift) - 1);
+        halfway = 1u << (shift - 1);
+    } else {
+        uint32_t rebiased = magnitude - 0x38000000;
+        result = rebiased >> 13;
+        remainder = rebiased & 0x1fff;
+        halfway = 0x1000;
+    }
+    if (remainder > halfway || (remainder == halfway && (result & 1)))
+        ++result;
+    return sign | result;
+}
+
+static float halfToFloat(uint16_t half)
+{
+    uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+    uint32_t exponent = (half >> 10) & 0x1f;
+    uint32_t mantissa = half & 0x3ff;
+
+    if (exponent == 0x1f)
+        return bitsToFloat(sign | 0x7f800000 | (mantissa << 13));
+    if (exponent)
+        return bitsToFloat(sign | ((exponent + 112) << 23) | (mantissa << 13));
+    float subnormal = mantissa * (1.0f / 16777216);
+    return sign ? -subnormal : subnormal;
+}
+
+#if HAVE_F16C_DISPATCH
+// The build doesn't assume F16C, these are compiled for it on their own
+// and only called once the CPU is known to have it. Both round to
+// nearest even like the scalar conversions. Return the frames done.
+static bool cpuHasF16C()
+{
+    // The 256 bit forms also need the OS to save the AVX state.
+    static const bool supported = __builtin_cpu_supports("f16c") && __builtin_cpu_supports("avx");
+    return supported;
+}
+
+__attribute__((target("f16c"))) static size_t floatsToHalvesF16C(const float* source, uint16_t* destination, size_t frames)
+{
+    size_t i = 0;
+    for (; i + 8 <= frames; i += 8)
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i), _mm256_cvtps_ph(_mm256_loadu_ps(source + i), 0));
+    return i;
+}
+
+__attribute__((target("f16c"))) static size_t halvesToFloatsF16C(const uint16_t* source, float* destination, size_t frames)
+{
+    size_t i = 0;
+    for (; i + 8 <= frames; i += 8)
+        _mm256_storeu_ps(destination + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i))));
+    return i;
+}
+#endif
+
+// Two's complement view of the sign-magnitude float bits: neighbouring
+// samples get close integers and trailing zero bits are preserved.
+// Negative zero takes 0x80000000, which nothing else maps to.
+static inline uint32_t mapFloatBits(uint32_t bits)
+{
+    uint32_t magnitude = bits & 0x7fffffff;
+    if (!(bits & 0x80000000))
+        return magnitude;
+    return magnitude ? 0u - magnitude : 0x80000000;
+}
+
+static inline uint32_t unmapFloatBits(uint32_t mapped)
+{
+    if (mapped == 0x80000000)
+        return mapped;
+    if (mapped & 0x80000000)
+        return 0x80000000 | (0u - mapped);
+    return mapped;
+}
+
+static inline uint64_t loadUnaligned64(const uint8_t* data)
+{
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+// Turns the residuals into zigzag codes without the low bits they all
+// share (16 bit sources leave most of them empty), and returns the
+// width needed to pack them.
+static unsigned prepareResiduals(uint32_t* residuals, size_t frames, unsigned& shift)
+{
+    uint32_t setBits = 0;
+    for (size_t i = 0; i < frames; ++i)
+        setBits |= residuals[i];
+    shift = setBits ? __builtin_ctz(setBits) : 0;
+
+    uint32_t zigzagBits = 0;
+    for (size_t i = 0; i < frames; ++i) {
+        int32_t value = static_cast<int32_t>(residuals[i]) >> shift;
+        residuals[i] = (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+        zigzagBits |= residuals[i];
+    }
+    return zigzagBits ? 32 - __builtin_clz(zigzagBits) : 0;
+}
+
+static void packResiduals(uint8_t* destination, const uint32_t* residuals, size_t frames, unsigned width)
+{
+    uint64_t accumulator = 0;
+    unsigned bits = 0;
+    for (size_t i = 0; i < frames; ++i) {
+        accumulator |= static_cast<uint64_t>(residuals[i]) << bits;
+        bits += width;
+        while (bits >= 8) {
+            *destination++ = accumulator & 0xff;
+            accumulator >>= 8;
+            bits -= 8;
+        }
+    }
+    if (bits)
+        *destination = accumulator & 0xff;
+}
+
+// Inverse of prepareResiduals() and packResiduals().
+class ResidualReader {
+public:
+    ResidualReader(const uint8_t* data, unsigned shift, unsigned width)
+        : m_data(data)
+        , m_shift(shift)
+        , m_width(width)
+        , m_mask((static_cast<uint64_t>(1) << width) - 1)
+        , m_bitPosition(0)
+    {
+    }
+
+    uint32_t next()
+    {
+        if (!m_width)
+            return 0;
+        uint32_t zigzag = (loadUnaligned64(m_data + (m_bitPosition >> 3)) >> (m_bitPosition & 7)) & m_mask;
+        m_bitPosition += m_width;
+        return static_cast<uint32_t>((zigzag >> 1) ^ (0u - (zigzag & 1))) << m_shift;
+    }
+
+private:
+    const uint8_t* m_data;
+    unsigned m_shift;
+    unsigned m_width;
+    uint64_t m_mask;
+    size_t m_bitPosition;
+};
+
+CompactAudioBus::CompactAudioBus(unsigned numberOfChannels, float sampleRate, CompactSampleFormat format)
+    : m_channels(numberOfChannels)
+    , m_length(0)
+    , m_sampleRate(sampleRate)
+    , m_format(format)
+{
+    for (auto& channel : m_channels)
+        channel.pending.reserve(blockFrames);
+}
+
+std::unique_ptr<CompactAudioBus> CompactAudioBus::create(unsigned numberOfChannels, float sampleRate, CompactSampleFormat format)
+{
+    return std::unique_ptr<CompactAudioBus>(new CompactAudioBus(numberOfChannels, sampleRate, format));
+}
+
+std::unique_ptr<CompactAudioBus> CompactAudioBus::createFromBus(const AudioBus& bus, CompactSampleFormat format)
+{
+    std::unique_ptr<CompactAudioBus> compactBus = create(bus.numberOfChannels(), bus.sampleRate(), format);
+    for (unsigned i = 0; i < bus.numberOfChannels(); ++i)
+        compactBus->append(i, bus.channel(i)->data(), bus.length());
+    compactBus->finish();
+    return compactBus;
+}
+
+void CompactAudioBus::append(unsigned channelIndex, const float* samples, size_t frames)
+{
+    ASSERT(channelIndex < m_channels.size());
+    Channel& channel = m_channels[channelIndex];
+    channel.length += frames;
+
+    while (frames) {
+        if (channel.pending.empty() && frames >= blockFrames) {
+            encodeBlock(channel, samples, blockFrames);
+            samples += blockFrames;
+            frames -= blockFrames;
+            continue;
+        }
+
+        size_t count = std::min(frames, blockFrames - channel.pending.size());
+        channel.pending.insert(channel.pending.end(), samples, samples + count);
+        samples += count;
+        frames -= count;
+        if (channel.pending.size() == blockFrames) {
+            encodeBlock(channel, channel.pending.data(), blockFrames);
+            channel.pending.clear();
+        }
+    }
+}
+
+void CompactAudioBus::finish()
+{
+    m_length = 0;
+    for (auto& channel : m_channels)
+        m_length = std::max(m_length, channel.length);
+
+    static const std::vector<float> silence(blockFrames, 0);
+    for (unsigned i = 0; i < m_channels.size(); ++i) {
+        Channel& channel = m_channels[i];
+        while (channel.length < m_length)
+            append(i, silence.data(), std::min(blockFrames, m_length - channel.length));
+
+        if (!channel.pending.empty())
+            encodeBlock(channel, channel.pending.data(), channel.pending.size());
+        std::vector<float>().swap(channel.pending);
+
+        if (m_format == CompactLossless)
+            channel.data.resize(channel.data.size() + gLosslessPadding, 0);
+        channel.data.shrink_to_fit();
+        channel.blockOffsets.shrink_to_fit();
+    }
+}
+
+size_t CompactAudioBus::memoryUsage() const
+{
+    size_t bytes = 0;
+    for (auto& channel : m_channels)
+        bytes += channel.data.capacity() + channel.blockOffsets.capacity() * sizeof(size_t) + channel.pending.capacity() * sizeof(float);
+    return bytes;
+}
+
+void CompactAudioBus::encodeBlock(Channel& channel, const float* samples, size_t frames)
+{
+    size_t start = channel.data.size();
+
+    switch (m_format) {
+    case CompactFloat16: {
+        channel.data.resize(start + frames * sizeof(uint16_t));
+        uint16_t* destination = reinterpret_cast<uint16_t*>(&channel.data[start]);
+        size_t i = 0;
+#if HAVE_F16C_DISPATCH
+        if (cpuHasF16C())
+            i = floatsToHalvesF16C(samples, destination, frames);
+#endif
+        for (; i < frames; ++i)
+            destination[i] = floatToHalf(samples[i]);
+        break;
+    }
+    case CompactInt16: {
+        channel.data.resize(start + frames * sizeof(int16_t));
+        int16_t* destination = reinterpret_cast<int16_t*>(&channel.data[start]);
+        size_t i = 0;
+#ifdef __SSE2__
+        // packs saturates, which is exactly the clipping we want.
+        const __m128 scale = _mm_set1_ps(32768);
+        for (; i + 8 <= frames; i += 8) {
+            __m128i low = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(samples + i), scale));
+            __m128i high = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(samples + i + 4), scale));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i), _mm_packs_epi32(low, high));
+        }
+#endif
+        for (; i < frames; ++i)
+            destination[i] = static_cast<int16_t>(std::max(-32768L, std::min(32767L, lrintf(samples[i] * 32768))));
+        break;
+    }
+    case CompactLossless: {
+        channel.blockOffsets.push_back(start);
+
+        // Samples of 16 and 24 bit sources are integer multiples of
+        // 2^-24, which predict much better as integers than through
+        // their float bit patterns.
+        int32_t integers[blockFrames];
+        bool isInteger = true;
+        for (size_t i = 0; i < frames && isInteger; ++i) {
+            float scaled = samples[i] * gIntegerScale;
+            isInteger = std::fabs(scaled) < 2147483648.0f;
+            if (isInteger) {
+                integers[i] = static_cast<int32_t>(scaled);
+                isInteger = floatBits(integers[i] * (1 / gIntegerScale)) == floatBits(samples[i]);
+            }
+        }
+
+        uint32_t residuals[blockFrames];
+        unsigned shift;
+        unsigned width;
+        LosslessPredictor predictor;
+        if (isInteger) {
+            uint32_t secondOrder[blockFrames];
+            uint32_t previous = 0;
+            uint32_t beforePrevious = 0;
+            for (size_t i = 0; i < frames; ++i) {
+                uint32_t value = integers[i];
+                residuals[i] = value - previous;
+                secondOrder[i] = value - (2 * previous - beforePrevious);
+                beforePrevious = previous;
+                previous = value;
+            }
+            unsigned secondOrderShift;
+            width = prepareResiduals(residuals, frames, shift);
+            unsigned secondOrderWidth = prepareResiduals(secondOrder, frames, secondOrderShift);
+            predictor = PredictIntegerFirstOrder;
+            if (secondOrderWidth < width) {
+                memcpy(residuals, secondOrder, frames * sizeof(uint32_t));
+                width = secondOrderWidth;
+                shift = secondOrderShift;
+                predictor = PredictIntegerSecondOrder;
+            }
+        } else {
+            uint32_t previous = 0;
+            for (size_t i = 0; i < frames; ++i) {
+                uint32_t mapped = mapFloatBits(floatBits(samples[i]));
+                residuals[i] = mapped - previous;
+                previous = mapped;
+            }
+            width = prepareResiduals(residuals, frames, shift);
+            predictor = PredictFloatBits;
+        }
+
+        channel.data.resize(start + gLosslessHeaderSize + (frames * width + 7) / 8);
+        uint8_t* destination = &channel.data[start];
+        destination[0] = predictor;
+        destination[1] = shift;
+        destination[2] = width;
+        packResiduals(destination + gLosslessHeaderSize, residuals, frames, width);
+        break;
+    }
+    }
+}
+
+void CompactAudioBus::decodeBlock(const Channel& channel, size_t block, size_t offset, size_t frames, float* destination) const
+{
+    switch (m_format) {
+    case CompactFloat16: {
+        const uint16_t* source = reinterpret_cast<const uint16_t*>(&channel.data[0]) + block * blockFrames + offset;
+        size_t i = 0;
+#if HAVE_F16C_DISPATCH
+        if (cpuHasF16C())
+            i = halvesToFloatsF16C(source, destination, frames);
+#endif
+        for (; i < frames; ++i)
+            destination[i] = halfToFloat(source[i]);
+        break;
+    }
+    case CompactInt16: {
+        const int16_t* source = reinterpret_cast<const int16_t*>(&channel.data[0]) + block * blockFrames + offset;
+        size_t i = 0;
+#ifdef __SSE2__
+        const __m128 scale = _mm_set1_ps(1.0f / 32768);
+        for (; i + 8 <= frames; i += 8) {
+            __m128i samples = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i));
+            __m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16);
+            __m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16);
+            _mm_storeu_ps(destination + i, _mm_mul_ps(_mm_cvtepi32_ps(low), scale));
+            _mm_storeu_ps(destination + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(high), scale));
+        }
+#endif
+        for (; i < frames; ++i)
+            destination[i] = source[i] * (1.0f / 32768);
+        break;
+    }
+    case CompactLossless: {
+        // Residuals only make sense from the start of the block.
+        const uint8_t* source = &channel.data[channel.blockOffsets[block]];
+        LosslessPredictor predictor = static_cast<LosslessPredictor>(source[0]);
+        ResidualReader residuals(source + gLosslessHeaderSize, source[1], source[2]);
+        size_t end = offset + frames;
+        destination -= offset;
+
+        uint32_t previous = 0;
+        uint32_t beforePrevious = 0;
+        switch (predictor) {
+        case PredictFloatBits:
+            for (size_t i = 0; i < end; ++i) {
+                previous += residuals.next();
+                if (i >= offset)
+                    destination[i] = bitsToFloat(unmapFloatBits(previous));
+            }
+            break;
+        case PredictIntegerFirstOrder:
+            for (size_t i = 0; i < end; ++i) {
+                previous += residuals.next();
+                if (i >= offset)
+                    destination[i] = static_cast<int32_t>(previous) * (1 / gIntegerScale);
+            }
+            break;
+        case PredictIntegerSecondOrder:
+            for (size_t i = 0; i < end; ++i) {
+                uint32_t value = 2 * previous - beforePrevious + residuals.next();
+                beforePrevious = previous;
+                previous = value;
+                if (i >= offset)
+                    destination[i] = static_cast<int32_t>(value) * (1 / gIntegerScale);
+            }
+            break;
+        }
+        break;
+    }
+    }
+}
+
+bool CompactAudioBus::read(unsigned channelIndex, size_t startFrame, size_t frames, float* destination) const
+{
+    if (channelIndex >= m_channels.size() || startFrame > m_length || frames > m_length - startFrame)
+        return false;
+
+    const Channel& channel = m_channels[channelIndex];
+    while (frames) {
+        size_t block = startFrame / blockFrames;
+        size_t offset = startFrame - block * blockFrames;
+        size_t count = std::min(frames, blockFrames - offset);
+        decodeBlock(channel, block, offset, count, destination);
+        startFrame += count;
+        destination += count;
+        frames -= count;
+    }
+    return true;
+}
+
+std::unique_ptr<AudioBus> CompactAudioBus::toAudioBus() const
+{
+    std::unique_ptr<AudioBus> bus = AudioBus::create(m_channels.size(), m_length);
+    bus->setSampleRate(m_sampleRate);
+    for (unsigned i = 0; i < m_channels.size(); ++i)
+        read(i, 0, m_length, bus->channel(i)->mutableData());
+    return bus;
+}
@@ -0,0 +1,101 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef CompactAudioBus_h
+#define CompactAudioBus_h
+
+#include <cstddef>
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+#include "AudioBus.h"
+
+enum CompactSampleFormat {
+    // IEEE half floats, about 11 bits of precision. Lossy.
+    CompactFloat16,
+    // 16 bit integers scaled by 32768, exact for 16 bit sources that
+    // were not resampled. Lossy otherwise.
+    CompactInt16,
+    // Bit exact: per block prediction residuals packed at the narrowest
+    // width the block needs. Blocks of 16 or 24 bit samples are
+    // predicted as integers, anything else through the float bits.
+    CompactLossless
+};
+
+// Planar decoded audio kept in a compact sample format, split in
+// blocks of blockFrames so any range can be decoded without touching
+// the rest of the channel. Memory is half of the float AudioBus with
+// Float16 and Int16. Lossless depends on the signal: 16 bit sources
+// typically take a third to a half, other float data 70-90%.
+//
+// Filled through append(), where every channel may be fed from its own
+// thread, then finish(). Reading is only valid after finish() and is
+// safe from several threads.
+class CompactAudioBus {
+public:
+    static const size_t blockFrames = 4096;
+
+    static std::unique_ptr<CompactAudioBus> create(unsigned numberOfChannels, float sampleRate, CompactSampleFormat);
+    static std::unique_ptr<CompactAudioBus> createFromBus(const AudioBus&, CompactSampleFormat);
+
+    void append(unsigned channel, const float* samples, size_t frames);
+    // Encodes the partial last blocks and pads shorter channels with
+    // silence up to the longest one.
+    void finish();
+
+    unsigned numberOfChannels() const { return m_channels.size(); }
+    size_t length() const { return m_length; }
+    float sampleRate() const { return m_sampleRate; }
+    CompactSampleFormat format() const { return m_format; }
+
+    // Heap bytes held by the encoded samples and the block index.
+    size_t memoryUsage() const;
+
+    // Decodes frames [startFrame, startFrame + frames) of channel into
+    // destination. Returns false if the range is out of bounds.
+    bool read(unsigned channel, size_t startFrame, size_t frames, float* destination) const;
+    std::unique_ptr<AudioBus> toAudioBus() const;
+
+private:
+    struct Channel {
+        Channel()
+            : length(0)
+        {
+        }
+
+        std::vector<uint8_t> data;
+        // Start of every block in data, only needed by Lossless where
+        // blocks vary in size.
+        std::vector<size_t> blockOffsets;
+        std::vector<float> pending;
+        size_t length;
+    };
+
+    CompactAudioBus(unsigned numberOfChannels, float sampleRate, CompactSampleFormat);
+
+    void encodeBlock(Channel&, const float* samples, size_t frames);
+    void decodeBlock(const Channel&, size_t block, size_t offset, size_t frames, float* destination) const;
+
+    std::vector<Channel> m_channels;
+    size_t m_length;
+    float m_sampleRate;
+    CompactSampleFormat m_format;
+};
+
+#endif // CompactAudioBus_h
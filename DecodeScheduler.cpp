@@ -0,0 +1,232 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "DecodeScheduler.h"
+
+#include <algorithm>
+#include <cstring>
+#include <gio/gio.h>
+#include <thread>
+
+#include "GOwnPtr.h"
+
+DecodeScheduler::DecodeScheduler(GMainContext* context, const DecodeSchedulerConfig& config)
+    : m_context(context)
+    , m_config(config)
+    , m_nextId(1)
+{
+    if (!m_config.maxPipelines)
+        m_config.maxPipelines = std::max(std::thread::hardware_concurrency(), 1u);
+    memset(m_stats, 0, sizeof(m_stats));
+}
+
+DecodeScheduler::~DecodeScheduler()
+{
+}
+
+DecodeScheduler::JobId DecodeScheduler::submit(const char* filePath, DecodePriority priority, AudioStreamChannelsReader::CompletionCallback completion)
+{
+    std::unique_ptr<Job> job(new Job);
+    job->id = m_nextId++;
+    job->filePath = filePath;
+    job->priority = priority;
+    job->completion = completion;
+    job->submitTime = g_get_monotonic_time();
+    job->startTime = 0;
+    job->pausedSince = 0;
+
+    JobId id = job->id;
+    m_queues[priority].push_back(std::move(job));
+    ++m_stats[priority].submitted;
+    ++m_stats[priority].queued;
+    schedule();
+    return id;
+}
+
+bool DecodeScheduler::cancel(JobId id)
+{
+    for (unsigned i = 0; i < DecodePriorityCount; ++i) {
+        auto& queue = m_queues[i];
+        for (auto it = queue.begin(); it != queue.end(); ++it) {
+            if ((*it)->id != id)
+                continue;
+
+            std::unique_ptr<Job> job = std::move(*it);
+            queue.erase(it);
+            --m_stats[i].queued;
+            ++m_stats[i].cancelled;
+            GOwnPtr<GError> error(g_error_new_literal(G_IO_ERROR, G_IO_ERROR_CANCELLED, "Decoding was cancelled"));
+            job->completion(std::unique_ptr<AudioBus>(), error.get());
+            return true;
+        }
+    }
+
+    for (auto& job : m_running) {
+        if (job->id != id)
+            continue;
+        if (job->reader->isFinished())
+            return false;
+        job->reader->cancel();
+        return true;
+    }
+    return false;
+}
+
+void DecodeScheduler::schedule()
+{
+    while (scheduleOne()) { }
+}
+
+// Starts, resumes or makes room for at most one job, the highest
+// priority one that can go. Returns whether anything changed.
+bool DecodeScheduler::scheduleOne()
+{
+    unsigned active = activePipelines();
+    for (unsigned i = 0; i < DecodePriorityCount; ++i) {
+        DecodePriority priority = static_cast<DecodePriority>(i);
+        Job* paused = oldestPausedJob(priority);
+        if (!paused && m_queues[i].empty())
+            continue;
+
+        // A paused job already holds its class slot, lower classes may
+        // still use whatever this one can't.
+        unsigned limit = m_config.classLimits[i];
+        if (!paused && limit && m_stats[i].running >= limit)
+            continue;
+
+        if (active >= m_config.maxPipelines) {
+            // Lower classes can only be worse off.
+            Job* victim = m_config.preemptLowerPriorities ? preemptionVictim(priority) : 0;
+            if (!victim)
+                return false;
+            pauseJob(victim);
+        }
+
+        if (paused)
+            resumeJob(paused);
+        else {
+            std::unique_ptr<Job> job = std::move(m_queues[i].front());
+            m_queues[i].pop_front();
+            startJob(std::move(job));
+        }
+        return true;
+    }
+    return false;
+}
+
+void DecodeScheduler::startJob(std::unique_ptr<Job> job)
+{
+    DecodeClassStats& stats = m_stats[job->priority];
+    job->startTime = g_get_monotonic_time();
+    gint64 queueTime = job->startTime - job->submitTime;
+    stats.totalQueueTime += queueTime;
+    stats.maxQueueTime = std::max(stats.maxQueueTime, queueTime);
+    --stats.queued;
+    ++stats.running;
+
+    JobId id = job->id;
+    job->reader.reset(new AudioStreamChannelsReader(job->filePath.c_str()));
+    job->reader->setDeadlines(m_config.deadlines);
+    job->reader->start(m_config.sampleRate, m_config.mixToMono, m_context.get(), [this, id](std::unique_ptr<AudioBus> bus, const GError* error) {
+        didFinishJob(id, std::move(bus), error);
+    });
+    m_running.push_back(std::move(job));
+}
+
+void DecodeScheduler::pauseJob(Job* job)
+{
+    job->reader->setPaused(true);
+    job->pausedSince = g_get_monotonic_time();
+    ++m_stats[job->priority].preempted;
+    ++m_stats[job->priority].paused;
+}
+
+void DecodeScheduler::resumeJob(Job* job)
+{
+    DecodeClassStats& stats = m_stats[job->priority];
+    stats.totalPausedTime += g_get_monotonic_time() - job->pausedSince;
+    --stats.paused;
+    job->pausedSince = 0;
+    job->reader->setPaused(false);
+}
+
+void DecodeScheduler::didFinishJob(JobId id, std::unique_ptr<AudioBus> bus, const GError* error)
+{
+    auto it = std::find_if(m_running.begin(), m_running.end(), [id](const std::unique_ptr<Job>& job) { return job->id == id; });
+    ASSERT(it != m_running.end());
+    std::unique_ptr<Job> job = std::move(*it);
+    m_running.erase(it);
+
+    DecodeClassStats& stats = m_stats[job->priority];
+    gint64 now = g_get_monotonic_time();
+    if (job->pausedSince) {
+        stats.totalPausedTime += now - job->pausedSince;
+        --stats.paused;
+    }
+    --stats.running;
+    gint64 serviceTime = now - job->startTime;
+    stats.totalServiceTime += serviceTime;
+    stats.maxServiceTime = std::max(stats.maxServiceTime, serviceTime);
+    if (!error)
+        ++stats.completed;
+    else if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        ++stats.cancelled;
+    else
+        ++stats.failed;
+
+    job->completion(std::move(bus), error);
+
+    // The reader goes away from within its own completion, which it
+    // allows. Its slot is handed on right after.
+    job.reset();
+    schedule();
+}
+
+DecodeScheduler::Job* DecodeScheduler::oldestPausedJob(DecodePriority priority) const
+{
+    for (auto& job : m_running) {
+        if (job->priority == priority && job->pausedSince)
+            return job.get();
+    }
+    return 0;
+}
+
+// The most recently started active job of the lowest class below
+// priority, it has the least decoding time to hold in memory.
+DecodeScheduler::Job* DecodeScheduler::preemptionVictim(DecodePriority priority) const
+{
+    Job* victim = 0;
+    for (auto it = m_running.rbegin(); it != m_running.rend(); ++it) {
+        Job* job = it->get();
+        if (job->pausedSince || job->priority <= priority || job->reader->isFinished())
+            continue;
+        if (!victim || job->priority > victim->priority)
+            victim = job;
+    }
+    return victim;
+}
+
+unsigned DecodeScheduler::activePipelines() const
+{
+    unsigned active = 0;
+    for (auto& job : m_running) {
+        if (!job->pausedSince)
+            ++active;
+    }
+    return active;
+}
@@ -0,0 +1,142 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef DecodeScheduler_h
+#define DecodeScheduler_h
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gst/gst.h>
+
+#include "AudioStreamChannelsReader.h"
+#include "GRefPtr.h"
+
+// Lower values are served first.
+enum DecodePriority {
+    // Previews and other decodes someone is waiting for.
+    DecodePriorityInteractive,
+    // Archival and batch work.
+    DecodePriorityBulk,
+    DecodePriorityCount
+};
+
+struct DecodeSchedulerConfig {
+    DecodeSchedulerConfig()
+        : sampleRate(44100)
+        , mixToMono(false)
+        , maxPipelines(0)
+        , preemptLowerPriorities(true)
+    {
+        classLimits[DecodePriorityInteractive] = 0;
+        classLimits[DecodePriorityBulk] = 2;
+    }
+
+    float sampleRate;
+    bool mixToMono;
+    // Pipelines decoding at the same time, paused ones don't count. 0
+    // for one per CPU.
+    unsigned maxPipelines;
+    // Pipelines of each class, paused ones included. 0 leaves the class
+    // bound by maxPipelines only.
+    unsigned classLimits[DecodePriorityCount];
+    // When every pipeline is busy, pause one of a lower class to start
+    // a waiting job of a higher one. It goes on once a slot frees up
+    // and nothing above it waits.
+    bool preemptLowerPriorities;
+    AudioReaderDeadlines deadlines;
+};
+
+// Times in microseconds.
+struct DecodeClassStats {
+    unsigned submitted;
+    unsigned completed;
+    unsigned failed;
+    unsigned cancelled;
+    // Times a pipeline of this class got paused for a higher one.
+    unsigned preempted;
+    // Current state, running includes the paused ones.
+    unsigned queued;
+    unsigned running;
+    unsigned paused;
+    // From submit() to the pipeline being started.
+    gint64 totalQueueTime;
+    gint64 maxQueueTime;
+    // From the pipeline being started to its completion, paused time
+    // included.
+    gint64 totalServiceTime;
+    gint64 maxServiceTime;
+    gint64 totalPausedTime;
+};
+
+// Runs decodes on a shared context by priority class, with a cap on the
+// pipelines of each class, so that interactive requests don't wait
+// behind long bulk jobs. Not thread-safe: call it from the thread
+// iterating context, where the completions run too.
+class DecodeScheduler {
+public:
+    typedef guint64 JobId;
+
+    DecodeScheduler(GMainContext*, const DecodeSchedulerConfig& = DecodeSchedulerConfig());
+    // Running decodes are torn down and queued ones dropped, neither
+    // gets its completion.
+    ~DecodeScheduler();
+
+    JobId submit(const char* filePath, DecodePriority, AudioStreamChannelsReader::CompletionCallback);
+    // A queued job completes right away, a running one once its
+    // pipeline is gone, both with G_IO_ERROR_CANCELLED. Returns false
+    // for unknown or finished jobs.
+    bool cancel(JobId);
+
+    const DecodeClassStats& stats(DecodePriority priority) const { return m_stats[priority]; }
+
+private:
+    struct Job {
+        JobId id;
+        std::string filePath;
+        DecodePriority priority;
+        AudioStreamChannelsReader::CompletionCallback completion;
+        std::unique_ptr<AudioStreamChannelsReader> reader;
+        gint64 submitTime;
+        gint64 startTime;
+        // 0 unless preempted.
+        gint64 pausedSince;
+    };
+
+    void schedule();
+    bool scheduleOne();
+    void startJob(std::unique_ptr<Job>);
+    void pauseJob(Job*);
+    void resumeJob(Job*);
+    void didFinishJob(JobId, std::unique_ptr<AudioBus>, const GError*);
+    Job* oldestPausedJob(DecodePriority) const;
+    Job* preemptionVictim(DecodePriority) const;
+    unsigned activePipelines() const;
+
+    GRefPtr<GMainContext> m_context;
+    DecodeSchedulerConfig m_config;
+    DecodeClassStats m_stats[DecodePriorityCount];
+    std::deque<std::unique_ptr<Job> > m_queues[DecodePriorityCount];
+    // In start order.
+    std::vector<std::unique_ptr<Job> > m_running;
+    JobId m_nextId;
+};
+
+#endif // DecodeScheduler_h
@@ -65,6 +65,17 @@ public:
             refGPtr(ptr);
     }
 
+    // Moving hands the reference over, no ref/unref pair involved.
+    GRefPtr(GRefPtr&& o)
+        : m_ptr(o.leakRef())
+    {
+    }
+
+    template <typename U> GRefPtr(GRefPtr<U>&& o)
+        : m_ptr(o.leakRef())
+    {
+    }
+
     ~GRefPtr()
     {
         if (T* ptr = m_ptr)
@@ -101,6 +112,7 @@ public:
     operator UnspecifiedBoolType() const { return m_ptr ? &GRefPtr::m_ptr : 0; }
 
     GRefPtr& operator=(const GRefPtr&);
+    GRefPtr& operator=(GRefPtr&&);
     GRefPtr& operator=(T*);
     template <typename U> GRefPtr& operator=(const GRefPtr<U>&);
 
@@ -127,6 +139,17 @@ template <typename T> inline GRefPtr<T>& GRefPtr<T>::operator=(const GRefPtr<T>&
     return *this;
 }
 
+template <typename T> inline GRefPtr<T>& GRefPtr<T>::operator=(GRefPtr<T>&& o)
+{
+    if (this == &o)
+        return *this;
+    T* ptr = m_ptr;
+    m_ptr = o.leakRef();
+    if (ptr)
+        derefGPtr(ptr);
+    return *this;
+}
+
 template <typename T> inline GRefPtr<T>& GRefPtr<T>::operator=(T* optr)
 {
     T* ptr = m_ptr;
@@ -0,0 +1,162 @@
+/*
+ *  Copyright (C) 2011 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "GRefPtrGStreamer.h"
+
+#include "GOwnPtr.h"
+
+namespace Nix {
+
+static void gstObjectRefSink(gpointer ptr)
+{
+#ifdef GST_API_VERSION_1
+    gst_object_ref_sink(ptr);
+#else
+    // GstObject has its own floating flag in 0.10, g_object_ref_sink
+    // doesn't know about it.
+    gst_object_ref(ptr);
+    gst_object_sink(ptr);
+#endif
+}
+
+template <> GRefPtr<GstElement> adoptGRef(GstElement* ptr)
+{
+    ASSERT(!ptr || !GST_OBJECT_IS_FLOATING(GST_OBJECT(ptr)));
+    return GRefPtr<GstElement>(ptr, GRefPtrAdopt);
+}
+
+template <> GstElement* refGPtr<GstElement>(GstElement* ptr)
+{
+    if (ptr)
+        gstObjectRefSink(ptr);
+    return ptr;
+}
+
+template <> void derefGPtr<GstElement>(GstElement* ptr)
+{
+    if (ptr)
+        gst_object_unref(ptr);
+}
+
+template <> GstPad* refGPtr<GstPad>(GstPad* ptr)
+{
+    if (ptr)
+        gstObjectRefSink(ptr);
+    return ptr;
+}
+
+template <> void derefGPtr<GstPad>(GstPad* ptr)
+{
+    if (ptr)
+        gst_object_unref(ptr);
+}
+
+template <> GstBus* refGPtr<GstBus>(GstBus* ptr)
+{
+    if (ptr)
+        gstObjectRefSink(ptr);
+    return ptr;
+}
+
+template <> void derefGPtr<GstBus>(GstBus* ptr)
+{
+    if (ptr)
+        gst_object_unref(ptr);
+}
+
+template <> GstElementFactory* refGPtr<GstElementFactory>(GstElementFactory* ptr)
+{
+    if (ptr)
+        gst_object_ref(ptr);
+    return ptr;
+}
+
+template <> void derefGPtr<GstElementFactory>(GstElementFactory* ptr)
+{
+    if (ptr)
+        gst_object_unref(ptr);
+}
+
+template <> GstCaps* refGPtr<GstCaps>(GstCaps* ptr)
+{
+    if (ptr)
+        gst_caps_ref(ptr);
+    return ptr;
+}
+
+template <> void derefGPtr<GstCaps>(GstCaps* ptr)
+{
+    if (ptr)
+        gst_caps_unref(ptr);
+}
+
+template <> GstBuffer* refGPtr<GstBuffer>(GstBuffer* ptr)
+{
+    if (ptr)
+        gst_buffer_ref(ptr);
+    return ptr;
+}
+
+template <> void derefGPtr<GstBuffer>(GstBuffer* ptr)
+{
+    if (ptr)
+        gst_buffer_unref(ptr);
+}
+
+template <> GstBufferList* refGPtr<GstBufferList>(GstBufferList* ptr)
+{
+    if (ptr)
+        gst_buffer_list_ref(ptr);
+    return ptr;
+}
+
+template <> void derefGPtr<GstBufferList>(GstBufferList* ptr)
+{
+    if (ptr)
+        gst_buffer_list_unref(ptr);
+}
+
+template <> GstMessage* refGPtr<GstMessage>(GstMessage* ptr)
+{
+    if (ptr)
+        gst_message_ref(ptr);
+    return ptr;
+}
+
+template <> void derefGPtr<GstMessage>(GstMessage* ptr)
+{
+    if (ptr)
+        gst_message_unref(ptr);
+}
+
+#ifdef GST_API_VERSION_1
+template <> GstSample* refGPtr<GstSample>(GstSample* ptr)
+{
+    if (ptr)
+        gst_sample_ref(ptr);
+    return ptr;
+}
+
+template <> void derefGPtr<GstSample>(GstSample* ptr)
+{
+    if (ptr)
+        gst_sample_unref(ptr);
+}
+#endif
+
+} // namespace Nix
@@ -0,0 +1,63 @@
+/*
+ *  Copyright (C) 2011 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef GRefPtrGStreamer_h
+#define GRefPtrGStreamer_h
+
+#include "GRefPtr.h"
+
+#include <gst/gst.h>
+
+namespace Nix {
+
+// GstObjects are sunk when a GRefPtr takes them, so a freshly created
+// (floating) element can be held right away. adoptGRef() on an element
+// is only valid for references that are already owned.
+template <> GRefPtr<GstElement> adoptGRef(GstElement* ptr);
+template <> GstElement* refGPtr<GstElement>(GstElement* ptr);
+template <> void derefGPtr<GstElement>(GstElement* ptr);
+
+template <> GstPad* refGPtr<GstPad>(GstPad* ptr);
+template <> void derefGPtr<GstPad>(GstPad* ptr);
+
+template <> GstBus* refGPtr<GstBus>(GstBus* ptr);
+template <> void derefGPtr<GstBus>(GstBus* ptr);
+
+template <> GstElementFactory* refGPtr<GstElementFactory>(GstElementFactory* ptr);
+template <> void derefGPtr<GstElementFactory>(GstElementFactory* ptr);
+
+template <> GstCaps* refGPtr<GstCaps>(GstCaps* ptr);
+template <> void derefGPtr<GstCaps>(GstCaps* ptr);
+
+template <> GstBuffer* refGPtr<GstBuffer>(GstBuffer* ptr);
+template <> void derefGPtr<GstBuffer>(GstBuffer* ptr);
+
+template <> GstBufferList* refGPtr<GstBufferList>(GstBufferList* ptr);
+template <> void derefGPtr<GstBufferList>(GstBufferList* ptr);
+
+template <> GstMessage* refGPtr<GstMessage>(GstMessage* ptr);
+template <> void derefGPtr<GstMessage>(GstMessage* ptr);
+
+#ifdef GST_API_VERSION_1
+template <> GstSample* refGPtr<GstSample>(GstSample* ptr);
+template <> void derefGPtr<GstSample>(GstSample* ptr);
+#endif
+
+} // namespace Nix
+
+#endif // GRefPtrGStreamer_h
@@ -18,8 +18,46 @@
 
 
 #include "GStreamerUtilities.h"
+#include <cstdio>
+#include <cstring>
 #include <gst/gst.h>
 
+#ifdef GST_API_VERSION_1
+#include <gst/audio/audio.h>
+#endif
+
+#ifdef GST_API_VERSION_1
+static const char* gRegistryVariable = "GST_REGISTRY_1_0";
+static const char* gDecodebinName = "decodebin";
+#else
+static const char* gRegistryVariable = "GST_REGISTRY";
+static const char* gDecodebinName = "decodebin2";
+#endif
+
+struct ResolvedFactory {
+    const char* name;
+    GstElementFactory* factory;
+};
+
+// Everything the reader pipelines are built from.
+static ResolvedFactory gResolvedFactories[] = {
+    { "filesrc", 0 },
+    { "giostreamsrc", 0 },
+    { "fdsrc", 0 },
+    { "pulsesrc", 0 },
+    { 0, 0 }, // decodebin, filled in at resolve time.
+    { "audioconvert", 0 },
+    { "audioresample", 0 },
+    { "capsfilter", 0 },
+    { "deinterleave", 0 },
+    { "queue", 0 },
+    { "tee", 0 },
+    { "appsink", 0 },
+    { "appsrc", 0 },
+    { "concat", 0 },
+};
+
+static GStreamerStartupTimes gStartupTimes = { 0, 0, 0, false };
 
 bool initializeGStreamer()
 {
@@ -28,11 +66,96 @@ bool initializeGStreamer()
         return true;
 #endif
 
-    GError *error;
+    gint64 start = g_get_monotonic_time();
+    GError *error = 0;
     bool gstInitialized = gst_init_check(0, 0, &error);
     if (!gstInitialized) {
         fprintf(stderr, "GStreamer initialization failed: %s", error ? error->message : "unknown error occurred");
     }
+    gStartupTimes.initMicroseconds = g_get_monotonic_time() - start;
     return gstInitialized;
 }
 
+static void resolveElementFactories()
+{
+    gint64 start = g_get_monotonic_time();
+    for (unsigned i = 0; i < G_N_ELEMENTS(gResolvedFactories); ++i) {
+        if (!gResolvedFactories[i].name)
+            gResolvedFactories[i].name = gDecodebinName;
+        // The table keeps the reference for the lifetime of the process.
+        gResolvedFactories[i].factory = gst_element_factory_find(gResolvedFactories[i].name);
+    }
+    demuxerFactories();
+    gStartupTimes.factoryResolveMicroseconds = g_get_monotonic_time() - start;
+}
+
+bool initializeGStreamerWithPinnedRegistry(const char* registryPath)
+{
+#if GST_CHECK_VERSION(0, 10, 31)
+    if (gst_is_initialized())
+        return true;
+#endif
+
+    // Only let GStreamer scan (and write the cache) when there is no
+    // cache to pin yet.
+    bool registryExists = g_file_test(registryPath, G_FILE_TEST_IS_REGULAR);
+    g_setenv(gRegistryVariable, registryPath, TRUE);
+    if (registryExists)
+        g_setenv("GST_REGISTRY_UPDATE", "no", TRUE);
+    g_setenv("GST_REGISTRY_FORK", "no", TRUE);
+    gst_registry_fork_set_enabled(FALSE);
+
+    if (!initializeGStreamer())
+        return false;
+
+    gStartupTimes.registryPinned = registryExists;
+#ifdef GST_API_VERSION_1
+    GList* features = gst_registry_get_feature_list(gst_registry_get(), GST_TYPE_ELEMENT_FACTORY);
+#else
+    GList* features = gst_registry_get_feature_list(gst_registry_get_default(), GST_TYPE_ELEMENT_FACTORY);
+#endif
+    gStartupTimes.registryFeatureCount = g_list_length(features);
+    gst_plugin_feature_list_free(features);
+
+    resolveElementFactories();
+    return true;
+}
+
+GstElement* makeGStreamerElement(const char* factoryName, const char* name)
+{
+    for (unsigned i = 0; i < G_N_ELEMENTS(gResolvedFactories); ++i) {
+        const ResolvedFactory& entry = gResolvedFactories[i];
+        if (entry.factory && !strcmp(entry.name, factoryName))
+            return gst_element_factory_create(entry.factory, name);
+    }
+
+    return gst_element_factory_make(factoryName, name);
+}
+
+GList* demuxerFactories()
+{
+    // Kept for the lifetime of the process, like the resolved table.
+    static GList* factories = gst_element_factory_list_get_elements(GST_ELEMENT_FACTORY_TYPE_DEMUXER, GST_RANK_MARGINAL);
+    return factories;
+}
+
+const GStreamerStartupTimes& gstreamerStartupTimes()
+{
+    return gStartupTimes;
+}
+
+GstCaps* getGstAudioCaps(int channels, float sampleRate)
+{
+#ifdef GST_API_VERSION_1
+    return gst_caps_new_simple("audio/x-raw", "rate", G_TYPE_INT, static_cast<int>(sampleRate),
+        "channels", G_TYPE_INT, channels,
+        "format", G_TYPE_STRING, gst_audio_format_to_string(GST_AUDIO_FORMAT_F32),
+        "layout", G_TYPE_STRING, "interleaved", NULL);
+#else
+    //return gst_caps_new_simple("audio/x-raw-float", "rate", G_TYPE_INT, static_cast<int>(sampleRate),
+    return gst_caps_new_simple("audio/x-raw-float", "rate", G_TYPE_INT, static_cast<int>(44100),
+        "channels", G_TYPE_INT, channels,
+        "endianness", G_TYPE_INT, G_BYTE_ORDER,
+        "width", G_TYPE_INT, 32, NULL);
+#endif
+}
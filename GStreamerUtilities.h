@@ -29,4 +29,38 @@
     LOG_VERBOSE(Media, __VA_ARGS__); } while (0)
 */
 
+#ifndef GStreamerUtilities_h
+#define GStreamerUtilities_h
+
+#include <gst/gst.h>
+
 bool initializeGStreamer();
+
+// Startup mode for short-lived processes: load the registry from a
+// pinned cache file without scanning plugin paths or forking a
+// scanner, then resolve the factories of every element the reader
+// creates. If registryPath doesn't exist yet it gets generated by this
+// first run.
+bool initializeGStreamerWithPinnedRegistry(const char* registryPath);
+
+// Like gst_element_factory_make(), but skips the registry lookup for
+// the elements resolved at startup.
+GstElement* makeGStreamerElement(const char* factoryName, const char* name);
+
+// Demuxer factories of at least marginal rank, looked up in the
+// registry once. The list belongs to GStreamerUtilities.
+GList* demuxerFactories();
+
+struct GStreamerStartupTimes {
+    gint64 initMicroseconds;
+    gint64 factoryResolveMicroseconds;
+    unsigned registryFeatureCount;
+    bool registryPinned;
+};
+
+const GStreamerStartupTimes& gstreamerStartupTimes();
+
+// Interleaved float caps, as produced for and by the reader.
+GstCaps* getGstAudioCaps(int channels, float sampleRate);
+
+#endif // GStreamerUtilities_h
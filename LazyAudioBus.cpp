@@ -0,0 +1,262 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "LazyAudioBus.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "AudioStreamChannelsReader.h"
+#include "AudioStreamProbe.h"
+#include "GOwnPtr.h"
+#include "GRefPtr.h"
+
+// Decoded and discarded on each side of a block, see gSegmentOverlap
+// in SegmentedAudioDecoder.cpp.
+static const GstClockTime gBlockOverlap = 200 * GST_MSECOND;
+
+LazyAudioBus::LazyAudioBus(const char* filePath, bool mixToMono, float sampleRate, const LazyAudioBusConfig& config)
+    : m_filePath(filePath)
+    , m_mixToMono(mixToMono)
+    , m_sampleRate(sampleRate)
+    , m_numberOfChannels(mixToMono ? 1 : 2)
+    , m_length(0)
+    , m_blockFrames(1)
+    , m_config(config)
+    , m_lastBlockRead(static_cast<size_t>(-1))
+    , m_stopping(false)
+{
+    // Prefetched blocks must not push out the one being read.
+    m_config.cacheBlocks = std::max(m_config.cacheBlocks, m_config.prefetchBlocks + 2);
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+LazyAudioBus::~LazyAudioBus()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+        m_prefetchQueue.clear();
+    }
+    m_prefetchCondition.notify_one();
+    if (m_prefetchThread.joinable())
+        m_prefetchThread.join();
+}
+
+std::unique_ptr<LazyAudioBus> LazyAudioBus::create(const char* filePath, bool mixToMono, float sampleRate, const LazyAudioBusConfig& config)
+{
+    AudioStreamInfo info;
+    GOwnPtr<GError> error;
+    if (!probeAudioFile(filePath, info, &error.outPtr())) {
+        fprintf(stderr, "Unsupported input %s: %s\n", filePath, error->message);
+        return std::unique_ptr<LazyAudioBus>();
+    }
+
+    std::unique_ptr<LazyAudioBus> lazyBus(new LazyAudioBus(filePath, mixToMono, sampleRate, config));
+
+#ifdef GST_API_VERSION_1
+    if (info.seekable && GST_CLOCK_TIME_IS_VALID(info.duration)) {
+        guint64 rate = static_cast<guint64>(sampleRate);
+        lazyBus->m_length = gst_util_uint64_scale_round(info.duration, rate, GST_SECOND);
+        lazyBus->m_blockFrames = std::max<guint64>(1, gst_util_uint64_scale_round(config.blockDuration, rate, GST_SECOND));
+        return lazyBus;
+    }
+#endif
+
+    std::unique_ptr<AudioBus> bus = AudioStreamChannelsReader(filePath).createBus(sampleRate, mixToMono);
+    if (!bus)
+        return std::unique_ptr<LazyAudioBus>();
+
+    lazyBus->m_length = bus->length();
+    lazyBus->m_blockFrames = std::max<size_t>(1, bus->length());
+    std::lock_guard<std::mutex> lock(lazyBus->m_mutex);
+    lazyBus->storeBlock(0, std::move(bus));
+    return lazyBus;
+}
+
+bool LazyAudioBus::read(unsigned channel, size_t startFrame, size_t frames, float* destination)
+{
+    if (channel >= m_numberOfChannels || startFrame > m_length || frames > m_length - startFrame)
+        return false;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    size_t frame = startFrame;
+    size_t endFrame = startFrame + frames;
+    while (frame < endFrame) {
+        size_t index = frame / m_blockFrames;
+        Block* block = acquireBlock(index, lock);
+        if (!block)
+            return false;
+
+        size_t offset = frame - index * m_blockFrames;
+        size_t count = std::min(endFrame - frame, m_blockFrames - offset);
+        memcpy(destination, block->bus->channel(channel)->data() + offset, count * sizeof(float));
+        destination += count;
+        frame += count;
+
+        // Staying in a block or moving on to the next one looks like a
+        // sequential scan, anything else like random access.
+        if (index == m_lastBlockRead || index == m_lastBlockRead + 1)
+            schedulePrefetch(index);
+        m_lastBlockRead = index;
+    }
+    return true;
+}
+
+LazyAudioBusStats LazyAudioBus::stats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
+
+// Called with lock held. Returns the ready block, decoding it on the
+// calling thread unless it is already being decoded elsewhere.
+LazyAudioBus::Block* LazyAudioBus::acquireBlock(size_t index, std::unique_lock<std::mutex>& lock)
+{
+    while (true) {
+        std::map<size_t, Block>::iterator it = m_blocks.find(index);
+        if (it == m_blocks.end())
+            break;
+
+        Block& block = it->second;
+        if (block.state == BlockReady) {
+            ++m_stats.hits;
+            m_lru.splice(m_lru.begin(), m_lru, block.lruPosition);
+            return &block;
+        }
+        if (block.state == BlockFailed)
+            return 0;
+        m_blockCondition.wait(lock);
+    }
+
+    ++m_stats.misses;
+    m_blocks[index].state = BlockDecoding;
+    lock.unlock();
+    std::unique_ptr<AudioBus> bus = decodeBlock(index);
+    lock.lock();
+    storeBlock(index, std::move(bus));
+
+    Block& block = m_blocks[index];
+    return block.state == BlockReady ? &block : 0;
+}
+
+// Called with lock held.
+void LazyAudioBus::storeBlock(size_t index, std::unique_ptr<AudioBus> bus)
+{
+    Block& block = m_blocks[index];
+    if (!bus)
+        block.state = BlockFailed;
+    else {
+        block.state = BlockReady;
+        block.bus = std::move(bus);
+        m_lru.push_front(index);
+        block.lruPosition = m_lru.begin();
+
+        while (m_lru.size() > m_config.cacheBlocks) {
+            m_blocks.erase(m_lru.back());
+            m_lru.pop_back();
+            ++m_stats.evictions;
+        }
+    }
+    m_blockCondition.notify_all();
+}
+
+// Called with lock held. Replaces whatever was queued before, which
+// belongs to an older position of the scan.
+void LazyAudioBus::schedulePrefetch(size_t index)
+{
+    m_prefetchQueue.clear();
+    for (size_t next = index + 1; next <= index + m_config.prefetchBlocks && next < blockCount(); ++next) {
+        if (!m_blocks.count(next))
+            m_prefetchQueue.push_back(next);
+    }
+    if (m_prefetchQueue.empty())
+        return;
+
+    if (!m_prefetchThread.joinable())
+        m_prefetchThread = std::thread(&LazyAudioBus::prefetchLoop, this);
+    m_prefetchCondition.notify_one();
+}
+
+void LazyAudioBus::prefetchLoop()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        m_prefetchCondition.wait(lock, [this] { return m_stopping || !m_prefetchQueue.empty(); });
+        if (m_stopping)
+            return;
+
+        size_t index = m_prefetchQueue.front();
+        m_prefetchQueue.pop_front();
+        if (m_blocks.count(index))
+            continue;
+
+        ++m_stats.prefetches;
+        m_blocks[index].state = BlockDecoding;
+        lock.unlock();
+        std::unique_ptr<AudioBus> bus = decodeBlock(index);
+        lock.lock();
+        storeBlock(index, std::move(bus));
+    }
+}
+
+#ifdef GST_API_VERSION_1
+std::unique_ptr<AudioBus> LazyAudioBus::decodeBlock(size_t index)
+{
+    guint64 rate = static_cast<guint64>(m_sampleRate);
+    guint64 firstFrame = static_cast<guint64>(index) * m_blockFrames;
+    guint64 endFrame = std::min<guint64>(firstFrame + m_blockFrames, m_length);
+    bool isLast = endFrame == m_length;
+
+    std::unique_ptr<AudioBus> block = AudioBus::create(m_numberOfChannels, endFrame - firstFrame);
+    block->setSampleRate(m_sampleRate);
+
+    GstClockTime keepStart = gst_util_uint64_scale(firstFrame, GST_SECOND, rate);
+    GstClockTime keepEnd = gst_util_uint64_scale(endFrame, GST_SECOND, rate);
+    GstClockTime start = keepStart > gBlockOverlap ? keepStart - gBlockOverlap : 0;
+    GstClockTime stop = isLast ? GST_CLOCK_TIME_NONE : keepEnd + gBlockOverlap;
+
+    GRefPtr<GMainContext> context = adoptGRef(g_main_context_new());
+    GRefPtr<GMainLoop> loop = adoptGRef(g_main_loop_new(context.get(), FALSE));
+    GMainLoop* loopPtr = loop.get();
+    bool failed = false;
+
+    AudioStreamChannelsReader reader(m_filePath.c_str());
+    reader.setSegment(start, stop);
+    reader.setDestination(block.get(), firstFrame, endFrame, firstFrame);
+    reader.start(m_sampleRate, m_mixToMono, context.get(), [&failed, loopPtr](std::unique_ptr<AudioBus>, const GError* error) {
+        if (error) {
+            g_warning("Block decoding failed: %s", error->message);
+            failed = true;
+        }
+        g_main_loop_quit(loopPtr);
+    });
+    g_main_loop_run(loop.get());
+
+    if (failed)
+        return std::unique_ptr<AudioBus>();
+    return block;
+}
+#else
+std::unique_ptr<AudioBus> LazyAudioBus::decodeBlock(size_t)
+{
+    // create() already decoded the whole file into block 0.
+    return std::unique_ptr<AudioBus>();
+}
+#endif
@@ -0,0 +1,127 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef LazyAudioBus_h
+#define LazyAudioBus_h
+
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <gst/gst.h>
+
+#include "AudioBus.h"
+
+struct LazyAudioBusConfig {
+    LazyAudioBusConfig()
+        : blockDuration(GST_SECOND)
+        , cacheBlocks(32)
+        , prefetchBlocks(2)
+    {
+    }
+
+    GstClockTime blockDuration;
+    // Decoded blocks kept around, least recently used ones go first.
+    unsigned cacheBlocks;
+    // Blocks decoded ahead in the background once reads look sequential.
+    unsigned prefetchBlocks;
+};
+
+struct LazyAudioBusStats {
+    guint64 hits;
+    guint64 misses;
+    guint64 prefetches;
+    guint64 evictions;
+};
+
+// Planar decoded audio of a file that is only decoded where it is read.
+// The file is split in fixed-size blocks, each one decoded on first
+// access by its own pipeline started through an accurate seek, like the
+// segments of createBusFromAudioFileInSegments(). Reading the first
+// samples therefore costs one block instead of the whole file.
+//
+// Non-seekable inputs, inputs of unknown duration and GStreamer 0.10
+// are decoded in full by create() and served from a single block.
+// Safe to read from several threads.
+class LazyAudioBus {
+public:
+    static std::unique_ptr<LazyAudioBus> create(const char* filePath, bool mixToMono, float sampleRate,
+        const LazyAudioBusConfig& = LazyAudioBusConfig());
+    ~LazyAudioBus();
+
+    unsigned numberOfChannels() const { return m_numberOfChannels; }
+    // Estimated from the probed duration, like a segmented decode.
+    size_t length() const { return m_length; }
+    float sampleRate() const { return m_sampleRate; }
+
+    // Copies frames [startFrame, startFrame + frames) of channel to
+    // destination, decoding the blocks that are not cached yet. Returns
+    // false if the range is out of bounds or a block failed to decode.
+    bool read(unsigned channel, size_t startFrame, size_t frames, float* destination);
+
+    LazyAudioBusStats stats() const;
+
+private:
+    enum BlockState {
+        BlockDecoding,
+        BlockReady,
+        BlockFailed
+    };
+
+    struct Block {
+        BlockState state;
+        std::unique_ptr<AudioBus> bus;
+        std::list<size_t>::iterator lruPosition;
+    };
+
+    LazyAudioBus(const char* filePath, bool mixToMono, float sampleRate, const LazyAudioBusConfig&);
+
+    size_t blockCount() const { return (m_length + m_blockFrames - 1) / m_blockFrames; }
+    Block* acquireBlock(size_t index, std::unique_lock<std::mutex>&);
+    void storeBlock(size_t index, std::unique_ptr<AudioBus>);
+    void schedulePrefetch(size_t index);
+    std::unique_ptr<AudioBus> decodeBlock(size_t index);
+    void prefetchLoop();
+
+    std::string m_filePath;
+    bool m_mixToMono;
+    float m_sampleRate;
+    unsigned m_numberOfChannels;
+    size_t m_length;
+    size_t m_blockFrames;
+    LazyAudioBusConfig m_config;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_blockCondition;
+    std::condition_variable m_prefetchCondition;
+    std::map<size_t, Block> m_blocks;
+    // Ready blocks, most recently used first.
+    std::list<size_t> m_lru;
+    std::deque<size_t> m_prefetchQueue;
+    size_t m_lastBlockRead;
+    LazyAudioBusStats m_stats;
+    std::thread m_prefetchThread;
+    bool m_stopping;
+};
+
+#endif // LazyAudioBus_h
@@ -0,0 +1,308 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "LoudnessMeter.h"
+
+#include <algorithm>
+#include <cmath>
+
+static const double gAbsoluteGate = -70;
+static const double gIntegratedRelativeGate = -10;
+static const double gRangeRelativeGate = -20;
+static const unsigned gMomentaryBlocks = 4;
+static const unsigned gShortTermBlocks = 30;
+
+// True peak interpolation: 4 phases of a 12 tap windowed sinc.
+static const unsigned gOversampling = 4;
+static const unsigned gTruePeakTaps = 12;
+
+struct Biquad {
+    Biquad()
+        : b0(1), b1(0), b2(0), a1(0), a2(0), z1(0), z2(0)
+    {
+    }
+
+    double process(double x)
+    {
+        double y = b0 * x + z1;
+        z1 = b1 * x - a1 * y + z2;
+        z2 = b2 * x - a2 * y;
+        return y;
+    }
+
+    double b0, b1, b2, a1, a2;
+    double z1, z2;
+};
+
+struct LoudnessMeter::ChannelState {
+    explicit ChannelState(float weight)
+        : weight(weight)
+        , sampleRate(0)
+        , blockFrames(0)
+        , blockSum(0)
+        , blockPosition(0)
+        , historyPosition(0)
+        , truePeak(0)
+        , samplePeak(0)
+    {
+        std::fill(history, history + 2 * gTruePeakTaps, 0.0f);
+    }
+
+    void configure(unsigned rate);
+
+    float weight;
+    unsigned sampleRate;
+    Biquad shelf;
+    Biquad highPass;
+    unsigned blockFrames;
+    double blockSum;
+    unsigned blockPosition;
+    // Mean square of every complete 100 ms block.
+    std::vector<double> blockPowers;
+    // Last samples, stored twice so the taps are always contiguous.
+    float history[2 * gTruePeakTaps];
+    unsigned historyPosition;
+    float truePeak;
+    float samplePeak;
+};
+
+void LoudnessMeter::ChannelState::configure(unsigned rate)
+{
+    sampleRate = rate;
+    blockFrames = std::max(rate / 10, 1u);
+
+    // BS.1770 K-weighting: a +4 dB high shelf modelling the head,
+    // then the RLB high-pass, both derived for this rate.
+    double k = std::tan(M_PI * 1681.974450955533 / rate);
+    double q = 0.7071752369554196;
+    double highGain = std::pow(10, 3.999843853973347 / 20);
+    double bandGain = std::pow(highGain, 0.4996667741545416);
+    double a0 = 1 + k / q + k * k;
+    shelf.b0 = (highGain + bandGain * k / q + k * k) / a0;
+    shelf.b1 = 2 * (k * k - highGain) / a0;
+    shelf.b2 = (highGain - bandGain * k / q + k * k) / a0;
+    shelf.a1 = 2 * (k * k - 1) / a0;
+    shelf.a2 = (1 - k / q + k * k) / a0;
+
+    k = std::tan(M_PI * 38.13547087602444 / rate);
+    q = 0.5003270373238773;
+    a0 = 1 + k / q + k * k;
+    highPass.b0 = 1;
+    highPass.b1 = -2;
+    highPass.b2 = 1;
+    highPass.a1 = 2 * (k * k - 1) / a0;
+    highPass.a2 = (1 - k / q + k * k) / a0;
+}
+
+static const float* truePeakCoefficients()
+{
+    static float coefficients[gOversampling][gTruePeakTaps];
+    static bool initialized = [] {
+        double halfWidth = gTruePeakTaps / 2 + 0.5;
+        for (unsigned phase = 0; phase < gOversampling; ++phase) {
+            for (unsigned tap = 0; tap < gTruePeakTaps; ++tap) {
+                // Distance from the interpolated point to the sample
+                // tap positions back in the history.
+                double distance = static_cast<double>(tap) - gTruePeakTaps / 2 + static_cast<double>(phase) / gOversampling;
+                double x = M_PI * distance;
+                double sinc = std::fabs(x) < 1e-9 ? 1 : std::sin(x) / x;
+                double ratio = distance / halfWidth;
+                double window = 0.5 + 0.5 * std::cos(M_PI * ratio);
+                coefficients[phase][tap] = sinc * window;
+            }
+        }
+        return true;
+    }();
+    (void)initialized;
+    return &coefficients[0][0];
+}
+
+static double loudness(double power)
+{
+    return power > 0 ? -0.691 + 10 * std::log10(power) : -HUGE_VAL;
+}
+
+static double decibels(float amplitude)
+{
+    return amplitude > 0 ? 20 * std::log10(amplitude) : -HUGE_VAL;
+}
+
+LoudnessInfo::LoudnessInfo()
+    : integrated(-HUGE_VAL)
+    , range(0)
+    , maxMomentary(-HUGE_VAL)
+    , maxShortTerm(-HUGE_VAL)
+    , truePeak(-HUGE_VAL)
+    , samplePeak(-HUGE_VAL)
+{
+}
+
+LoudnessMeter::LoudnessMeter(const std::vector<float>& channelWeights)
+{
+    for (float weight : channelWeights)
+        m_channels.push_back(std::unique_ptr<ChannelState>(new ChannelState(weight)));
+}
+
+LoudnessMeter::~LoudnessMeter()
+{
+}
+
+void LoudnessMeter::process(unsigned channelIndex, const float* samples, size_t frames, unsigned sampleRate)
+{
+    if (channelIndex >= m_channels.size() || !sampleRate)
+        return;
+
+    ChannelState& channel = *m_channels[channelIndex];
+    if (channel.sampleRate != sampleRate)
+        channel.configure(sampleRate);
+
+    const float* coefficients = truePeakCoefficients();
+    for (size_t i = 0; i < frames; ++i) {
+        float sample = samples[i];
+
+        double weighted = channel.highPass.process(channel.shelf.process(sample));
+        channel.blockSum += weighted * weighted;
+        if (++channel.blockPosition == channel.blockFrames) {
+            channel.blockPowers.push_back(channel.blockSum / channel.blockFrames);
+            channel.blockSum = 0;
+            channel.blockPosition = 0;
+        }
+
+        channel.samplePeak = std::max(channel.samplePeak, std::fabs(sample));
+
+        channel.history[channel.historyPosition] = sample;
+        channel.history[channel.historyPosition + gTruePeakTaps] = sample;
+        channel.historyPosition = (channel.historyPosition + 1) % gTruePeakTaps;
+        const float* window = channel.history + channel.historyPosition;
+        for (unsigned phase = 0; phase < gOversampling; ++phase) {
+            const float* phaseCoefficients = coefficients + phase * gTruePeakTaps;
+            float value = 0;
+            for (unsigned tap = 0; tap < gTruePeakTaps; ++tap)
+                value += phaseCoefficients[tap] * window[tap];
+            channel.truePeak = std::max(channel.truePeak, std::fabs(value));
+        }
+    }
+}
+
+static double percentile(std::vector<double>& sorted, double fraction)
+{
+    size_t index = std::min<size_t>(sorted.size() - 1, fraction * (sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+LoudnessInfo LoudnessMeter::result() const
+{
+    LoudnessInfo info;
+    if (m_channels.empty())
+        return info;
+
+    size_t blocks = m_channels[0]->blockPowers.size();
+    float truePeak = 0;
+    float samplePeak = 0;
+    for (const std::unique_ptr<ChannelState>& channel : m_channels) {
+        blocks = std::min(blocks, channel->blockPowers.size());
+        truePeak = std::max(truePeak, std::max(channel->truePeak, channel->samplePeak));
+        samplePeak = std::max(samplePeak, channel->samplePeak);
+    }
+    info.truePeak = decibels(truePeak);
+    info.samplePeak = decibels(samplePeak);
+
+    std::vector<double> powers(blocks, 0);
+    for (const std::unique_ptr<ChannelState>& channel : m_channels) {
+        if (!channel->weight)
+            continue;
+        for (size_t i = 0; i < blocks; ++i)
+            powers[i] += channel->weight * channel->blockPowers[i];
+    }
+
+    std::vector<double> momentaryPowers;
+    std::vector<double> shortTermPowers;
+    double windowSum = 0;
+    double longWindowSum = 0;
+    for (size_t i = 0; i < blocks; ++i) {
+        windowSum += powers[i];
+        longWindowSum += powers[i];
+        if (i >= gMomentaryBlocks)
+            windowSum -= powers[i - gMomentaryBlocks];
+        if (i >= gShortTermBlocks)
+            longWindowSum -= powers[i - gShortTermBlocks];
+
+        if (i + 1 >= gMomentaryBlocks) {
+            double power = std::max(windowSum, 0.0) / gMomentaryBlocks;
+            momentaryPowers.push_back(power);
+            info.momentary.push_back(loudness(power));
+            info.maxMomentary = std::max(info.maxMomentary, loudness(power));
+        }
+        if (i + 1 >= gShortTermBlocks) {
+            double power = std::max(longWindowSum, 0.0) / gShortTermBlocks;
+            shortTermPowers.push_back(power);
+            info.shortTerm.push_back(loudness(power));
+            info.maxShortTerm = std::max(info.maxShortTerm, loudness(power));
+        }
+    }
+
+    // Integrated loudness: 400 ms blocks, absolute then relative gate.
+    double gatedSum = 0;
+    size_t gatedCount = 0;
+    for (double power : momentaryPowers) {
+        if (loudness(power) > gAbsoluteGate) {
+            gatedSum += power;
+            ++gatedCount;
+        }
+    }
+    if (gatedCount) {
+        double relativeGate = loudness(gatedSum / gatedCount) + gIntegratedRelativeGate;
+        gatedSum = 0;
+        gatedCount = 0;
+        for (double power : momentaryPowers) {
+            double blockLoudness = loudness(power);
+            if (blockLoudness > gAbsoluteGate && blockLoudness > relativeGate) {
+                gatedSum += power;
+                ++gatedCount;
+            }
+        }
+        if (gatedCount)
+            info.integrated = loudness(gatedSum / gatedCount);
+    }
+
+    // Loudness range (EBU Tech 3342): spread between the 10th and 95th
+    // percentiles of the gated short-term loudness.
+    gatedSum = 0;
+    gatedCount = 0;
+    for (double power : shortTermPowers) {
+        if (loudness(power) > gAbsoluteGate) {
+            gatedSum += power;
+            ++gatedCount;
+        }
+    }
+    if (gatedCount) {
+        double relativeGate = loudness(gatedSum / gatedCount) + gRangeRelativeGate;
+        std::vector<double> gated;
+        for (double power : shortTermPowers) {
+            double blockLoudness = loudness(power);
+            if (blockLoudness > gAbsoluteGate && blockLoudness > relativeGate)
+                gated.push_back(blockLoudness);
+        }
+        if (!gated.empty()) {
+            std::sort(gated.begin(), gated.end());
+            info.range = percentile(gated, 0.95) - percentile(gated, 0.10);
+        }
+    }
+
+    return info;
+}
@@ -0,0 +1,69 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef LoudnessMeter_h
+#define LoudnessMeter_h
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// EBU R128 / ITU-R BS.1770 measurements of a decoded stream. Loudness
+// values are in LUFS (-HUGE_VAL for silence), the range in LU and the
+// peaks in dBTP and dBFS.
+struct LoudnessInfo {
+    LoudnessInfo();
+
+    double integrated;
+    double range;
+    double maxMomentary;
+    double maxShortTerm;
+    double truePeak;
+    double samplePeak;
+    // Momentary (400 ms) and short-term (3 s) loudness every 100 ms.
+    std::vector<float> momentary;
+    std::vector<float> shortTerm;
+};
+
+// Measures loudness as the samples stream by, so there is no second
+// pass over the decoded data. Each channel is K-weighted and folded into
+// 100 ms mean square blocks as it arrives, and keeps a 4x oversampled
+// true peak. Gating only needs those blocks and is done in result().
+//
+// Nothing is locked: process() only touches the state of its channel,
+// so channels can be fed from different threads.
+class LoudnessMeter {
+public:
+    // One BS.1770 weight per channel: 1 for the front channels, 1.41
+    // for the surrounds, 0 for LFE.
+    explicit LoudnessMeter(const std::vector<float>& channelWeights);
+    ~LoudnessMeter();
+
+    void process(unsigned channel, const float* samples, size_t frames, unsigned sampleRate);
+
+    // Reads every channel, so only once the last process() call has
+    // returned. The gating needs the whole stream anyway.
+    LoudnessInfo result() const;
+
+    struct ChannelState;
+
+private:
+    std::vector<std::unique_ptr<ChannelState> > m_channels;
+};
+
+#endif // LoudnessMeter_h
@@ -0,0 +1,323 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "OnsetDetector.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <gst/fft/gstfftf32.h>
+
+// Peak picking neighbourhoods, in seconds: the flux has to be the
+// maximum of [-30 ms, +30 ms] and exceed its mean over [-100 ms, +70 ms].
+static const double gPeakPreMax = 0.03;
+static const double gPeakPostMax = 0.03;
+static const double gPeakPreAverage = 0.1;
+static const double gPeakPostAverage = 0.07;
+
+// Tempo prior: log-normal around 120 BPM, one octave wide.
+static const double gPreferredBpm = 120;
+static const double gPreferredBpmOctaves = 1;
+
+struct OnsetDetector::ChannelState {
+    ChannelState()
+        : sampleRate(0)
+        , fft(0)
+        , filled(0)
+        , framesProduced(0)
+    {
+    }
+
+    ~ChannelState()
+    {
+        if (fft)
+            gst_fft_f32_free(fft);
+    }
+
+    void configure(unsigned rate, unsigned frameSize)
+    {
+        sampleRate = rate;
+        if (!fft)
+            fft = gst_fft_f32_new(frameSize, FALSE);
+        history.assign(frameSize, 0);
+        frame.resize(frameSize);
+        spectrum.resize(frameSize / 2 + 1);
+        previousMagnitudes.assign(frameSize / 2 + 1, 0);
+    }
+
+    float flux()
+    {
+        std::copy(history.begin(), history.end(), frame.begin());
+        gst_fft_f32_window(fft, frame.data(), GST_FFT_WINDOW_HAMMING);
+        gst_fft_f32_fft(fft, frame.data(), spectrum.data());
+
+        float sum = 0;
+        for (size_t i = 0; i < spectrum.size(); ++i) {
+            float magnitude = std::log1p(std::sqrt(spectrum[i].r * spectrum[i].r + spectrum[i].i * spectrum[i].i));
+            sum += std::max(magnitude - previousMagnitudes[i], 0.0f);
+            previousMagnitudes[i] = magnitude;
+        }
+        return sum / spectrum.size();
+    }
+
+    unsigned sampleRate;
+    GstFFTF32* fft;
+    // The last frameSize samples, the current hop filling its end.
+    std::vector<float> history;
+    unsigned filled;
+    std::vector<float> frame;
+    std::vector<GstFFTF32Complex> spectrum;
+    std::vector<float> previousMagnitudes;
+    // Written with the detector's mutex held.
+    size_t framesProduced;
+};
+
+OnsetDetector::OnsetDetector(unsigned numberOfChannels, const OnsetDetectorConfig& config)
+    : m_config(config)
+    , m_sampleRate(0)
+    , m_firstTimestamp(GST_CLOCK_TIME_NONE)
+    , m_completeFrames(0)
+    , m_pickedFrames(0)
+    , m_fluxSum(0)
+    , m_lastOnsetFrame(0)
+    , m_nextTempoFrame(0)
+{
+    // The real FFT needs an even frame.
+    m_config.frameSize = std::max(m_config.frameSize + (m_config.frameSize & 1), 16u);
+    m_config.hopSize = std::min(std::max(m_config.hopSize, 1u), m_config.frameSize);
+    m_config.minimumBpm = std::max(m_config.minimumBpm, 1.0f);
+    m_config.maximumBpm = std::max(m_config.maximumBpm, m_config.minimumBpm);
+    for (unsigned i = 0; i < numberOfChannels; ++i)
+        m_channels.push_back(std::unique_ptr<ChannelState>(new ChannelState));
+}
+
+OnsetDetector::~OnsetDetector()
+{
+}
+
+void OnsetDetector::process(unsigned channelIndex, const float* samples, size_t frames, unsigned sampleRate, GstClockTime timestamp)
+{
+    if (channelIndex >= m_channels.size() || !sampleRate)
+        return;
+
+    ChannelState& channel = *m_channels[channelIndex];
+    if (channel.sampleRate != sampleRate) {
+        channel.configure(sampleRate, m_config.frameSize);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_sampleRate) {
+            m_sampleRate = sampleRate;
+            m_nextTempoFrame = gst_util_uint64_scale(m_config.tempoWindow, sampleRate, GST_SECOND * m_config.hopSize);
+        }
+    }
+    if (!channelIndex && !channel.framesProduced && !channel.filled) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_firstTimestamp = timestamp;
+    }
+
+    unsigned hopStart = m_config.frameSize - m_config.hopSize;
+    while (frames) {
+        size_t count = std::min<size_t>(frames, m_config.hopSize - channel.filled);
+        std::copy(samples, samples + count, channel.history.begin() + hopStart + channel.filled);
+        channel.filled += count;
+        samples += count;
+        frames -= count;
+        if (channel.filled < m_config.hopSize)
+            break;
+
+        addFlux(channel, channel.flux());
+        std::copy(channel.history.begin() + m_config.hopSize, channel.history.end(), channel.history.begin());
+        channel.filled = 0;
+    }
+}
+
+void OnsetDetector::addFlux(ChannelState& channel, float flux)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    size_t index = channel.framesProduced++;
+    if (index >= m_flux.size())
+        m_flux.resize(index + 1, 0);
+    m_flux[index] += flux;
+
+    size_t complete = m_flux.size();
+    for (const std::unique_ptr<ChannelState>& state : m_channels)
+        complete = std::min(complete, state->framesProduced);
+    if (complete <= m_completeFrames)
+        return;
+    m_completeFrames = complete;
+    pickOnsets(complete);
+    estimateTempo(complete);
+}
+
+GstClockTime OnsetDetector::frameTime(size_t frame) const
+{
+    GstClockTime time = gst_util_uint64_scale(static_cast<guint64>(frame) * m_config.hopSize, GST_SECOND, m_sampleRate);
+    return GST_CLOCK_TIME_IS_VALID(m_firstTimestamp) ? m_firstTimestamp + time : time;
+}
+
+// Called with m_mutex held. Only looks at m_flux up to end.
+bool OnsetDetector::isOnset(size_t frame, size_t end, double meanFlux, size_t lastOnsetFrame) const
+{
+    double framesPerSecond = static_cast<double>(m_sampleRate) / m_config.hopSize;
+    size_t preMax = std::ceil(gPeakPreMax * framesPerSecond);
+    size_t postMax = std::ceil(gPeakPostMax * framesPerSecond);
+    size_t preAverage = std::ceil(gPeakPreAverage * framesPerSecond);
+    size_t postAverage = std::ceil(gPeakPostAverage * framesPerSecond);
+
+    float value = m_flux[frame];
+    if (value <= 0)
+        return false;
+    for (size_t i = frame > preMax ? frame - preMax : 0; i < std::min(frame + postMax + 1, end); ++i) {
+        if (m_flux[i] > value)
+            return false;
+    }
+
+    size_t first = frame > preAverage ? frame - preAverage : 0;
+    size_t last = std::min(frame + postAverage + 1, end);
+    double sum = 0;
+    for (size_t i = first; i < last; ++i)
+        sum += m_flux[i];
+    if (value < sum / (last - first) + m_config.sensitivity * meanFlux)
+        return false;
+
+    GstClockTime minimumFrames = gst_util_uint64_scale(m_config.minimumInterval, m_sampleRate, GST_SECOND * m_config.hopSize);
+    return lastOnsetFrame == G_MAXSIZE || frame - lastOnsetFrame >= minimumFrames;
+}
+
+// Called with m_mutex held.
+void OnsetDetector::pickOnsets(size_t end)
+{
+    double framesPerSecond = static_cast<double>(m_sampleRate) / m_config.hopSize;
+    size_t lookahead = std::ceil(std::max(gPeakPostMax, gPeakPostAverage) * framesPerSecond);
+    for (; m_pickedFrames + lookahead < end; ++m_pickedFrames) {
+        m_fluxSum += m_flux[m_pickedFrames];
+        size_t lastOnsetFrame = m_onsets.empty() ? G_MAXSIZE : m_lastOnsetFrame;
+        if (isOnset(m_pickedFrames, end, m_fluxSum / (m_pickedFrames + 1), lastOnsetFrame)) {
+            m_onsets.push_back(frameTime(m_pickedFrames));
+            m_lastOnsetFrame = m_pickedFrames;
+        }
+    }
+}
+
+// Called with m_mutex held. Autocorrelation of the mean removed onset
+// envelope over [begin, end), up to one lag past the slowest tempo.
+void OnsetDetector::autocorrelate(size_t begin, size_t end, std::vector<double>& autocorrelation) const
+{
+    double secondsPerFrame = static_cast<double>(m_config.hopSize) / m_sampleRate;
+    size_t maximumLag = std::ceil(60 / (m_config.minimumBpm * secondsPerFrame)) + 1;
+    size_t length = end - begin;
+    autocorrelation.assign(maximumLag + 1, 0);
+    if (length <= maximumLag)
+        return;
+
+    double mean = 0;
+    for (size_t i = begin; i < end; ++i)
+        mean += m_flux[i];
+    mean /= length;
+
+    const float* envelope = &m_flux[begin];
+    for (size_t lag = 0; lag <= maximumLag; ++lag) {
+        double sum = 0;
+        for (size_t i = 0; i + lag < length; ++i)
+            sum += (envelope[i] - mean) * (envelope[i + lag] - mean);
+        autocorrelation[lag] = sum / (length - lag);
+    }
+}
+
+bool OnsetDetector::pickTempo(const std::vector<double>& autocorrelation, float& bpm, float& confidence) const
+{
+    if (autocorrelation.size() < 3 || autocorrelation[0] <= 0)
+        return false;
+
+    double secondsPerFrame = static_cast<double>(m_config.hopSize) / m_sampleRate;
+    size_t minimumLag = std::max<size_t>(std::floor(60 / (m_config.maximumBpm * secondsPerFrame)), 1);
+    size_t maximumLag = std::min<size_t>(std::ceil(60 / (m_config.minimumBpm * secondsPerFrame)), autocorrelation.size() - 2);
+    size_t bestLag = 0;
+    double bestScore = 0;
+    for (size_t lag = minimumLag; lag <= maximumLag; ++lag) {
+        double octaves = std::log2(60 / (lag * secondsPerFrame) / gPreferredBpm) / gPreferredBpmOctaves;
+        double score = autocorrelation[lag] * std::exp(-0.5 * octaves * octaves);
+        if (score > bestScore) {
+            bestScore = score;
+            bestLag = lag;
+        }
+    }
+    if (!bestLag)
+        return false;
+
+    // Parabolic interpolation between the neighbouring lags.
+    double before = autocorrelation[bestLag - 1];
+    double peak = autocorrelation[bestLag];
+    double after = autocorrelation[bestLag + 1];
+    double curvature = before - 2 * peak + after;
+    double offset = curvature < 0 ? 0.5 * (before - after) / curvature : 0;
+
+    bpm = 60 / ((bestLag + offset) * secondsPerFrame);
+    confidence = std::min(std::max(peak / autocorrelation[0], 0.0), 1.0);
+    return true;
+}
+
+// Called with m_mutex held.
+void OnsetDetector::estimateTempo(size_t end)
+{
+    size_t windowFrames = gst_util_uint64_scale(m_config.tempoWindow, m_sampleRate, GST_SECOND * m_config.hopSize);
+    size_t intervalFrames = std::max<size_t>(gst_util_uint64_scale(m_config.tempoInterval, m_sampleRate, GST_SECOND * m_config.hopSize), 1);
+    for (; m_nextTempoFrame <= end; m_nextTempoFrame += intervalFrames) {
+        autocorrelate(m_nextTempoFrame - std::min(windowFrames, m_nextTempoFrame), m_nextTempoFrame, m_autocorrelation);
+        TempoEstimate estimate;
+        if (!pickTempo(m_autocorrelation, estimate.bpm, estimate.confidence))
+            continue;
+        estimate.timestamp = frameTime(m_nextTempoFrame);
+        m_tempo.push_back(estimate);
+
+        if (m_accumulatedAutocorrelation.size() != m_autocorrelation.size())
+            m_accumulatedAutocorrelation.assign(m_autocorrelation.size(), 0);
+        for (size_t i = 0; i < m_autocorrelation.size(); ++i)
+            m_accumulatedAutocorrelation[i] += m_autocorrelation[i];
+    }
+}
+
+OnsetInfo OnsetDetector::result() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    OnsetInfo info;
+    if (!m_sampleRate)
+        return info;
+    info.onsets = m_onsets;
+    info.tempo = m_tempo;
+
+    // The last frames had no lookahead yet, judge them on what there is.
+    double fluxSum = m_fluxSum;
+    size_t lastOnsetFrame = m_onsets.empty() ? G_MAXSIZE : m_lastOnsetFrame;
+    for (size_t frame = m_pickedFrames; frame < m_completeFrames; ++frame) {
+        fluxSum += m_flux[frame];
+        if (isOnset(frame, m_completeFrames, fluxSum / (frame + 1), lastOnsetFrame)) {
+            info.onsets.push_back(frameTime(frame));
+            lastOnsetFrame = frame;
+        }
+    }
+
+    // Streams shorter than a tempo window get a single estimate over
+    // all of it.
+    std::vector<double> autocorrelation = m_accumulatedAutocorrelation;
+    if (autocorrelation.empty())
+        autocorrelate(0, m_completeFrames, autocorrelation);
+    float confidence;
+    if (!pickTempo(autocorrelation, info.bpm, confidence))
+        info.bpm = 0;
+    return info;
+}
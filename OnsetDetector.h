@@ -0,0 +1,131 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef OnsetDetector_h
+#define OnsetDetector_h
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <gst/gst.h>
+
+struct OnsetDetectorConfig {
+    OnsetDetectorConfig()
+        : frameSize(2048)
+        , hopSize(512)
+        , sensitivity(0.5)
+        , minimumInterval(50 * GST_MSECOND)
+        , tempoWindow(8 * GST_SECOND)
+        , tempoInterval(GST_SECOND)
+        , minimumBpm(60)
+        , maximumBpm(200)
+    {
+    }
+
+    // STFT frame and hop, in samples.
+    unsigned frameSize;
+    unsigned hopSize;
+    // How far above its neighbourhood, in units of the mean flux of the
+    // stream so far, a flux peak has to rise to count as an onset.
+    float sensitivity;
+    GstClockTime minimumInterval;
+    // Span of flux the tempo is estimated from, and how often.
+    GstClockTime tempoWindow;
+    GstClockTime tempoInterval;
+    float minimumBpm;
+    float maximumBpm;
+};
+
+struct TempoEstimate {
+    // Of the end of the window the estimate was made from.
+    GstClockTime timestamp;
+    float bpm;
+    // Normalised autocorrelation at the chosen period, in [0, 1].
+    float confidence;
+};
+
+struct OnsetInfo {
+    OnsetInfo()
+        : bpm(0)
+    {
+    }
+
+    std::vector<GstClockTime> onsets;
+    std::vector<TempoEstimate> tempo;
+    // From the autocorrelation accumulated over the whole stream, 0 when
+    // there was too little of it.
+    float bpm;
+};
+
+// Detects onsets and follows the tempo as the samples stream by. Each
+// channel goes through a Hamming windowed STFT (gstreamer-fft) and yields
+// the half-wave rectified spectral flux of its log-compressed
+// magnitudes. The fluxes of all channels are summed per frame, peaks of
+// that onset envelope are picked with a few frames of lookahead, and its
+// autocorrelation over a sliding window, weighted towards 120 BPM to
+// avoid octave errors, gives the tempo curve.
+//
+// Meant to sit behind deinterleave: the STFT of a channel runs on the
+// thread feeding it, only the shared envelope is locked. Each channel
+// has to be fed in order from one thread at a time.
+class OnsetDetector {
+public:
+    OnsetDetector(unsigned numberOfChannels, const OnsetDetectorConfig& = OnsetDetectorConfig());
+    ~OnsetDetector();
+
+    void process(unsigned channel, const float* samples, size_t frames, unsigned sampleRate, GstClockTime timestamp);
+
+    // Safe while channels are still being fed, it then returns what was
+    // picked so far. Frames still waiting for their lookahead are judged
+    // on the flux available, so call it again at the end of the stream.
+    OnsetInfo result() const;
+
+    struct ChannelState;
+
+private:
+    void addFlux(ChannelState&, float flux);
+    bool isOnset(size_t frame, size_t end, double meanFlux, size_t lastOnsetFrame) const;
+    void pickOnsets(size_t end);
+    void estimateTempo(size_t end);
+    bool pickTempo(const std::vector<double>& autocorrelation, float& bpm, float& confidence) const;
+    void autocorrelate(size_t begin, size_t end, std::vector<double>& autocorrelation) const;
+    GstClockTime frameTime(size_t frame) const;
+
+    OnsetDetectorConfig m_config;
+    std::vector<std::unique_ptr<ChannelState> > m_channels;
+
+    mutable std::mutex m_mutex;
+    unsigned m_sampleRate;
+    GstClockTime m_firstTimestamp;
+    // Onset envelope, summed over the channels, one value per hop.
+    std::vector<float> m_flux;
+    // Frames of m_flux every channel has contributed to.
+    size_t m_completeFrames;
+    size_t m_pickedFrames;
+    double m_fluxSum;
+    size_t m_lastOnsetFrame;
+    size_t m_nextTempoFrame;
+    std::vector<GstClockTime> m_onsets;
+    std::vector<TempoEstimate> m_tempo;
+    std::vector<double> m_autocorrelation;
+    std::vector<double> m_accumulatedAutocorrelation;
+};
+
+#endif // OnsetDetector_h
@@ -0,0 +1,112 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "PcmStreamWriter.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <unistd.h>
+
+const uint32_t PcmStreamFrameHeader::magic;
+
+PcmStreamWriter::PcmStreamWriter(int fd, PcmStreamFormat format, unsigned channels, unsigned sampleRate)
+    : m_fd(fd)
+    , m_format(format)
+    , m_channels(channels)
+    , m_sampleRate(sampleRate)
+    , m_pending(channels)
+    , m_framesWritten(0)
+    , m_failed(false)
+{
+}
+
+bool PcmStreamWriter::write(unsigned channel, const float* samples, size_t frames, GstClockTime timestamp)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_failed || channel >= m_channels)
+        return !m_failed;
+
+    if (m_format == PcmStreamFramed) {
+        PcmStreamFrameHeader header;
+        header.chunkMagic = PcmStreamFrameHeader::magic;
+        header.channel = channel;
+        header.channels = m_channels;
+        header.sampleRate = m_sampleRate;
+        header.frames = frames;
+        header.timestamp = GST_CLOCK_TIME_IS_VALID(timestamp) ? timestamp : G_MAXUINT64;
+        if (!writeAll(&header, sizeof(header)) || !writeAll(samples, frames * sizeof(float)))
+            return false;
+        if (!channel)
+            m_framesWritten += frames;
+        return true;
+    }
+
+    m_pending[channel].insert(m_pending[channel].end(), samples, samples + frames);
+    size_t ready = m_pending[0].size();
+    for (auto& pending : m_pending)
+        ready = std::min(ready, pending.size());
+    return !ready || writeInterleaved(ready);
+}
+
+bool PcmStreamWriter::finish()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_failed || m_format != PcmStreamRaw)
+        return !m_failed;
+
+    size_t longest = 0;
+    for (auto& pending : m_pending)
+        longest = std::max(longest, pending.size());
+    for (auto& pending : m_pending)
+        pending.resize(longest, 0);
+    return !longest || writeInterleaved(longest);
+}
+
+// Called with m_mutex held.
+bool PcmStreamWriter::writeInterleaved(size_t frames)
+{
+    m_interleaved.resize(frames * m_channels);
+    for (unsigned channel = 0; channel < m_channels; ++channel) {
+        const float* source = m_pending[channel].data();
+        for (size_t i = 0; i < frames; ++i)
+            m_interleaved[i * m_channels + channel] = source[i];
+        m_pending[channel].erase(m_pending[channel].begin(), m_pending[channel].begin() + frames);
+    }
+    if (!writeAll(m_interleaved.data(), m_interleaved.size() * sizeof(float)))
+        return false;
+    m_framesWritten += frames;
+    return true;
+}
+
+// Called with m_mutex held.
+bool PcmStreamWriter::writeAll(const void* data, size_t size)
+{
+    const char* bytes = static_cast<const char*>(data);
+    while (size) {
+        ssize_t written = ::write(m_fd, bytes, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0) {
+            m_failed = true;
+            return false;
+        }
+        bytes += written;
+        size -= written;
+    }
+    return true;
+}
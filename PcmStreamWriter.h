@@ -0,0 +1,83 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef PcmStreamWriter_h
+#define PcmStreamWriter_h
+
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
+#include <gst/gst.h>
+
+enum PcmStreamFormat {
+    // Interleaved native endian float32, what sox -t f32 or
+    // aplay -f FLOAT_LE read.
+    PcmStreamRaw,
+    // Planar chunks of one channel each, every one preceded by a
+    // PcmStreamFrameHeader.
+    PcmStreamFramed
+};
+
+// All fields in native byte order, followed by frames float32 samples.
+struct PcmStreamFrameHeader {
+    static const uint32_t magic = 0x464d4350; // "PCMF"
+
+    uint32_t chunkMagic;
+    uint16_t channel;
+    uint16_t channels;
+    uint32_t sampleRate;
+    uint32_t frames;
+    // Nanoseconds, G_MAXUINT64 when unknown.
+    uint64_t timestamp;
+};
+
+// Writes decoded samples to a file descriptor as they are produced, for
+// use from a SampleObserver. Safe to call from the streaming threads of
+// every channel at once. Writes block while the reading end is full,
+// which holds back the pipeline.
+class PcmStreamWriter {
+public:
+    PcmStreamWriter(int fd, PcmStreamFormat, unsigned channels, unsigned sampleRate);
+
+    // Returns false once fd can't be written anymore, typically because
+    // the reader went away.
+    bool write(unsigned channel, const float* samples, size_t frames, GstClockTime timestamp);
+    // Raw: flushes the frames only some channels got, padded with
+    // silence.
+    bool finish();
+
+    guint64 framesWritten() const { return m_framesWritten; }
+
+private:
+    bool writeAll(const void*, size_t);
+    bool writeInterleaved(size_t frames);
+
+    int m_fd;
+    PcmStreamFormat m_format;
+    unsigned m_channels;
+    unsigned m_sampleRate;
+    std::mutex m_mutex;
+    // Raw only, samples waiting for the other channels to catch up.
+    std::vector<std::vector<float> > m_pending;
+    std::vector<float> m_interleaved;
+    guint64 m_framesWritten;
+    bool m_failed;
+};
+
+#endif // PcmStreamWriter_h
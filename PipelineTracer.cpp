@@ -0,0 +1,304 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "PipelineTracer.h"
+
+#include <cstdio>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "GOwnPtr.h"
+
+// Past this many buffers waiting for their way out, an element is not
+// 1:1 (decoders, resamplers) and pairing enters with leaves is moot.
+static const size_t gMaximumPendingEnters = 64;
+// A million events already take over 100 MB. Later ones are dropped
+// rather than growing without bound on live streams.
+static const size_t gMaximumEvents = 1 << 20;
+
+static int currentThreadId()
+{
+    return syscall(SYS_gettid);
+}
+
+static std::string escapeJSON(const char* string)
+{
+    std::string escaped;
+    for (const char* c = string; c && *c; ++c) {
+        if (*c == '"' || *c == '\\')
+            escaped += '\\';
+        if (static_cast<unsigned char>(*c) < 0x20)
+            continue;
+        escaped += *c;
+    }
+    return escaped;
+}
+
+static std::string bufferArgs(GstPad* pad, GstBuffer* buffer)
+{
+#ifdef GST_API_VERSION_1
+    GstClockTime timestamp = GST_BUFFER_PTS(buffer);
+    gsize size = gst_buffer_get_size(buffer);
+#else
+    GstClockTime timestamp = GST_BUFFER_TIMESTAMP(buffer);
+    gsize size = GST_BUFFER_SIZE(buffer);
+#endif
+    GOwnPtr<gchar> args(g_strdup_printf("{\"pad\":\"%s\",\"pts\":%" G_GINT64_FORMAT ",\"size\":%" G_GSIZE_FORMAT "}",
+        escapeJSON(GST_OBJECT_NAME(pad)).c_str(), GST_CLOCK_TIME_IS_VALID(timestamp) ? static_cast<gint64>(timestamp) : -1, size));
+    return args.get();
+}
+
+#ifdef GST_API_VERSION_1
+static GstPadProbeReturn bufferProbe(GstPad* pad, GstPadProbeInfo* info, gpointer userData)
+{
+    PipelineTracer::ElementTrace* element = static_cast<PipelineTracer::ElementTrace*>(userData);
+    GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    if (GST_PAD_IS_SINK(pad))
+        element->tracer->bufferEntered(element, pad, buffer);
+    else
+        element->tracer->bufferLeft(element, pad, buffer);
+    return GST_PAD_PROBE_OK;
+}
+#else
+static gboolean bufferProbe(GstPad* pad, GstBuffer* buffer, gpointer userData)
+{
+    PipelineTracer::ElementTrace* element = static_cast<PipelineTracer::ElementTrace*>(userData);
+    if (GST_PAD_IS_SINK(pad))
+        element->tracer->bufferEntered(element, pad, buffer);
+    else
+        element->tracer->bufferLeft(element, pad, buffer);
+    return TRUE;
+}
+#endif
+
+static void onElementPadAdded(GstElement*, GstPad* pad, PipelineTracer::ElementTrace* element)
+{
+    element->tracer->tracePad(element, pad);
+}
+
+static void onPipelineElementAdded(GstBin*, GstElement* element, PipelineTracer* tracer)
+{
+    tracer->traceElement(element);
+}
+
+PipelineTracer::PipelineTracer(const char* outputPath)
+    : m_outputPath(outputPath)
+    , m_startTime(g_get_monotonic_time())
+    , m_droppedEvents(0)
+    , m_asyncIdBase(0)
+{
+}
+
+PipelineTracer::~PipelineTracer()
+{
+    if (m_pipeline)
+        g_signal_handlers_disconnect_by_func(m_pipeline.get(), reinterpret_cast<gpointer>(onPipelineElementAdded), this);
+    for (auto& entry : m_elements)
+        g_signal_handlers_disconnect_by_func(entry.second->element.get(), reinterpret_cast<gpointer>(onElementPadAdded), entry.second.get());
+}
+
+void PipelineTracer::attach(GstElement* pipeline)
+{
+    m_pipeline = pipeline;
+    g_signal_connect(pipeline, "element-added", G_CALLBACK(onPipelineElementAdded), this);
+}
+
+void PipelineTracer::traceElement(GstElement* element)
+{
+    ElementTrace* trace;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::unique_ptr<ElementTrace>& entry = m_elements[element];
+        if (entry)
+            return;
+        entry.reset(new ElementTrace);
+        trace = entry.get();
+        trace->tracer = this;
+        trace->element = element;
+        trace->name = GST_OBJECT_NAME(element);
+        // Async event ids have to be unique across the whole trace.
+        trace->nextAsyncId = ++m_asyncIdBase << 32;
+    }
+
+    GstIterator* iterator = gst_element_iterate_pads(element);
+#ifdef GST_API_VERSION_1
+    GValue item = G_VALUE_INIT;
+    while (gst_iterator_next(iterator, &item) == GST_ITERATOR_OK) {
+        tracePad(trace, GST_PAD(g_value_get_object(&item)));
+        g_value_reset(&item);
+    }
+    g_value_unset(&item);
+#else
+    gpointer item;
+    while (gst_iterator_next(iterator, &item) == GST_ITERATOR_OK) {
+        tracePad(trace, GST_PAD(item));
+        gst_object_unref(item);
+    }
+#endif
+    gst_iterator_free(iterator);
+
+    g_signal_connect(element, "pad-added", G_CALLBACK(onElementPadAdded), trace);
+}
+
+void PipelineTracer::tracePad(ElementTrace* element, GstPad* pad)
+{
+#ifdef GST_API_VERSION_1
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, bufferProbe, element, 0);
+#else
+    gst_pad_add_buffer_probe(pad, G_CALLBACK(bufferProbe), element);
+#endif
+}
+
+void PipelineTracer::bufferEntered(ElementTrace* element, GstPad*, GstBuffer*)
+{
+    std::lock_guard<std::mutex> lock(element->mutex);
+    if (element->pendingEnters.size() >= gMaximumPendingEnters)
+        element->pendingEnters.pop_front();
+    element->pendingEnters.push_back(std::make_pair(now(), currentThreadId()));
+}
+
+void PipelineTracer::bufferLeft(ElementTrace* element, GstPad* pad, GstBuffer* buffer)
+{
+    gint64 timestamp = now();
+    int threadId = currentThreadId();
+
+    Event event;
+    event.name = element->name;
+    event.category = "buffer";
+    event.args = bufferArgs(pad, buffer);
+    event.id = 0;
+    event.duration = 0;
+
+    std::pair<gint64, int> enter(-1, 0);
+    {
+        std::lock_guard<std::mutex> lock(element->mutex);
+        if (!element->pendingEnters.empty()) {
+            enter = element->pendingEnters.front();
+            element->pendingEnters.pop_front();
+        }
+        event.id = element->nextAsyncId++;
+    }
+
+    if (enter.first < 0) {
+        // Sources and elements pushing more than they receive.
+        event.phase = 'i';
+        event.timestamp = timestamp;
+        event.threadId = threadId;
+        addEvent(event);
+        return;
+    }
+
+    if (enter.second == threadId) {
+        event.phase = 'X';
+        event.timestamp = enter.first;
+        event.duration = timestamp - enter.first;
+        event.threadId = threadId;
+        addEvent(event);
+        return;
+    }
+
+    event.phase = 'b';
+    event.timestamp = enter.first;
+    event.threadId = enter.second;
+    addEvent(event);
+
+    event.phase = 'e';
+    event.timestamp = timestamp;
+    event.threadId = threadId;
+    addEvent(event);
+}
+
+void PipelineTracer::recordMessage(GstMessage* message)
+{
+    Event event;
+    event.phase = 'i';
+    event.category = "message";
+    event.timestamp = now();
+    event.duration = 0;
+    event.threadId = currentThreadId();
+    event.id = 0;
+
+    const char* source = GST_MESSAGE_SRC(message) ? GST_OBJECT_NAME(GST_MESSAGE_SRC(message)) : "";
+    if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_STATE_CHANGED) {
+        GstState oldState, newState;
+        gst_message_parse_state_changed(message, &oldState, &newState, 0);
+        event.category = "state";
+        GOwnPtr<gchar> name(g_strdup_printf("%s %s -> %s", source, gst_element_state_get_name(oldState), gst_element_state_get_name(newState)));
+        event.name = name.get();
+    } else {
+        GOwnPtr<gchar> name(g_strdup_printf("%s %s", GST_MESSAGE_TYPE_NAME(message), source));
+        event.name = name.get();
+    }
+
+    addEvent(event);
+}
+
+void PipelineTracer::recordSpan(const char* name, const char* category, gint64 startTime, gint64 endTime)
+{
+    Event event;
+    event.phase = 'X';
+    event.name = name;
+    event.category = category;
+    event.timestamp = startTime - m_startTime;
+    event.duration = endTime - startTime;
+    event.threadId = currentThreadId();
+    event.id = 0;
+    addEvent(event);
+}
+
+void PipelineTracer::addEvent(const Event& event)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_events.size() >= gMaximumEvents) {
+        ++m_droppedEvents;
+        return;
+    }
+    m_events.push_back(event);
+}
+
+bool PipelineTracer::write()
+{
+    FILE* file = fopen(m_outputPath.c_str(), "w");
+    if (!file) {
+        g_warning("Could not open %s to write the trace", m_outputPath.c_str());
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_droppedEvents)
+        g_warning("Trace %s is missing the last %" G_GSIZE_FORMAT " events", m_outputPath.c_str(), m_droppedEvents);
+    int processId = getpid();
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (size_t i = 0; i < m_events.size(); ++i) {
+        const Event& event = m_events[i];
+        fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%" G_GINT64_FORMAT ",\"pid\":%d,\"tid\":%d",
+            i ? ",\n" : "", escapeJSON(event.name.c_str()).c_str(), escapeJSON(event.category.c_str()).c_str(), event.phase, event.timestamp, processId, event.threadId);
+        if (event.phase == 'X')
+            fprintf(file, ",\"dur\":%" G_GINT64_FORMAT, event.duration);
+        if (event.phase == 'b' || event.phase == 'e')
+            fprintf(file, ",\"id\":\"0x%" G_GINT64_MODIFIER "x\"", event.id);
+        if (event.phase == 'i')
+            fprintf(file, ",\"s\":\"t\"");
+        if (!event.args.empty())
+            fprintf(file, ",\"args\":%s", event.args.c_str());
+        fprintf(file, "}");
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    return true;
+}
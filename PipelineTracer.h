@@ -0,0 +1,97 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef PipelineTracer_h
+#define PipelineTracer_h
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <gst/gst.h>
+
+#include "GRefPtrGStreamer.h"
+
+// Records buffer flow through a pipeline and writes it as Chrome trace
+// JSON (chrome://tracing, ui.perfetto.dev).
+//
+// Buffers are seen through probes on the pads of every top-level
+// element (bins like decodebin count as one element). A buffer entering
+// and leaving an element on the same thread becomes a duration event on
+// that thread. When it leaves on another thread, as with queues, the
+// wait becomes an async event so starvation and backlog show up as
+// long bars. Bus messages and state changes are instant events. Past
+// about a million events the rest are dropped.
+class PipelineTracer {
+public:
+    explicit PipelineTracer(const char* outputPath);
+    ~PipelineTracer();
+
+    // Traces every element added to pipeline from now on.
+    void attach(GstElement* pipeline);
+
+    void recordMessage(GstMessage*);
+    void recordSpan(const char* name, const char* category, gint64 startTime, gint64 endTime);
+
+    bool write();
+
+    struct ElementTrace {
+        PipelineTracer* tracer;
+        // Keeps the element around until its handler is disconnected,
+        // the reader drops the pipeline before the tracer.
+        GRefPtr<GstElement> element;
+        std::string name;
+        std::mutex mutex;
+        std::deque<std::pair<gint64, int> > pendingEnters;
+        guint64 nextAsyncId;
+    };
+
+    void bufferEntered(ElementTrace*, GstPad*, GstBuffer*);
+    void bufferLeft(ElementTrace*, GstPad*, GstBuffer*);
+    void traceElement(GstElement*);
+    void tracePad(ElementTrace*, GstPad*);
+
+private:
+    struct Event {
+        char phase;
+        std::string name;
+        std::string category;
+        gint64 timestamp;
+        gint64 duration;
+        int threadId;
+        guint64 id;
+        std::string args;
+    };
+
+    void addEvent(const Event&);
+    gint64 now() const { return g_get_monotonic_time() - m_startTime; }
+
+    std::string m_outputPath;
+    gint64 m_startTime;
+    std::mutex m_mutex;
+    std::vector<Event> m_events;
+    size_t m_droppedEvents;
+    GRefPtr<GstElement> m_pipeline;
+    std::map<GstElement*, std::unique_ptr<ElementTrace> > m_elements;
+    guint64 m_asyncIdBase;
+};
+
+#endif // PipelineTracer_h
@@ -0,0 +1,436 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "PlaylistDecoder.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <gst/app/gstappsink.h>
+
+#include "AudioStreamChannelsReader.h"
+#include "GOwnPtr.h"
+#include "GRefPtr.h"
+#include "GRefPtrGStreamer.h"
+#include "GStreamerUtilities.h"
+
+#ifdef GST_API_VERSION_1
+#define HAVE_CONCAT GST_CHECK_VERSION(1, 6, 0)
+#else
+#define HAVE_CONCAT 0
+#endif
+
+static const unsigned gChannels = 2;
+
+static guint64 itemFrame(GstClockTime time, float sampleRate)
+{
+    if (!GST_CLOCK_TIME_IS_VALID(time))
+        return G_MAXUINT64;
+    return gst_util_uint64_scale_round(time, static_cast<guint64>(sampleRate), GST_SECOND);
+}
+
+#if HAVE_CONCAT
+
+class PlaylistDecoder {
+public:
+    PlaylistDecoder(const std::vector<PlaylistItem>&, bool mixToMono, float sampleRate);
+    ~PlaylistDecoder();
+
+    bool run();
+    std::unique_ptr<AudioBus> takeBus();
+    const std::vector<PlaylistSegment>& segments() const { return m_segments; }
+
+    struct ItemBranch {
+        PlaylistDecoder* decoder;
+        unsigned index;
+        GRefPtr<GstElement> decodebin;
+        GRefPtr<GstElement> audioConvert;
+        GRefPtr<GstPad> concatPad;
+        guint64 framesDelivered;
+        guint64 firstFrame;
+        guint64 endFrame;
+        bool started;
+    };
+
+    void handleDecodedPad(ItemBranch*, GstPad*);
+    void decodedPadsConfigured(ItemBranch*);
+    void itemFinishing(ItemBranch*);
+    void enterActiveItem();
+    GstFlowReturn handleSample(GstAppSink*);
+    gboolean handleMessage(GstMessage*);
+
+private:
+    void plugItem(unsigned index);
+
+    std::vector<PlaylistItem> m_items;
+    // Mono is downmixed by audioconvert, as in the reader.
+    unsigned m_channelCount;
+    float m_sampleRate;
+    GRefPtr<GstElement> m_pipeline;
+    GRefPtr<GstElement> m_concat;
+    GRefPtr<GSource> m_busWatch;
+    GMainLoop* m_loop;
+    // Grows from the streaming thread of the item that is finishing,
+    // which concat only lets go on once it is done.
+    std::vector<std::unique_ptr<ItemBranch> > m_branches;
+    // Only touched from the thread concat pushes the active item from,
+    // which also runs the appsink callbacks.
+    ItemBranch* m_currentItem;
+    std::vector<float> m_channels[gChannels];
+    std::vector<PlaylistSegment> m_segments;
+    bool m_succeeded;
+};
+
+static void onDecodebinPadAddedCallback(GstElement*, GstPad* pad, PlaylistDecoder::ItemBranch* branch)
+{
+    branch->decoder->handleDecodedPad(branch, pad);
+}
+
+static void onDecodebinNoMorePadsCallback(GstElement*, PlaylistDecoder::ItemBranch* branch)
+{
+    branch->decoder->decodedPadsConfigured(branch);
+}
+
+static GstPadProbeReturn itemEndProbe(GstPad*, GstPadProbeInfo* info, gpointer userData)
+{
+    if (GST_EVENT_TYPE(GST_PAD_PROBE_INFO_EVENT(info)) != GST_EVENT_EOS)
+        return GST_PAD_PROBE_OK;
+    PlaylistDecoder::ItemBranch* branch = static_cast<PlaylistDecoder::ItemBranch*>(userData);
+    branch->decoder->itemFinishing(branch);
+    return GST_PAD_PROBE_REMOVE;
+}
+
+// Runs on the item's streaming thread, the one handleSample() counts
+// its frames from once it is active, before concat gets the buffer.
+static GstPadProbeReturn itemStopProbe(GstPad* pad, GstPadProbeInfo*, gpointer userData)
+{
+    PlaylistDecoder::ItemBranch* branch = static_cast<PlaylistDecoder::ItemBranch*>(userData);
+    if (branch->framesDelivered < branch->endFrame)
+        return GST_PAD_PROBE_OK;
+
+    // Past stop: end the item here instead of decoding the rest of the
+    // file only to drop it. Upstream gets EOS on its next push.
+    gst_pad_send_event(pad, gst_event_new_eos());
+    return GST_PAD_PROBE_DROP;
+}
+
+static GstPadProbeReturn concatSegmentProbe(GstPad*, GstPadProbeInfo* info, gpointer userData)
+{
+    if (GST_EVENT_TYPE(GST_PAD_PROBE_INFO_EVENT(info)) == GST_EVENT_SEGMENT)
+        static_cast<PlaylistDecoder*>(userData)->enterActiveItem();
+    return GST_PAD_PROBE_OK;
+}
+
+static GstFlowReturn onPlaylistSampleCallback(GstAppSink* sink, gpointer userData)
+{
+    return static_cast<PlaylistDecoder*>(userData)->handleSample(sink);
+}
+
+static gboolean playlistMessageCallback(GstBus*, GstMessage* message, PlaylistDecoder* decoder)
+{
+    return decoder->handleMessage(message);
+}
+
+PlaylistDecoder::PlaylistDecoder(const std::vector<PlaylistItem>& items, bool mixToMono, float sampleRate)
+    : m_items(items)
+    , m_channelCount(mixToMono ? 1 : gChannels)
+    , m_sampleRate(sampleRate)
+    , m_loop(0)
+    , m_currentItem(0)
+    , m_segments(items.size())
+    , m_succeeded(false)
+{
+    m_pipeline = gst_pipeline_new(0);
+
+    m_concat = makeGStreamerElement("concat", 0);
+    GstElement* sink = makeGStreamerElement("appsink", 0);
+    gst_bin_add_many(GST_BIN(m_pipeline.get()), m_concat.get(), sink, NULL);
+    gst_element_link(m_concat.get(), sink);
+
+    // concat pushes the segment of an item once that item became the
+    // active one, right before its first buffer and from the same
+    // thread.
+    GRefPtr<GstPad> concatSrcPad = adoptGRef(gst_element_get_static_pad(m_concat.get(), "src"));
+    gst_pad_add_probe(concatSrcPad.get(), GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, concatSegmentProbe, this, 0);
+
+    GstCaps* caps = getGstAudioCaps(m_channelCount, sampleRate);
+    g_object_set(sink, "caps", caps, "sync", FALSE, NULL);
+    gst_caps_unref(caps);
+
+    GstAppSinkCallbacks callbacks;
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.new_sample = onPlaylistSampleCallback;
+    gst_app_sink_set_callbacks(GST_APP_SINK(sink), &callbacks, this, 0);
+
+    // The other items are plugged one at a time, as the previous one
+    // ends.
+    if (!items.empty())
+        plugItem(0);
+}
+
+void PlaylistDecoder::plugItem(unsigned index)
+{
+    std::unique_ptr<ItemBranch> branch(new ItemBranch);
+    branch->decoder = this;
+    branch->index = index;
+    branch->framesDelivered = 0;
+    branch->firstFrame = itemFrame(m_items[index].start, m_sampleRate);
+    branch->endFrame = itemFrame(m_items[index].stop, m_sampleRate);
+    branch->started = false;
+
+    // ... filesrc ! decodebin ! audioconvert ! audioresample ! capsfilter ! concat.sink_N
+    // concat plays its pads in the order they were requested.
+    GstElement* source = makeGStreamerElement("filesrc", 0);
+    g_object_set(source, "location", m_items[index].filePath.c_str(), NULL);
+    branch->decodebin = makeGStreamerElement("decodebin", 0);
+    branch->audioConvert = makeGStreamerElement("audioconvert", 0);
+    GstElement* audioResample = makeGStreamerElement("audioresample", 0);
+    GstElement* capsFilter = makeGStreamerElement("capsfilter", 0);
+    GstCaps* caps = getGstAudioCaps(m_channelCount, m_sampleRate);
+    g_object_set(capsFilter, "caps", caps, NULL);
+    gst_caps_unref(caps);
+
+    gst_bin_add_many(GST_BIN(m_pipeline.get()), source, branch->decodebin.get(), branch->audioConvert.get(), audioResample, capsFilter, NULL);
+    gst_element_link(source, branch->decodebin.get());
+    gst_element_link_many(branch->audioConvert.get(), audioResample, capsFilter, NULL);
+
+    branch->concatPad = adoptGRef(gst_element_get_request_pad(m_concat.get(), "sink_%u"));
+    GRefPtr<GstPad> branchPad = adoptGRef(gst_element_get_static_pad(capsFilter, "src"));
+    gst_pad_link(branchPad.get(), branch->concatPad.get());
+    if (index + 1 < m_items.size())
+        gst_pad_add_probe(branch->concatPad.get(), GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, itemEndProbe, branch.get(), 0);
+    if (branch->endFrame != G_MAXUINT64)
+        gst_pad_add_probe(branch->concatPad.get(), GST_PAD_PROBE_TYPE_BUFFER, itemStopProbe, branch.get(), 0);
+
+    g_signal_connect(branch->decodebin.get(), "pad-added", G_CALLBACK(onDecodebinPadAddedCallback), branch.get());
+    g_signal_connect(branch->decodebin.get(), "no-more-pads", G_CALLBACK(onDecodebinNoMorePadsCallback), branch.get());
+
+    // A no-op until the pipeline is started.
+    gst_element_sync_state_with_parent(capsFilter);
+    gst_element_sync_state_with_parent(audioResample);
+    gst_element_sync_state_with_parent(branch->audioConvert.get());
+    gst_element_sync_state_with_parent(branch->decodebin.get());
+    gst_element_sync_state_with_parent(source);
+    m_branches.push_back(std::move(branch));
+}
+
+PlaylistDecoder::~PlaylistDecoder()
+{
+    if (m_busWatch)
+        g_source_destroy(m_busWatch.get());
+    gst_element_set_state(m_pipeline.get(), GST_STATE_NULL);
+    for (auto& branch : m_branches) {
+        g_signal_handlers_disconnect_by_func(branch->decodebin.get(), reinterpret_cast<gpointer>(onDecodebinPadAddedCallback), branch.get());
+        g_signal_handlers_disconnect_by_func(branch->decodebin.get(), reinterpret_cast<gpointer>(onDecodebinNoMorePadsCallback), branch.get());
+    }
+}
+
+void PlaylistDecoder::handleDecodedPad(ItemBranch* branch, GstPad* pad)
+{
+    GRefPtr<GstCaps> caps = adoptGRef(gst_pad_query_caps(pad, 0));
+    if (!caps || gst_caps_is_empty(caps.get()) || !g_str_has_prefix(gst_structure_get_name(gst_caps_get_structure(caps.get(), 0)), "audio/"))
+        return;
+
+    // Only the first audio stream of each item is played.
+    GRefPtr<GstPad> sinkPad = adoptGRef(gst_element_get_static_pad(branch->audioConvert.get(), "sink"));
+    if (!gst_pad_is_linked(sinkPad.get()))
+        gst_pad_link(pad, sinkPad.get());
+}
+
+void PlaylistDecoder::decodedPadsConfigured(ItemBranch* branch)
+{
+    // An item without audio would leave concat waiting on its pad
+    // forever.
+    GRefPtr<GstPad> sinkPad = adoptGRef(gst_element_get_static_pad(branch->audioConvert.get(), "sink"));
+    if (gst_pad_is_linked(sinkPad.get()))
+        return;
+
+    GError* error = g_error_new(GST_STREAM_ERROR, GST_STREAM_ERROR_WRONG_TYPE, "Playlist item %u has no audio stream", branch->index);
+    gst_element_post_message(branch->decodebin.get(), gst_message_new_error(GST_OBJECT(branch->decodebin.get()), error, 0));
+    g_error_free(error);
+}
+
+void PlaylistDecoder::itemFinishing(ItemBranch* branch)
+{
+    // Runs before concat sees the EOS, so the next pad is there when
+    // it looks for one and the stream does not end early.
+    if (branch->index + 1 == m_branches.size())
+        plugItem(branch->index + 1);
+}
+
+void PlaylistDecoder::enterActiveItem()
+{
+    GstPad* activePad = 0;
+    g_object_get(m_concat.get(), "active-pad", &activePad, NULL);
+    GRefPtr<GstPad> pad = adoptGRef(activePad);
+    if (!pad)
+        return;
+
+    for (auto& branch : m_branches) {
+        if (branch->concatPad != pad)
+            continue;
+        m_currentItem = branch.get();
+        if (!branch->started) {
+            branch->started = true;
+            m_segments[branch->index].offset = m_channels[0].size();
+        }
+        return;
+    }
+}
+
+GstFlowReturn PlaylistDecoder::handleSample(GstAppSink* sink)
+{
+    GRefPtr<GstSample> sample = adoptGRef(gst_app_sink_pull_sample(sink));
+    if (!sample || !m_currentItem)
+        return GST_FLOW_ERROR;
+
+    GstBuffer* buffer = gst_sample_get_buffer(sample.get());
+    GstMapInfo map;
+    if (!buffer || !gst_buffer_map(buffer, &map, GST_MAP_READ))
+        return GST_FLOW_ERROR;
+
+    // Frames are counted per item rather than taken from timestamps,
+    // which concat rewrites and which would be rounded anyway.
+    ItemBranch* item = m_currentItem;
+    const float* samples = reinterpret_cast<const float*>(map.data);
+    guint64 frames = map.size / (m_channelCount * sizeof(float));
+    guint64 first = item->framesDelivered;
+    guint64 begin = std::max(first, item->firstFrame);
+    guint64 end = std::min(first + frames, item->endFrame);
+    item->framesDelivered += frames;
+
+    for (guint64 frame = begin; frame < end; ++frame) {
+        const float* interleaved = samples + (frame - first) * m_channelCount;
+        for (unsigned channel = 0; channel < m_channelCount; ++channel)
+            m_channels[channel].push_back(interleaved[channel]);
+    }
+    if (end > begin)
+        m_segments[item->index].length += end - begin;
+
+    gst_buffer_unmap(buffer, &map);
+    return GST_FLOW_OK;
+}
+
+gboolean PlaylistDecoder::handleMessage(GstMessage* message)
+{
+    GOwnPtr<GError> error;
+    GOwnPtr<gchar> debug;
+
+    switch (GST_MESSAGE_TYPE(message)) {
+    case GST_MESSAGE_EOS:
+        m_succeeded = true;
+        g_main_loop_quit(m_loop);
+        break;
+    case GST_MESSAGE_ERROR:
+        gst_message_parse_error(message, &error.outPtr(), &debug.outPtr());
+        g_warning("Playlist decoding failed: %s. Debug output: %s", error->message, debug.get());
+        g_main_loop_quit(m_loop);
+        break;
+    default:
+        break;
+    }
+    return TRUE;
+}
+
+bool PlaylistDecoder::run()
+{
+    GRefPtr<GMainContext> context = adoptGRef(g_main_context_new());
+    GRefPtr<GMainLoop> loop = adoptGRef(g_main_loop_new(context.get(), FALSE));
+    m_loop = loop.get();
+
+    GRefPtr<GstBus> bus = adoptGRef(gst_pipeline_get_bus(GST_PIPELINE(m_pipeline.get())));
+    m_busWatch = adoptGRef(gst_bus_create_watch(bus.get()));
+    g_source_set_callback(m_busWatch.get(), reinterpret_cast<GSourceFunc>(playlistMessageCallback), this, 0);
+    g_source_attach(m_busWatch.get(), context.get());
+
+    gst_element_set_state(m_pipeline.get(), GST_STATE_PLAYING);
+    g_main_loop_run(loop.get());
+
+    // Joins the streaming threads before the samples are handed out.
+    gst_element_set_state(m_pipeline.get(), GST_STATE_NULL);
+    g_source_destroy(m_busWatch.get());
+    m_busWatch.clear();
+    m_loop = 0;
+
+    // Items that never produced anything sit at the end.
+    for (unsigned i = 0; i < m_segments.size(); ++i) {
+        if (i >= m_branches.size() || !m_branches[i]->started)
+            m_segments[i].offset = m_channels[0].size();
+    }
+    return m_succeeded;
+}
+
+std::unique_ptr<AudioBus> PlaylistDecoder::takeBus()
+{
+    std::unique_ptr<AudioBus> bus = AudioBus::create(m_channelCount, m_channels[0].size());
+    bus->setSampleRate(m_sampleRate);
+    for (unsigned channel = 0; channel < m_channelCount; ++channel) {
+        std::copy(m_channels[channel].begin(), m_channels[channel].end(), bus->channel(channel)->mutableData());
+        std::vector<float>().swap(m_channels[channel]);
+    }
+    return bus;
+}
+
+#endif // HAVE_CONCAT
+
+std::unique_ptr<AudioBus> createBusFromPlaylist(const std::vector<PlaylistItem>& items, bool mixToMono, float sampleRate,
+    std::vector<PlaylistSegment>* segments)
+{
+    if (items.empty())
+        return std::unique_ptr<AudioBus>();
+
+#if HAVE_CONCAT
+    // Unsupported items fail the pipeline when their turn comes.
+    PlaylistDecoder decoder(items, mixToMono, sampleRate);
+    if (!decoder.run())
+        return std::unique_ptr<AudioBus>();
+    if (segments)
+        *segments = decoder.segments();
+    return decoder.takeBus();
+#else
+    std::vector<std::unique_ptr<AudioBus> > decoded;
+    std::vector<PlaylistSegment> itemSegments(items.size());
+    guint64 totalFrames = 0;
+    for (unsigned i = 0; i < items.size(); ++i) {
+        std::unique_ptr<AudioBus> bus = createBusFromAudioFile(items[i].filePath.c_str(), mixToMono, sampleRate);
+        if (!bus)
+            return std::unique_ptr<AudioBus>();
+        guint64 begin = std::min<guint64>(itemFrame(items[i].start, sampleRate), bus->length());
+        guint64 end = std::min<guint64>(itemFrame(items[i].stop, sampleRate), bus->length());
+        itemSegments[i].offset = totalFrames;
+        itemSegments[i].length = end > begin ? end - begin : 0;
+        totalFrames += itemSegments[i].length;
+        decoded.push_back(std::move(bus));
+    }
+
+    std::unique_ptr<AudioBus> output = AudioBus::create(mixToMono ? 1 : gChannels, totalFrames);
+    output->setSampleRate(sampleRate);
+    for (unsigned i = 0; i < items.size(); ++i) {
+        guint64 begin = std::min<guint64>(itemFrame(items[i].start, sampleRate), decoded[i]->length());
+        for (unsigned channel = 0; channel < output->numberOfChannels(); ++channel) {
+            const float* source = decoded[i]->channel(channel)->data() + begin;
+            std::copy(source, source + itemSegments[i].length, output->channel(channel)->mutableData() + itemSegments[i].offset);
+        }
+        decoded[i].reset();
+    }
+
+    if (segments)
+        *segments = itemSegments;
+    return output;
+#endif
+}
@@ -0,0 +1,72 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef PlaylistDecoder_h
+#define PlaylistDecoder_h
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gst/gst.h>
+
+#include "AudioBus.h"
+
+// One entry of a playlist: [start, stop) of filePath, in stream time.
+struct PlaylistItem {
+    PlaylistItem(const char* filePath, GstClockTime start = 0, GstClockTime stop = GST_CLOCK_TIME_NONE)
+        : filePath(filePath)
+        , start(start)
+        , stop(stop)
+    {
+    }
+
+    std::string filePath;
+    GstClockTime start;
+    GstClockTime stop;
+};
+
+// Where an item ended up in the output, in frames.
+struct PlaylistSegment {
+    PlaylistSegment()
+        : offset(0)
+        , length(0)
+    {
+    }
+
+    guint64 offset;
+    guint64 length;
+};
+
+// Decodes every item back to back into a single bus, gaplessly. All
+// items go through one pipeline: a filesrc ! decodebin ! audioconvert !
+// audioresample branch per item feeds a concat element that plays them
+// in order, and the output grows as the items are decoded. A branch is
+// only built once the previous item reaches its end. Items are
+// trimmed to their [start, stop) by counting the frames each one
+// delivers, so the cut is sample accurate, and an item ends as soon as
+// it got past stop rather than at the end of its file. segments, when
+// given, gets one entry per item. Returns 0 if any item fails to
+// decode.
+//
+// Without concat (GStreamer 0.10 or older than 1.6) the items are
+// decoded one after the other with separate readers.
+std::unique_ptr<AudioBus> createBusFromPlaylist(const std::vector<PlaylistItem>&, bool mixToMono, float sampleRate,
+    std::vector<PlaylistSegment>* segments = 0);
+
+#endif // PlaylistDecoder_h
@@ -0,0 +1,183 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "PolyphaseResampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <tuple>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "GOwnPtr.h"
+
+// Ratios like 44100/44099 would need tens of thousands of phases. Past
+// this many the nearest precomputed phase is used instead.
+static const unsigned gMaximumPhases = 4096;
+
+struct QualityPreset {
+    unsigned zeroCrossings;
+    double kaiserBeta;
+};
+
+// Zero crossings on each side of the kernel center and Kaiser window
+// shape. On a 1 kHz tone these give roughly 60, 85 and 110 dB SNR.
+static const QualityPreset gQualityPresets[] = {
+    { 8, 6.0 },
+    { 16, 8.5 },
+    { 32, 10.5 }
+};
+
+struct PolyphaseFilterBank {
+    unsigned phases;
+    unsigned halfWidth;
+    unsigned taps;
+    // phases x taps coefficients, each phase padded to a multiple of
+    // four taps for the SIMD loop.
+    std::vector<float> coefficients;
+};
+
+static double besselI0(double x)
+{
+    double sum = 1;
+    double term = 1;
+    for (unsigned k = 1; k < 50; ++k) {
+        double factor = x / (2 * k);
+        term *= factor * factor;
+        sum += term;
+        if (term < sum * 1e-12)
+            break;
+    }
+    return sum;
+}
+
+static std::shared_ptr<const PolyphaseFilterBank> createFilterBank(unsigned interpolation, unsigned decimation, ResamplerQuality quality)
+{
+    const QualityPreset& preset = gQualityPresets[quality];
+    // Downsampling lowers the cutoff below the output Nyquist frequency,
+    // which widens the kernel by the same factor.
+    double cutoff = std::min(1.0, static_cast<double>(interpolation) / decimation);
+    unsigned halfWidth = static_cast<unsigned>(std::ceil(preset.zeroCrossings / cutoff));
+
+    std::shared_ptr<PolyphaseFilterBank> bank(new PolyphaseFilterBank);
+    bank->phases = std::min(interpolation, gMaximumPhases);
+    bank->halfWidth = halfWidth;
+    bank->taps = (2 * halfWidth + 4) & ~3u;
+    bank->coefficients.resize(bank->phases * bank->taps);
+
+    double windowNormalization = besselI0(preset.kaiserBeta);
+    for (unsigned phase = 0; phase < bank->phases; ++phase) {
+        float* coefficients = &bank->coefficients[phase * bank->taps];
+        double fraction = static_cast<double>(phase) / bank->phases;
+        for (unsigned tap = 0; tap < bank->taps; ++tap) {
+            // Distance from the output position to input sample
+            // base - halfWidth + 1 + tap, in input samples.
+            double distance = fraction + halfWidth - 1 - static_cast<double>(tap);
+            double ratio = distance / (halfWidth + 1);
+            if (std::fabs(ratio) >= 1) {
+                coefficients[tap] = 0;
+                continue;
+            }
+            double x = M_PI * cutoff * distance;
+            double sinc = std::fabs(x) < 1e-9 ? 1 : std::sin(x) / x;
+            double window = besselI0(preset.kaiserBeta * std::sqrt(1 - ratio * ratio)) / windowNormalization;
+            coefficients[tap] = cutoff * sinc * window;
+        }
+    }
+    return bank;
+}
+
+static std::shared_ptr<const PolyphaseFilterBank> filterBank(unsigned interpolation, unsigned decimation, ResamplerQuality quality)
+{
+    typedef std::tuple<unsigned, unsigned, ResamplerQuality> BankKey;
+    static std::mutex mutex;
+    static std::map<BankKey, std::shared_ptr<const PolyphaseFilterBank> > banks;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::shared_ptr<const PolyphaseFilterBank>& bank = banks[BankKey(interpolation, decimation, quality)];
+    if (!bank)
+        bank = createFilterBank(interpolation, decimation, quality);
+    return bank;
+}
+
+static inline float dotProduct(const float* samples, const float* coefficients, unsigned taps)
+{
+#ifdef __SSE__
+    __m128 sum = _mm_setzero_ps();
+    for (unsigned i = 0; i < taps; i += 4)
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(samples + i), _mm_loadu_ps(coefficients + i)));
+    float lanes[4];
+    _mm_storeu_ps(lanes, sum);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#else
+    float sum = 0;
+    for (unsigned i = 0; i < taps; ++i)
+        sum += samples[i] * coefficients[i];
+    return sum;
+#endif
+}
+
+PolyphaseResampler::PolyphaseResampler(unsigned inputRate, unsigned outputRate, ResamplerQuality quality)
+{
+    ASSERT(inputRate && outputRate);
+    unsigned divisor = 1;
+    for (unsigned a = inputRate, b = outputRate; b; ) {
+        unsigned remainder = a % b;
+        a = b;
+        b = remainder;
+        divisor = a;
+    }
+    m_interpolation = outputRate / divisor;
+    m_decimation = inputRate / divisor;
+    m_bank = filterBank(m_interpolation, m_decimation, quality);
+}
+
+unsigned PolyphaseResampler::tapsPerPhase() const
+{
+    return m_bank->taps;
+}
+
+size_t PolyphaseResampler::outputLength(size_t inputLength) const
+{
+    return (static_cast<unsigned long long>(inputLength) * m_interpolation + m_decimation - 1) / m_decimation;
+}
+
+void PolyphaseResampler::process(const float* input, size_t inputLength, float* output) const
+{
+    const PolyphaseFilterBank& bank = *m_bank;
+    unsigned halfWidth = bank.halfWidth;
+
+    // Zero padding on both sides keeps the inner loop branch free.
+    std::vector<float> padded(inputLength + 2 * bank.taps, 0);
+    std::copy(input, input + inputLength, padded.begin() + bank.taps);
+    const float* origin = &padded[bank.taps];
+
+    size_t length = outputLength(inputLength);
+    unsigned long long position = 0;
+    for (size_t i = 0; i < length; ++i, position += m_decimation) {
+        size_t base = position / m_interpolation;
+        unsigned long long phase = position % m_interpolation;
+        if (m_interpolation != bank.phases)
+            phase = phase * bank.phases / m_interpolation;
+        output[i] = dotProduct(origin + base - halfWidth + 1, &bank.coefficients[phase * bank.taps], bank.taps);
+    }
+}
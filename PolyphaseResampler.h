@@ -0,0 +1,56 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef PolyphaseResampler_h
+#define PolyphaseResampler_h
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+enum ResamplerQuality {
+    ResamplerFast,
+    ResamplerMedium,
+    ResamplerBest
+};
+
+struct PolyphaseFilterBank;
+
+// Windowed sinc resampler for planar float data, run on whole decoded
+// channels rather than in the pipeline. The rate ratio is reduced to
+// L/M and the L filter phases are computed once per ratio and quality
+// and shared by every resampler using them.
+class PolyphaseResampler {
+public:
+    PolyphaseResampler(unsigned inputRate, unsigned outputRate, ResamplerQuality = ResamplerMedium);
+
+    size_t outputLength(size_t inputLength) const;
+
+    // Resamples one channel. output must hold outputLength(inputLength)
+    // samples; the signal is taken as silent outside of input.
+    void process(const float* input, size_t inputLength, float* output) const;
+
+    unsigned tapsPerPhase() const;
+
+private:
+    unsigned m_interpolation;
+    unsigned m_decimation;
+    std::shared_ptr<const PolyphaseFilterBank> m_bank;
+};
+
+#endif // PolyphaseResampler_h
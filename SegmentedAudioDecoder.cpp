@@ -0,0 +1,120 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#include "SegmentedAudioDecoder.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include <gst/gst.h>
+
+#include "AudioStreamChannelsReader.h"
+#include "AudioStreamProbe.h"
+#include "GOwnPtr.h"
+#include "GRefPtr.h"
+
+// Decoded and discarded on each side of a segment.
+static const GstClockTime gSegmentOverlap = 200 * GST_MSECOND;
+
+// Splitting files shorter than this costs more in pipeline setup than
+// it gains.
+static const GstClockTime gMinimumSegmentDuration = 10 * GST_SECOND;
+
+std::unique_ptr<AudioBus> createBusFromAudioFileInSegments(const char* filePath, bool mixToMono, float sampleRate, unsigned segmentCount)
+{
+#ifndef GST_API_VERSION_1
+    // Writing into a shared destination needs buffer timestamps from
+    // the 1.0 appsink path.
+    return createBusFromAudioFile(filePath, mixToMono, sampleRate);
+#else
+    AudioStreamInfo info;
+    GOwnPtr<GError> error;
+    if (!probeAudioFile(filePath, info, &error.outPtr())) {
+        fprintf(stderr, "Unsupported input %s: %s\n", filePath, error->message);
+        return std::unique_ptr<AudioBus>();
+    }
+
+    if (!segmentCount)
+        segmentCount = std::max(1u, std::thread::hardware_concurrency());
+
+    if (info.seekable && GST_CLOCK_TIME_IS_VALID(info.duration))
+        segmentCount = std::min<guint64>(segmentCount, std::max<guint64>(1, info.duration / gMinimumSegmentDuration));
+    else
+        segmentCount = 1;
+
+    if (segmentCount < 2)
+        return AudioStreamChannelsReader(filePath).createBus(sampleRate, mixToMono);
+
+    guint64 rate = static_cast<guint64>(sampleRate);
+    guint64 totalFrames = gst_util_uint64_scale_round(info.duration, rate, GST_SECOND);
+    std::unique_ptr<AudioBus> bus = AudioBus::create(mixToMono ? 1 : 2, totalFrames);
+    bus->setSampleRate(sampleRate);
+
+    // All segment pipelines share one context: the decoding itself
+    // happens in their streaming threads, this loop only sees bus
+    // messages.
+    GRefPtr<GMainContext> context = adoptGRef(g_main_context_new());
+    GRefPtr<GMainLoop> loop = adoptGRef(g_main_loop_new(context.get(), FALSE));
+    GMainLoop* loopPtr = loop.get();
+
+    std::vector<std::unique_ptr<AudioStreamChannelsReader> > readers;
+    unsigned pending = segmentCount;
+    bool failed = false;
+
+    for (unsigned i = 0; i < segmentCount; ++i) {
+        bool isLast = i == segmentCount - 1;
+        guint64 firstFrame = totalFrames * i / segmentCount;
+        guint64 endFrame = totalFrames * (i + 1) / segmentCount;
+
+        GstClockTime keepStart = gst_util_uint64_scale(firstFrame, GST_SECOND, rate);
+        GstClockTime keepEnd = gst_util_uint64_scale(endFrame, GST_SECOND, rate);
+        GstClockTime start = keepStart > gSegmentOverlap ? keepStart - gSegmentOverlap : 0;
+        GstClockTime stop = isLast ? GST_CLOCK_TIME_NONE : keepEnd + gSegmentOverlap;
+
+        std::unique_ptr<AudioStreamChannelsReader> reader(new AudioStreamChannelsReader(filePath));
+        reader->setSegment(start, stop);
+        // The probed duration may be slightly off, let the last
+        // segment fill in whatever is left of the bus.
+        reader->setDestination(bus.get(), firstFrame, isLast ? G_MAXUINT64 : endFrame);
+        readers.push_back(std::move(reader));
+    }
+
+    for (unsigned i = 0; i < segmentCount; ++i) {
+        readers[i]->start(sampleRate, mixToMono, context.get(), [&readers, &pending, &failed, loopPtr](std::unique_ptr<AudioBus>, const GError* error) {
+            if (error && !failed) {
+                g_warning("Segment decoding failed: %s", error->message);
+                failed = true;
+                for (auto& reader : readers)
+                    reader->cancel();
+            }
+            if (!--pending)
+                g_main_loop_quit(loopPtr);
+        });
+    }
+
+    g_main_loop_run(loop.get());
+    readers.clear();
+
+    if (failed)
+        return std::unique_ptr<AudioBus>();
+    return bus;
+#endif
+}
@@ -0,0 +1,38 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#ifndef SegmentedAudioDecoder_h
+#define SegmentedAudioDecoder_h
+
+#include <memory>
+
+#include "AudioBus.h"
+
+// Decodes filePath as segmentCount time segments, each one in its own
+// pipeline started through an accurate seek, so that long files use
+// several cores. Every segment also decodes a short overlap on both
+// sides that is thrown away, which primes the decoder and audioresample
+// and hides their edge effects at the seams. Segments write directly
+// into their slice of a single preallocated bus.
+//
+// segmentCount 0 means one segment per core. Short or non-seekable
+// inputs are decoded in one piece.
+std::unique_ptr<AudioBus> createBusFromAudioFileInSegments(const char* filePath, bool mixToMono, float sampleRate, unsigned segmentCount = 0);
+
+#endif // SegmentedAudioDecoder_h
@@ -0,0 +1,263 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "SharedAudioRing.h"
+
+#include <algorithm>
+#include <cstring>
+#include <errno.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "GOwnPtr.h"
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+static const uint32_t gRingMagic = 0x41524e47; // "ARNG"
+static const uint32_t gRingVersion = 1;
+// Writers recheck the ring this often even without a wakeup, so a
+// consumer that died doesn't hang them for good once it is closed.
+static const unsigned gWriterWaitMs = 100;
+
+static int createMemoryFile(const char* name)
+{
+#ifdef SYS_memfd_create
+    return syscall(SYS_memfd_create, name, MFD_CLOEXEC);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// Not FUTEX_PRIVATE_FLAG: waiters and wakers live in different
+// processes.
+static void futexWait(std::atomic<uint32_t>* word, uint32_t expected, unsigned timeoutMs)
+{
+    struct timespec timeout;
+    timeout.tv_sec = timeoutMs / 1000;
+    timeout.tv_nsec = (timeoutMs % 1000) * 1000000L;
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, expected, &timeout, 0, 0);
+}
+
+static void futexWake(std::atomic<uint32_t>* word)
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, INT32_MAX, 0, 0, 0);
+}
+
+static size_t dataOffset()
+{
+    // Keep the sample blocks page aligned.
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    return (sizeof(SharedAudioRingHeader) + pageSize - 1) / pageSize * pageSize;
+}
+
+SharedAudioRing::SharedAudioRing(int fd, void* mapping, size_t mappingSize)
+    : m_fd(fd)
+    , m_mapping(mapping)
+    , m_mappingSize(mappingSize)
+    , m_header(static_cast<SharedAudioRingHeader*>(mapping))
+    , m_failsWhenFull(false)
+    , m_overflowed(false)
+{
+}
+
+SharedAudioRing::~SharedAudioRing()
+{
+    munmap(m_mapping, m_mappingSize);
+    ::close(m_fd);
+}
+
+std::unique_ptr<SharedAudioRing> SharedAudioRing::create(unsigned channels, size_t capacityFrames, unsigned sampleRate)
+{
+    if (!channels || channels > maximumChannels || !capacityFrames)
+        return std::unique_ptr<SharedAudioRing>();
+
+    int fd = createMemoryFile("audio-ring");
+    if (fd < 0)
+        return std::unique_ptr<SharedAudioRing>();
+
+    size_t size = dataOffset() + channels * capacityFrames * sizeof(float);
+    void* mapping = MAP_FAILED;
+    if (!ftruncate(fd, size))
+        mapping = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        ::close(fd);
+        return std::unique_ptr<SharedAudioRing>();
+    }
+
+    // The file starts zeroed, which is a valid state for the atomics.
+    SharedAudioRingHeader* header = static_cast<SharedAudioRingHeader*>(mapping);
+    header->magic = gRingMagic;
+    header->version = gRingVersion;
+    header->channels = channels;
+    header->sampleRate = sampleRate;
+    header->capacityFrames = capacityFrames;
+    header->dataOffset = dataOffset();
+    return std::unique_ptr<SharedAudioRing>(new SharedAudioRing(fd, mapping, size));
+}
+
+std::unique_ptr<SharedAudioRing> SharedAudioRing::attach(int fd)
+{
+    struct stat status;
+    if (fstat(fd, &status) || static_cast<size_t>(status.st_size) < sizeof(SharedAudioRingHeader))
+        return std::unique_ptr<SharedAudioRing>();
+
+    int ownFd = dup(fd);
+    size_t size = status.st_size;
+    void* mapping = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, ownFd, 0);
+    if (mapping == MAP_FAILED) {
+        ::close(ownFd);
+        return std::unique_ptr<SharedAudioRing>();
+    }
+
+    std::unique_ptr<SharedAudioRing> ring(new SharedAudioRing(ownFd, mapping, size));
+    const SharedAudioRingHeader* header = ring->m_header;
+    if (header->magic != gRingMagic || header->version != gRingVersion || !header->channels || header->channels > maximumChannels
+        || header->dataOffset + header->channels * header->capacityFrames * sizeof(float) > size)
+        return std::unique_ptr<SharedAudioRing>();
+    return ring;
+}
+
+std::unique_ptr<SharedAudioRing> SharedAudioRing::createFromBus(const AudioBus& bus)
+{
+    std::unique_ptr<SharedAudioRing> ring = create(bus.numberOfChannels(), std::max<size_t>(bus.length(), 1), bus.sampleRate());
+    if (!ring)
+        return ring;
+    for (unsigned channel = 0; channel < bus.numberOfChannels(); ++channel)
+        ring->writeChannel(channel, bus.channel(channel)->data(), bus.length());
+    ring->close(false);
+    return ring;
+}
+
+float* SharedAudioRing::channelBlock(unsigned channel) const
+{
+    char* data = static_cast<char*>(m_mapping) + m_header->dataOffset;
+    return reinterpret_cast<float*>(data) + channel * m_header->capacityFrames;
+}
+
+bool SharedAudioRing::setSampleRate(unsigned sampleRate)
+{
+    if (m_header->sampleRate.load(std::memory_order_relaxed) == sampleRate)
+        return true;
+    for (unsigned channel = 0; channel < m_header->channels; ++channel) {
+        if (m_header->channelPositions[channel].load(std::memory_order_relaxed))
+            return false;
+    }
+    // Published to the consumer along with the first write position.
+    m_header->sampleRate.store(sampleRate, std::memory_order_relaxed);
+    return true;
+}
+
+bool SharedAudioRing::writeChannel(unsigned channel, const float* samples, size_t frames)
+{
+    if (channel >= m_header->channels)
+        return true;
+
+    uint64_t capacity = m_header->capacityFrames;
+    float* block = channelBlock(channel);
+    uint64_t position = m_header->channelPositions[channel].load(std::memory_order_relaxed);
+
+    while (frames) {
+        if (m_header->flags)
+            return false;
+
+        uint32_t sequence = m_header->readSequence.load(std::memory_order_acquire);
+        uint64_t space = capacity - (position - m_header->readPosition.load(std::memory_order_acquire));
+        if (!space) {
+            if (m_failsWhenFull) {
+                m_overflowed = true;
+                close(true);
+                return false;
+            }
+            futexWait(&m_header->readSequence, sequence, gWriterWaitMs);
+            continue;
+        }
+
+        size_t index = position % capacity;
+        size_t count = std::min<uint64_t>(std::min<uint64_t>(frames, space), capacity - index);
+        memcpy(block + index, samples, count * sizeof(float));
+        samples += count;
+        frames -= count;
+        position += count;
+        m_header->channelPositions[channel].store(position, std::memory_order_release);
+        publishWritePosition();
+    }
+    return true;
+}
+
+void SharedAudioRing::publishWritePosition()
+{
+    // Frames are only readable once every channel has them.
+    uint64_t position = m_header->channelPositions[0].load(std::memory_order_acquire);
+    for (unsigned channel = 1; channel < m_header->channels; ++channel)
+        position = std::min<uint64_t>(position, m_header->channelPositions[channel].load(std::memory_order_acquire));
+
+    uint64_t published = m_header->writePosition.load(std::memory_order_relaxed);
+    while (published < position && !m_header->writePosition.compare_exchange_weak(published, position, std::memory_order_release)) { }
+    if (published >= position)
+        return;
+
+    m_header->writeSequence.fetch_add(1, std::memory_order_release);
+    futexWake(&m_header->writeSequence);
+}
+
+void SharedAudioRing::close(bool failed)
+{
+    m_header->flags.fetch_or(failed ? (Finished | Failed) : Finished, std::memory_order_release);
+    m_header->writeSequence.fetch_add(1, std::memory_order_release);
+    m_header->readSequence.fetch_add(1, std::memory_order_release);
+    futexWake(&m_header->writeSequence);
+    futexWake(&m_header->readSequence);
+}
+
+size_t SharedAudioRing::available() const
+{
+    return m_header->writePosition.load(std::memory_order_acquire) - m_header->readPosition.load(std::memory_order_relaxed);
+}
+
+const float* SharedAudioRing::channelData(unsigned channel, size_t& contiguousFrames) const
+{
+    ASSERT(channel < m_header->channels);
+    uint64_t capacity = m_header->capacityFrames;
+    size_t index = m_header->readPosition.load(std::memory_order_relaxed) % capacity;
+    contiguousFrames = std::min<uint64_t>(available(), capacity - index);
+    return channelBlock(channel) + index;
+}
+
+void SharedAudioRing::consume(size_t frames)
+{
+    frames = std::min(frames, available());
+    m_header->readPosition.fetch_add(frames, std::memory_order_release);
+    m_header->readSequence.fetch_add(1, std::memory_order_release);
+    futexWake(&m_header->readSequence);
+}
+
+bool SharedAudioRing::waitForData(unsigned timeoutMs) const
+{
+    uint32_t sequence = m_header->writeSequence.load(std::memory_order_acquire);
+    if (available() || m_header->flags)
+        return true;
+    futexWait(&m_header->writeSequence, sequence, timeoutMs);
+    return available() || m_header->flags;
+}
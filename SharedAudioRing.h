@@ -0,0 +1,127 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef SharedAudioRing_h
+#define SharedAudioRing_h
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <stdint.h>
+
+#include "AudioBus.h"
+
+// Layout of the start of the shared mapping, followed at dataOffset by
+// one planar float block of capacityFrames samples per channel.
+// Positions count frames since the start and only ever grow, the sample
+// at position p of channel c lives at index p % capacityFrames of block
+// c. The sequence words are futexes: writers bump writeSequence and
+// wake it after publishing, readers do the same with readSequence.
+struct SharedAudioRingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t channels;
+    // 0 until the producer knows it, see SharedAudioRing::setSampleRate().
+    std::atomic<uint32_t> sampleRate;
+    uint64_t capacityFrames;
+    uint64_t dataOffset;
+    std::atomic<uint32_t> flags;
+
+    alignas(64) std::atomic<uint64_t> writePosition;
+    std::atomic<uint32_t> writeSequence;
+
+    alignas(64) std::atomic<uint64_t> readPosition;
+    std::atomic<uint32_t> readSequence;
+
+    // Per channel write progress, writePosition is the lowest of them.
+    alignas(64) std::atomic<uint64_t> channelPositions[8];
+};
+
+// Planar float ring buffer in a memfd, for handing decoded samples to
+// other local processes without copies: the consumer maps the same
+// memory and reads samples in place. Pass fd() to the consumer (fork,
+// SCM_RIGHTS or /proc/<pid>/fd) and attach() to it there.
+//
+// One producer per channel and a single consumer. Producers block while
+// the ring is full, until the consumer catches up or the ring is
+// closed.
+class SharedAudioRing {
+public:
+    enum Flags {
+        Finished = 1 << 0,
+        Failed = 1 << 1
+    };
+
+    static const unsigned maximumChannels = 8;
+
+    // sampleRate may be 0 when only the producer will know it.
+    static std::unique_ptr<SharedAudioRing> create(unsigned channels, size_t capacityFrames, unsigned sampleRate);
+    static std::unique_ptr<SharedAudioRing> attach(int fd);
+
+    // Whole-file case: a ring holding bus exactly, already finished, so
+    // consumers can map the complete decode at once.
+    static std::unique_ptr<SharedAudioRing> createFromBus(const AudioBus&);
+
+    ~SharedAudioRing();
+
+    int fd() const { return m_fd; }
+    unsigned numberOfChannels() const { return m_header->channels; }
+    // Final once available() returned non-zero.
+    unsigned sampleRate() const { return m_header->sampleRate.load(std::memory_order_relaxed); }
+    size_t capacity() const { return m_header->capacityFrames; }
+
+    // Producer side. The rate can only change before the first write,
+    // setSampleRate() returns false for a different one afterwards.
+    // writeChannel() returns false if the ring got closed meanwhile.
+    bool setSampleRate(unsigned);
+    bool writeChannel(unsigned channel, const float* samples, size_t frames);
+    void close(bool failed);
+
+    // For a ring filled before anybody consumes it: a write that finds
+    // it full fails the ring and flags it overflowed instead of waiting.
+    void setFailsWhenFull(bool failsWhenFull) { m_failsWhenFull = failsWhenFull; }
+    bool overflowed() const { return m_overflowed; }
+
+    // Consumer side. Frames ready to be read, and a pointer to the
+    // contiguous run of them starting at readPosition() in channel.
+    size_t available() const;
+    const float* channelData(unsigned channel, size_t& contiguousFrames) const;
+    uint64_t readPosition() const { return m_header->readPosition; }
+    void consume(size_t frames);
+    bool isClosed() const { return m_header->flags; }
+    bool failed() const { return m_header->flags & Failed; }
+
+    // Sleeps until more frames are published or the ring is closed.
+    // Returns false on timeout.
+    bool waitForData(unsigned timeoutMs) const;
+
+private:
+    SharedAudioRing(int fd, void* mapping, size_t mappingSize);
+
+    float* channelBlock(unsigned channel) const;
+    void publishWritePosition();
+
+    int m_fd;
+    void* m_mapping;
+    size_t m_mappingSize;
+    SharedAudioRingHeader* m_header;
+    bool m_failsWhenFull;
+    std::atomic<bool> m_overflowed;
+};
+
+#endif // SharedAudioRing_h
@@ -0,0 +1,199 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "SimulatedLiveSource.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "AudioStreamChannelsReader.h"
+#include "GStreamerUtilities.h"
+
+// Enough full scale samples for a marker to stay above the detection
+// threshold through audioresample's filter.
+static const guint64 gMarkerFrames = 16;
+static const float gSignalLevel = 0.25;
+static const double gToneFrequency = 440;
+static const unsigned gChannels = 2;
+
+static void onNeedDataCallback(GstAppSrc* appsrc, guint, gpointer userData)
+{
+    static_cast<SimulatedLiveSource*>(userData)->produceBuffer(appsrc);
+}
+
+SimulatedLiveSource::SimulatedLiveSource(const SimulatedLiveConfig& config)
+    : m_config(config)
+    , m_markerIntervalFrames(std::max<guint64>(gst_util_uint64_scale(config.markerInterval, config.sampleRate, GST_SECOND), gMarkerFrames * 2))
+    , m_bufferFrames(std::max<guint64>(gst_util_uint64_scale(config.bufferDuration, config.sampleRate, GST_SECOND), 1))
+    , m_framesProduced(0)
+    , m_firstTimestamp(0)
+    , m_startTime(-1)
+    , m_markersEmitted(0)
+    , m_elementCreated(false)
+{
+}
+
+bool SimulatedLiveSource::loadFile(const char* filePath)
+{
+    ASSERT(!m_elementCreated);
+    std::unique_ptr<AudioBus> bus = createBusFromAudioFile(filePath, false, m_config.sampleRate);
+    if (!bus || !bus->length())
+        return false;
+
+    float peak = 0;
+    for (unsigned channel = 0; channel < bus->numberOfChannels(); ++channel) {
+        const float* data = bus->channel(channel)->data();
+        for (size_t i = 0; i < bus->length(); ++i)
+            peak = std::max(peak, std::fabs(data[i]));
+    }
+
+    // Leave room above the signal so only markers cross the threshold.
+    if (peak > gSignalLevel) {
+        float gain = gSignalLevel / peak;
+        for (unsigned channel = 0; channel < bus->numberOfChannels(); ++channel) {
+            float* data = bus->channel(channel)->mutableData();
+            for (size_t i = 0; i < bus->length(); ++i)
+                data[i] *= gain;
+        }
+    }
+
+    m_file = std::move(bus);
+    return true;
+}
+
+GstElement* SimulatedLiveSource::createElement()
+{
+    ASSERT(!m_elementCreated);
+    m_elementCreated = true;
+
+    GstElement* source = makeGStreamerElement("appsrc", 0);
+    if (!source)
+        return 0;
+
+    GstCaps* caps = getGstAudioCaps(gChannels, m_config.sampleRate);
+    g_object_set(source, "caps", caps, "is-live", TRUE, "format", GST_FORMAT_TIME,
+        "min-latency", static_cast<gint64>(m_config.bufferDuration), NULL);
+    gst_caps_unref(caps);
+
+    GstAppSrcCallbacks callbacks;
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.need_data = onNeedDataCallback;
+    gst_app_src_set_callbacks(GST_APP_SRC(source), &callbacks, this, 0);
+    return source;
+}
+
+gint64 SimulatedLiveSource::markerCaptureTime(unsigned index) const
+{
+    gint64 startTime = m_startTime;
+    if (startTime < 0 || index >= m_markersEmitted)
+        return -1;
+    guint64 frame = (index + 1) * m_markerIntervalFrames;
+    return startTime + gst_util_uint64_scale(frame, G_USEC_PER_SEC, m_config.sampleRate);
+}
+
+int SimulatedLiveSource::markerAt(GstClockTime timestamp) const
+{
+    if (m_startTime < 0 || !GST_CLOCK_TIME_IS_VALID(timestamp) || timestamp < m_firstTimestamp)
+        return -1;
+    guint64 frame = gst_util_uint64_scale_round(timestamp - m_firstTimestamp, m_config.sampleRate, GST_SECOND);
+    guint64 index = (frame + m_markerIntervalFrames / 2) / m_markerIntervalFrames;
+    return index ? index - 1 : -1;
+}
+
+bool SimulatedLiveSource::isMarkerFrame(guint64 frame) const
+{
+    // Marker n starts at frame (n + 1) * interval, none at the very
+    // start while the pipeline is still spinning up.
+    return frame >= m_markerIntervalFrames && frame % m_markerIntervalFrames < gMarkerFrames;
+}
+
+void SimulatedLiveSource::fill(float* interleaved, guint64 firstFrame, size_t frames) const
+{
+    for (size_t i = 0; i < frames; ++i) {
+        guint64 frame = firstFrame + i;
+        float* samples = interleaved + i * gChannels;
+        if (isMarkerFrame(frame)) {
+            std::fill(samples, samples + gChannels, 1.0f);
+            continue;
+        }
+
+        if (m_file) {
+            size_t position = frame % m_file->length();
+            for (unsigned channel = 0; channel < gChannels; ++channel)
+                samples[channel] = m_file->channel(std::min(channel, m_file->numberOfChannels() - 1))->data()[position];
+            continue;
+        }
+
+        float value = gSignalLevel * std::sin(2 * M_PI * gToneFrequency * frame / m_config.sampleRate);
+        std::fill(samples, samples + gChannels, value);
+    }
+}
+
+void SimulatedLiveSource::produceBuffer(GstAppSrc* appsrc)
+{
+    guint64 frames = m_bufferFrames;
+    if (GST_CLOCK_TIME_IS_VALID(m_config.duration)) {
+        guint64 totalFrames = gst_util_uint64_scale(m_config.duration, m_config.sampleRate, GST_SECOND);
+        if (m_framesProduced >= totalFrames) {
+            gst_app_src_end_of_stream(appsrc);
+            return;
+        }
+        frames = std::min(frames, totalFrames - m_framesProduced);
+    }
+
+    if (m_startTime < 0) {
+        // Running time of the first captured sample, so the timestamps
+        // are the ones a real capture element would put on the buffers.
+        if (GstClock* clock = gst_element_get_clock(GST_ELEMENT(appsrc))) {
+            m_firstTimestamp = gst_clock_get_time(clock) - gst_element_get_base_time(GST_ELEMENT(appsrc));
+            gst_object_unref(clock);
+        }
+        m_startTime = g_get_monotonic_time();
+    }
+
+    // Hold the buffer until its last sample has been "captured".
+    guint64 endFrame = m_framesProduced + frames;
+    gint64 deadline = m_startTime + gst_util_uint64_scale(endFrame, G_USEC_PER_SEC, m_config.sampleRate);
+    gint64 now = g_get_monotonic_time();
+    if (deadline > now)
+        g_usleep(deadline - now);
+
+    gsize size = frames * gChannels * sizeof(float);
+    GstClockTime timestamp = m_firstTimestamp + gst_util_uint64_scale(m_framesProduced, GST_SECOND, m_config.sampleRate);
+    GstClockTime endTimestamp = m_firstTimestamp + gst_util_uint64_scale(endFrame, GST_SECOND, m_config.sampleRate);
+#ifdef GST_API_VERSION_1
+    GstBuffer* buffer = gst_buffer_new_allocate(0, size, 0);
+    GstMapInfo map;
+    gst_buffer_map(buffer, &map, GST_MAP_WRITE);
+    fill(reinterpret_cast<float*>(map.data), m_framesProduced, frames);
+    gst_buffer_unmap(buffer, &map);
+    GST_BUFFER_PTS(buffer) = timestamp;
+#else
+    GstBuffer* buffer = gst_buffer_new_and_alloc(size);
+    fill(reinterpret_cast<float*>(GST_BUFFER_DATA(buffer)), m_framesProduced, frames);
+    GST_BUFFER_TIMESTAMP(buffer) = timestamp;
+#endif
+    GST_BUFFER_DURATION(buffer) = endTimestamp - timestamp;
+    GST_BUFFER_OFFSET(buffer) = m_framesProduced;
+    GST_BUFFER_OFFSET_END(buffer) = endFrame;
+
+    m_framesProduced = endFrame;
+    m_markersEmitted = endFrame ? (endFrame - 1) / m_markerIntervalFrames : 0;
+    gst_app_src_push_buffer(appsrc, buffer);
+}
@@ -0,0 +1,98 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef SimulatedLiveSource_h
+#define SimulatedLiveSource_h
+
+#include <atomic>
+#include <memory>
+
+#include <gst/app/gstappsrc.h>
+#include <gst/gst.h>
+
+#include "AudioBus.h"
+
+struct SimulatedLiveConfig {
+    SimulatedLiveConfig()
+        : sampleRate(44100)
+        , bufferDuration(10 * GST_MSECOND)
+        , markerInterval(250 * GST_MSECOND)
+        , duration(GST_CLOCK_TIME_NONE)
+    {
+    }
+
+    float sampleRate;
+    // Capture period: a buffer is pushed once its last sample would
+    // have been captured, like a sound card does.
+    GstClockTime bufferDuration;
+    GstClockTime markerInterval;
+    // EOS after this much audio, GST_CLOCK_TIME_NONE to run forever.
+    GstClockTime duration;
+};
+
+// Live stereo source replaying a file or a 440 Hz tone at real-time
+// pace, for reproducible latency measurements without a microphone.
+//
+// The signal is kept under a quarter of full scale and every
+// markerInterval a short burst of full scale samples is embedded in
+// all channels, so consumers can spot markers with isMarkerSample()
+// even after conversion and resampling, and look up when each one was
+// captured.
+class SimulatedLiveSource {
+public:
+    explicit SimulatedLiveSource(const SimulatedLiveConfig& = SimulatedLiveConfig());
+
+    // Replays filePath, decoded up front, attenuated and looped,
+    // instead of the tone. Call before createElement().
+    bool loadFile(const char* filePath);
+
+    // A live appsrc to hand to AudioStreamChannelsReader::setLiveSource().
+    // Only one element can be created per source, and the source has to
+    // outlive the pipeline using it.
+    GstElement* createElement();
+
+    static bool isMarkerSample(float sample) { return sample >= 0.75; }
+
+    unsigned markersEmitted() const { return m_markersEmitted; }
+
+    // g_get_monotonic_time() at which the first sample of marker index
+    // was captured, or -1 before it was.
+    gint64 markerCaptureTime(unsigned index) const;
+
+    // Index of the marker nearest to the sample with this buffer
+    // timestamp, or -1 if there is none there.
+    int markerAt(GstClockTime timestamp) const;
+
+    void produceBuffer(GstAppSrc*);
+
+private:
+    void fill(float* interleaved, guint64 firstFrame, size_t frames) const;
+    bool isMarkerFrame(guint64 frame) const;
+
+    SimulatedLiveConfig m_config;
+    std::unique_ptr<AudioBus> m_file;
+    guint64 m_markerIntervalFrames;
+    guint64 m_bufferFrames;
+    guint64 m_framesProduced;
+    GstClockTime m_firstTimestamp;
+    std::atomic<gint64> m_startTime;
+    std::atomic<unsigned> m_markersEmitted;
+    bool m_elementCreated;
+};
+
+#endif // SimulatedLiveSource_h
@@ -0,0 +1,210 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "StereoCorrelator.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Bins this far below the averaged power are left out of the PHAT
+// weighting and the coherence instead of amplifying rounding noise.
+static const float gPowerFloor = 1e-20f;
+
+// The real FFTs need an even length.
+static unsigned fastEvenLength(unsigned length)
+{
+    unsigned fastLength = gst_fft_next_fast_length(length);
+    while (fastLength & 1)
+        fastLength = gst_fft_next_fast_length(fastLength + 1);
+    return fastLength;
+}
+
+StereoCorrelator::StereoCorrelator(const StereoCorrelatorConfig& config, ResultCallback callback)
+    : m_config(config)
+    , m_callback(callback)
+    , m_sampleRate(0)
+    , m_fftSize(0)
+    , m_hop(0)
+    , m_maxLag(0)
+    , m_forward(0)
+    , m_inverse(0)
+    , m_firstTimestamp(GST_CLOCK_TIME_NONE)
+    , m_blocks(0)
+{
+    m_config.blockFrames = std::max(m_config.blockFrames, 16u);
+    m_config.maxDelay = std::max(m_config.maxDelay, 0.0);
+    m_config.smoothing = std::min(std::max(m_config.smoothing, 0.0), 0.999);
+}
+
+StereoCorrelator::~StereoCorrelator()
+{
+    releaseTransforms();
+}
+
+void StereoCorrelator::releaseTransforms()
+{
+    if (m_forward)
+        gst_fft_f32_free(m_forward);
+    if (m_inverse)
+        gst_fft_f32_free(m_inverse);
+    m_forward = 0;
+    m_inverse = 0;
+}
+
+// Called with m_mutex held.
+void StereoCorrelator::configure(unsigned sampleRate)
+{
+    m_sampleRate = sampleRate;
+    m_maxLag = std::ceil(m_config.maxDelay * sampleRate);
+    m_fftSize = fastEvenLength(m_config.blockFrames + 2 * m_maxLag);
+    m_hop = m_fftSize - 2 * m_maxLag;
+
+    releaseTransforms();
+    m_forward = gst_fft_f32_new(m_fftSize, FALSE);
+    m_inverse = gst_fft_f32_new(m_fftSize, TRUE);
+
+    unsigned bins = m_fftSize / 2 + 1;
+    for (auto& pending : m_pending) {
+        pending.assign(m_maxLag, 0);
+        // Room for the other channel running a few blocks ahead.
+        pending.reserve(4 * m_fftSize);
+    }
+    m_leftFrame.assign(m_fftSize, 0);
+    m_rightFrame.assign(m_fftSize, 0);
+    m_leftSpectrum.resize(bins);
+    m_rightSpectrum.resize(bins);
+    m_crossSpectrum.resize(bins);
+    m_leftPower.resize(bins);
+    m_rightPower.resize(bins);
+    m_weighted.resize(bins);
+    m_correlation.resize(m_fftSize);
+    m_firstTimestamp = GST_CLOCK_TIME_NONE;
+    m_blocks = 0;
+}
+
+void StereoCorrelator::process(unsigned channel, const float* samples, size_t frames, unsigned sampleRate, GstClockTime timestamp)
+{
+    if (channel > 1 || !sampleRate)
+        return;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (sampleRate != m_sampleRate)
+        configure(sampleRate);
+    if (!channel && !m_blocks && m_pending[0].size() == m_maxLag)
+        m_firstTimestamp = timestamp;
+
+    m_pending[channel].insert(m_pending[channel].end(), samples, samples + frames);
+    while (m_pending[0].size() >= m_fftSize && m_pending[1].size() >= m_fftSize) {
+        analyseBlock();
+        for (auto& pending : m_pending)
+            pending.erase(pending.begin(), pending.begin() + m_hop);
+    }
+}
+
+// Called with m_mutex held.
+void StereoCorrelator::analyseBlock()
+{
+    // Left: the new frames only, zero padded by the largest lag on both
+    // sides. Right: the same frames plus that many around them.
+    std::copy(m_pending[0].begin() + m_maxLag, m_pending[0].begin() + m_maxLag + m_hop, m_leftFrame.begin() + m_maxLag);
+    std::copy(m_pending[1].begin(), m_pending[1].begin() + m_fftSize, m_rightFrame.begin());
+    gst_fft_f32_fft(m_forward, m_leftFrame.data(), m_leftSpectrum.data());
+    gst_fft_f32_fft(m_forward, m_rightFrame.data(), m_rightSpectrum.data());
+
+    // The first block has no history to average with.
+    float previous = m_blocks ? m_config.smoothing : 0;
+    float current = 1 - previous;
+    unsigned bins = m_fftSize / 2 + 1;
+    double coherenceSum = 0;
+    unsigned coherentBins = 0;
+    for (unsigned i = 0; i < bins; ++i) {
+        const GstFFTF32Complex& left = m_leftSpectrum[i];
+        const GstFFTF32Complex& right = m_rightSpectrum[i];
+        GstFFTF32Complex& cross = m_crossSpectrum[i];
+        // conj(left) * right peaks at the lag by which right trails left.
+        cross.r = previous * cross.r + current * (left.r * right.r + left.i * right.i);
+        cross.i = previous * cross.i + current * (left.r * right.i - left.i * right.r);
+        m_leftPower[i] = previous * m_leftPower[i] + current * (left.r * left.r + left.i * left.i);
+        m_rightPower[i] = previous * m_rightPower[i] + current * (right.r * right.r + right.i * right.i);
+
+        float crossPower = cross.r * cross.r + cross.i * cross.i;
+        float power = m_leftPower[i] * m_rightPower[i];
+        if (power < gPowerFloor || crossPower < gPowerFloor * gPowerFloor) {
+            m_weighted[i].r = m_weighted[i].i = 0;
+            continue;
+        }
+        float magnitude = std::sqrt(crossPower);
+        m_weighted[i].r = cross.r / magnitude;
+        m_weighted[i].i = cross.i / magnitude;
+        coherenceSum += std::min(crossPower / power, 1.0f);
+        ++coherentBins;
+    }
+    gst_fft_f32_inverse_fft(m_inverse, m_weighted.data(), m_correlation.data());
+
+    // Positive lags sit at the start, negative ones wrap to the end.
+    int bestLag = 0;
+    float bestValue = m_correlation[0];
+    int maxLag = m_maxLag;
+    for (int lag = -maxLag; lag <= maxLag; ++lag) {
+        float value = m_correlation[lag < 0 ? m_fftSize + lag : lag];
+        if (value > bestValue) {
+            bestValue = value;
+            bestLag = lag;
+        }
+    }
+
+    // Parabolic interpolation between the neighbours of the peak.
+    double offset = 0;
+    if (bestLag > -maxLag && bestLag < maxLag) {
+        float before = m_correlation[(bestLag - 1 + m_fftSize) % m_fftSize];
+        float after = m_correlation[(bestLag + 1 + m_fftSize) % m_fftSize];
+        float curvature = before - 2 * bestValue + after;
+        if (curvature < 0)
+            offset = 0.5 * (before - after) / curvature;
+    }
+
+    StereoCorrelation result;
+    guint64 firstFrame = m_blocks * m_hop;
+    result.timestamp = gst_util_uint64_scale(firstFrame, GST_SECOND, m_sampleRate);
+    if (GST_CLOCK_TIME_IS_VALID(m_firstTimestamp))
+        result.timestamp += m_firstTimestamp;
+    result.delay = (bestLag + offset) / m_sampleRate;
+    // The inverse transform is not normalised.
+    result.peak = std::max(bestValue / m_fftSize, 0.0f);
+    result.coherence = coherentBins ? coherenceSum / coherentBins : 0;
+
+    ++m_blocks;
+    m_latest = result;
+    if (m_callback)
+        m_callback(result);
+}
+
+bool StereoCorrelator::latest(StereoCorrelation& result) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_blocks)
+        return false;
+    result = m_latest;
+    return true;
+}
+
+guint64 StereoCorrelator::blocksAnalysed() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_blocks;
+}
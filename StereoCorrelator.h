@@ -0,0 +1,125 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef StereoCorrelator_h
+#define StereoCorrelator_h
+
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include <gst/fft/gstfftf32.h>
+#include <gst/gst.h>
+
+struct StereoCorrelatorConfig {
+    StereoCorrelatorConfig()
+        : blockFrames(1024)
+        , maxDelay(0.002)
+        , smoothing(0.7)
+    {
+    }
+
+    // New frames analysed per block, rounded up so that the FFT gets a
+    // fast length.
+    unsigned blockFrames;
+    // Largest inter-channel delay looked for, in seconds. 2 ms covers
+    // microphones up to about 68 cm apart.
+    double maxDelay;
+    // Weight of the previous blocks in the averaged spectra, in [0, 1).
+    // 0 estimates every block on its own, which also makes the
+    // coherence meaningless.
+    double smoothing;
+};
+
+struct StereoCorrelation {
+    // Of the first frame of the block.
+    GstClockTime timestamp;
+    // Positive when the right channel lags the left one, with sub-frame
+    // precision.
+    double delay;
+    // Height of the GCC-PHAT peak, 1 for a pure delay, close to 0 when
+    // the channels are unrelated.
+    float peak;
+    // Magnitude squared coherence of the averaged spectra, mean over
+    // the frequency bins.
+    float coherence;
+};
+
+// Estimates the time delay between the front left and front right
+// channels with the generalised cross-correlation weighted by the phase
+// transform (GCC-PHAT), block by block as the samples stream by.
+//
+// Blocks are processed overlap-save: the left block is correlated
+// against the right channel extended by maxDelay on both sides, so the
+// circular correlation of the FFT holds the exact linear one for every
+// lag looked for. Results lag the input by maxDelay. All buffers are
+// allocated when the rate is first seen, nothing is allocated per block.
+//
+// Channels may be fed from their own streaming threads. The block is
+// analysed by whichever thread completes it.
+class StereoCorrelator {
+public:
+    // Called on a streaming thread for every block, with the correlator
+    // locked.
+    typedef std::function<void(const StereoCorrelation&)> ResultCallback;
+
+    StereoCorrelator(const StereoCorrelatorConfig&, ResultCallback);
+    ~StereoCorrelator();
+
+    void process(unsigned channel, const float* samples, size_t frames, unsigned sampleRate, GstClockTime timestamp);
+
+    // Last estimate, false before the first block.
+    bool latest(StereoCorrelation&) const;
+    guint64 blocksAnalysed() const;
+
+private:
+    void configure(unsigned sampleRate);
+    void analyseBlock();
+    void releaseTransforms();
+
+    StereoCorrelatorConfig m_config;
+    ResultCallback m_callback;
+
+    mutable std::mutex m_mutex;
+    unsigned m_sampleRate;
+    unsigned m_fftSize;
+    unsigned m_hop;
+    unsigned m_maxLag;
+    GstFFTF32* m_forward;
+    GstFFTF32* m_inverse;
+    // Samples not analysed yet. Both start with m_maxLag frames of
+    // silence so the first block has its history.
+    std::vector<float> m_pending[2];
+    GstClockTime m_firstTimestamp;
+
+    std::vector<float> m_leftFrame;
+    std::vector<float> m_rightFrame;
+    std::vector<GstFFTF32Complex> m_leftSpectrum;
+    std::vector<GstFFTF32Complex> m_rightSpectrum;
+    // Averaged cross and auto spectra.
+    std::vector<GstFFTF32Complex> m_crossSpectrum;
+    std::vector<float> m_leftPower;
+    std::vector<float> m_rightPower;
+    std::vector<GstFFTF32Complex> m_weighted;
+    std::vector<float> m_correlation;
+
+    guint64 m_blocks;
+    StereoCorrelation m_latest;
+};
+
+#endif // StereoCorrelator_h
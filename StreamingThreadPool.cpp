@@ -0,0 +1,274 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#include "StreamingThreadPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <sched.h>
+#include <thread>
+
+#include "GOwnPtr.h"
+
+namespace {
+
+class StreamingThreadPool {
+public:
+    explicit StreamingThreadPool(const StreamingThreadPoolConfig&);
+
+    void push(GstTaskPoolFunction, gpointer userData);
+    std::vector<StreamingThreadStats> stats();
+    StreamingThreadPoolUsage usage();
+
+private:
+    struct Worker {
+        Worker()
+            : function(0)
+            , userData(0)
+            , tasksRun(0)
+            , busyMicroseconds(0)
+            , createdTime(g_get_monotonic_time())
+        {
+        }
+
+        unsigned index;
+        std::condition_variable condition;
+        GstTaskPoolFunction function;
+        gpointer userData;
+        std::atomic<guint64> tasksRun;
+        std::atomic<gint64> busyMicroseconds;
+        gint64 createdTime;
+    };
+
+    void run(Worker*);
+    void pinToCpu(const Worker&);
+
+    StreamingThreadPoolConfig m_config;
+    std::mutex m_mutex;
+    // Up to maxThreads of them stay once idle, the others exit.
+    std::vector<std::unique_ptr<Worker> > m_workers;
+    std::vector<Worker*> m_idleWorkers;
+    unsigned m_nextIndex;
+    guint64 m_extraThreadsStarted;
+    unsigned m_peakThreads;
+};
+
+StreamingThreadPool::StreamingThreadPool(const StreamingThreadPoolConfig& config)
+    : m_config(config)
+    , m_nextIndex(0)
+    , m_extraThreadsStarted(0)
+    , m_peakThreads(0)
+{
+    if (!m_config.maxThreads)
+        m_config.maxThreads = std::max(1u, std::thread::hardware_concurrency());
+}
+
+void StreamingThreadPool::push(GstTaskPoolFunction function, gpointer userData)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (!m_idleWorkers.empty()) {
+        Worker* worker = m_idleWorkers.back();
+        m_idleWorkers.pop_back();
+        worker->function = function;
+        worker->userData = userData;
+        worker->condition.notify_one();
+        return;
+    }
+
+    if (m_workers.size() >= m_config.maxThreads)
+        ++m_extraThreadsStarted;
+
+    std::unique_ptr<Worker> worker(new Worker);
+    worker->index = m_nextIndex++;
+    worker->function = function;
+    worker->userData = userData;
+
+    Worker* workerPtr = worker.get();
+    m_workers.push_back(std::move(worker));
+    m_peakThreads = std::max<unsigned>(m_peakThreads, m_workers.size());
+    std::thread(&StreamingThreadPool::run, this, workerPtr).detach();
+}
+
+void StreamingThreadPool::pinToCpu(const Worker& worker)
+{
+    if (m_config.cpus.empty())
+        return;
+
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    CPU_SET(m_config.cpus[worker.index % m_config.cpus.size()], &cpuSet);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet))
+        g_warning("Could not pin streaming thread %u", worker.index);
+}
+
+void StreamingThreadPool::run(Worker* worker)
+{
+    pinToCpu(*worker);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        while (!worker->function)
+            worker->condition.wait(lock);
+
+        GstTaskPoolFunction function = worker->function;
+        gpointer userData = worker->userData;
+        lock.unlock();
+
+        gint64 start = g_get_monotonic_time();
+        function(userData);
+        worker->busyMicroseconds += g_get_monotonic_time() - start;
+        ++worker->tasksRun;
+
+        lock.lock();
+        if (m_workers.size() > m_config.maxThreads) {
+            // The worker goes away with its record, the lock outlives
+            // both.
+            m_workers.erase(std::find_if(m_workers.begin(), m_workers.end(), [worker](const std::unique_ptr<Worker>& entry) {
+                return entry.get() == worker;
+            }));
+            return;
+        }
+        worker->function = 0;
+        worker->userData = 0;
+        m_idleWorkers.push_back(worker);
+    }
+}
+
+std::vector<StreamingThreadStats> StreamingThreadPool::stats()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    gint64 now = g_get_monotonic_time();
+
+    std::vector<StreamingThreadStats> result;
+    for (auto& worker : m_workers) {
+        StreamingThreadStats stats;
+        stats.index = worker->index;
+        stats.tasksRun = worker->tasksRun;
+        stats.busyMicroseconds = worker->busyMicroseconds;
+        stats.lifetimeMicroseconds = now - worker->createdTime;
+        result.push_back(stats);
+    }
+    return result;
+}
+
+StreamingThreadPoolUsage StreamingThreadPool::usage()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    StreamingThreadPoolUsage usage;
+    usage.extraThreadsStarted = m_extraThreadsStarted;
+    usage.threads = m_workers.size();
+    usage.peakThreads = m_peakThreads;
+    return usage;
+}
+
+} // namespace
+
+static StreamingThreadPool* gStreamingThreadPool = 0;
+static GstTaskPool* gSharedTaskPool = 0;
+
+#define STREAMING_TYPE_TASK_POOL (streaming_task_pool_get_type())
+
+typedef struct _StreamingTaskPool {
+    GstTaskPool parent;
+} StreamingTaskPool;
+
+typedef struct _StreamingTaskPoolClass {
+    GstTaskPoolClass parentClass;
+} StreamingTaskPoolClass;
+
+GType streaming_task_pool_get_type();
+
+G_DEFINE_TYPE(StreamingTaskPool, streaming_task_pool, GST_TYPE_TASK_POOL);
+
+static void streamingTaskPoolPrepare(GstTaskPool*, GError**)
+{
+    // Workers are created lazily in push().
+}
+
+static void streamingTaskPoolCleanup(GstTaskPool*)
+{
+    // The pool lives as long as the process.
+}
+
+static gpointer streamingTaskPoolPush(GstTaskPool*, GstTaskPoolFunction function, gpointer userData, GError**)
+{
+    gStreamingThreadPool->push(function, userData);
+    // Like the default pool, no id: GstTask waits for its function
+    // to return on its own before calling join.
+    return 0;
+}
+
+static void streamingTaskPoolJoin(GstTaskPool*, gpointer)
+{
+}
+
+static void streaming_task_pool_class_init(StreamingTaskPoolClass* klass)
+{
+    GstTaskPoolClass* taskPoolClass = GST_TASK_POOL_CLASS(klass);
+    taskPoolClass->prepare = streamingTaskPoolPrepare;
+    taskPoolClass->cleanup = streamingTaskPoolCleanup;
+    taskPoolClass->push = streamingTaskPoolPush;
+    taskPoolClass->join = streamingTaskPoolJoin;
+}
+
+static void streaming_task_pool_init(StreamingTaskPool*)
+{
+}
+
+void configureStreamingThreadPool(const StreamingThreadPoolConfig& config)
+{
+    if (gSharedTaskPool)
+        return;
+
+    gStreamingThreadPool = new StreamingThreadPool(config);
+    gSharedTaskPool = GST_TASK_POOL(g_object_new(STREAMING_TYPE_TASK_POOL, NULL));
+#ifdef GST_API_VERSION_1
+    gst_object_ref_sink(gSharedTaskPool);
+#else
+    gst_object_ref(gSharedTaskPool);
+    gst_object_sink(gSharedTaskPool);
+#endif
+    gst_task_pool_prepare(gSharedTaskPool, 0);
+}
+
+GstTaskPool* sharedStreamingThreadPool()
+{
+    return gSharedTaskPool;
+}
+
+std::vector<StreamingThreadStats> streamingThreadPoolStats()
+{
+    if (!gStreamingThreadPool)
+        return std::vector<StreamingThreadStats>();
+    return gStreamingThreadPool->stats();
+}
+
+StreamingThreadPoolUsage streamingThreadPoolUsage()
+{
+    if (!gStreamingThreadPool) {
+        StreamingThreadPoolUsage usage = { 0, 0, 0 };
+        return usage;
+    }
+    return gStreamingThreadPool->usage();
+}
@@ -0,0 +1,69 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#ifndef StreamingThreadPool_h
+#define StreamingThreadPool_h
+
+#include <gst/gst.h>
+#include <vector>
+
+struct StreamingThreadPoolConfig {
+    StreamingThreadPoolConfig()
+        : maxThreads(0)
+    {
+    }
+
+    // Threads kept around between tasks, 0 means one per core. More are
+    // started when every thread is busy and exit once done.
+    unsigned maxThreads;
+    // Worker n is pinned to cpus[n % cpus.size()]. Pass the CPUs of a
+    // single NUMA node to keep all streaming on it. Empty: no pinning.
+    std::vector<int> cpus;
+};
+
+struct StreamingThreadStats {
+    unsigned index;
+    guint64 tasksRun;
+    gint64 busyMicroseconds;
+    gint64 lifetimeMicroseconds;
+};
+
+struct StreamingThreadPoolUsage {
+    // Threads started beyond maxThreads because all were busy.
+    guint64 extraThreadsStarted;
+    unsigned threads;
+    unsigned peakThreads;
+};
+
+// Sets up the process-wide pool that every reader hands its streaming
+// tasks (decodebin internals, queues) to. Threads are reused across
+// readers instead of being created per task. A task is never made to
+// wait: a GstTask holds its thread for as long as it exists, paused
+// included, so a pipeline could never get going if its tasks had to
+// wait for another one to stop. The number of decodes running at once
+// is what bounds the threads, see DecodeScheduler.
+void configureStreamingThreadPool(const StreamingThreadPoolConfig&);
+
+// 0 unless configureStreamingThreadPool() was called.
+GstTaskPool* sharedStreamingThreadPool();
+
+std::vector<StreamingThreadStats> streamingThreadPoolStats();
+StreamingThreadPoolUsage streamingThreadPoolUsage();
+
+#endif // StreamingThreadPool_h
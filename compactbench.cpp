@@ -0,0 +1,144 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include <gst/gst.h>
+
+#include "AudioStreamChannelsReader.h"
+#include "CompactAudioBus.h"
+#include "GOwnPtr.h"
+#include "GStreamerUtilities.h"
+
+// Memory against access cost of each CompactSampleFormat, on a decoded
+// file or on a synthetic 16 bit stereo signal. Random access reads
+// short ranges at random positions, so Lossless also pays for decoding
+// the start of every block it lands in.
+
+static const char* gFormatNames[] = { "float16", "int16", "lossless" };
+static const size_t gRandomReadFrames = 256;
+static const unsigned gRandomReads = 20000;
+
+static std::unique_ptr<AudioBus> createSyntheticBus(unsigned seconds)
+{
+    size_t length = seconds * 44100;
+    std::unique_ptr<AudioBus> bus = AudioBus::create(2, length);
+    bus->setSampleRate(44100);
+
+    std::mt19937 random(1);
+    std::normal_distribution<float> noise(0, 0.02);
+    for (unsigned channel = 0; channel < 2; ++channel) {
+        float* samples = bus->channel(channel)->mutableData();
+        for (size_t i = 0; i < length; ++i) {
+            double t = static_cast<double>(i) / 44100;
+            double envelope = 0.5 + 0.4 * std::sin(2 * M_PI * 0.2 * t);
+            double value = envelope * (0.4 * std::sin(2 * M_PI * 220 * t + channel) + 0.2 * std::sin(2 * M_PI * 1375 * t)) + noise(random);
+            samples[i] = std::max(-32768.0, std::min(32767.0, std::round(value * 32768))) / 32768;
+        }
+    }
+    return bus;
+}
+
+static double signalToNoise(const AudioBus& reference, const AudioBus& decoded)
+{
+    double signal = 0;
+    double noise = 0;
+    for (unsigned channel = 0; channel < reference.numberOfChannels(); ++channel) {
+        const float* expected = reference.channel(channel)->data();
+        const float* actual = decoded.channel(channel)->data();
+        for (size_t i = 0; i < reference.length(); ++i) {
+            signal += expected[i] * expected[i];
+            noise += (actual[i] - expected[i]) * (actual[i] - expected[i]);
+        }
+    }
+    return noise ? 10 * std::log10(signal / noise) : HUGE_VAL;
+}
+
+static double randomReadMicroseconds(const CompactAudioBus& bus)
+{
+    std::mt19937 random(2);
+    std::uniform_int_distribution<size_t> position(0, bus.length() - gRandomReadFrames);
+    std::vector<float> samples(gRandomReadFrames);
+
+    gint64 begin = g_get_monotonic_time();
+    for (unsigned i = 0; i < gRandomReads; ++i)
+        bus.read(i % bus.numberOfChannels(), position(random), gRandomReadFrames, &samples[0]);
+    return static_cast<double>(g_get_monotonic_time() - begin) / gRandomReads;
+}
+
+int main(int argc, char** argv)
+{
+    gint seconds = 600;
+    gchar** arguments = 0;
+
+    GOptionEntry entries[] = {
+        { "seconds", 's', 0, G_OPTION_ARG_INT, &seconds, "Length of the synthetic signal used without FILE (default 600)", "S" },
+        { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &arguments, 0, "[FILE]" },
+        { 0, 0, 0, G_OPTION_ARG_NONE, 0, 0, 0 }
+    };
+
+    GOptionContext* optionContext = g_option_context_new("- memory and access cost of compact PCM storage");
+    g_option_context_add_main_entries(optionContext, entries, 0);
+    GOwnPtr<GError> optionError;
+    bool parsed = g_option_context_parse(optionContext, &argc, &argv, &optionError.outPtr());
+    g_option_context_free(optionContext);
+    if (!parsed) {
+        fprintf(stderr, "%s\n", optionError->message);
+        return -1;
+    }
+
+    std::unique_ptr<AudioBus> bus;
+    if (arguments) {
+        if (!initializeGStreamer()) {
+            fprintf(stderr, "Error trying to initialize gstreamer :(\n");
+            g_strfreev(arguments);
+            return -1;
+        }
+        bus = createBusFromAudioFile(arguments[0], false, 44100);
+        g_strfreev(arguments);
+    } else
+        bus = createSyntheticBus(std::max(seconds, 1));
+    if (!bus || bus->length() < gRandomReadFrames) {
+        fprintf(stderr, "Nothing to compress\n");
+        return -1;
+    }
+
+    double floatBytes = static_cast<double>(bus->length()) * bus->numberOfChannels() * sizeof(float);
+    double frames = static_cast<double>(bus->length()) * bus->numberOfChannels();
+    printf("%zu frames x %u channels, %.1f MiB as float\n", bus->length(), bus->numberOfChannels(), floatBytes / (1 << 20));
+    printf("%-9s %10s %6s %13s %13s %15s %9s\n", "format", "MiB", "ratio", "encode (Mf/s)", "decode (Mf/s)", "random read (us)", "SNR (dB)");
+
+    for (unsigned format = CompactFloat16; format <= CompactLossless; ++format) {
+        gint64 begin = g_get_monotonic_time();
+        std::unique_ptr<CompactAudioBus> compactBus = CompactAudioBus::createFromBus(*bus, static_cast<CompactSampleFormat>(format));
+        gint64 encodeTime = std::max<gint64>(g_get_monotonic_time() - begin, 1);
+
+        begin = g_get_monotonic_time();
+        std::unique_ptr<AudioBus> decoded = compactBus->toAudioBus();
+        gint64 decodeTime = std::max<gint64>(g_get_monotonic_time() - begin, 1);
+
+        printf("%-9s %10.1f %5.2fx %13.1f %13.1f %15.2f %9.1f\n", gFormatNames[format], compactBus->memoryUsage() / static_cast<double>(1 << 20),
+            floatBytes / compactBus->memoryUsage(), frames / encodeTime, frames / decodeTime, randomReadMicroseconds(*compactBus),
+            signalToNoise(*bus, *decoded));
+    }
+    return 0;
+}
@@ -0,0 +1,786 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <signal.h>
+#include <string>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <gst/gst.h>
+
+#include "AudioMixer.h"
+#include "AudioStreamChannelsReader.h"
+#include "AudioStreamProbe.h"
+#include "BatchDecoder.h"
+#include "CompactAudioBus.h"
+#include "DecodeScheduler.h"
+#include "GOwnPtr.h"
+#include "GRefPtr.h"
+#include "GStreamerUtilities.h"
+#include "LazyAudioBus.h"
+#include "LoudnessMeter.h"
+#include "OnsetDetector.h"
+#include "PcmStreamWriter.h"
+#include "PlaylistDecoder.h"
+#include "SegmentedAudioDecoder.h"
+#include "SharedAudioRing.h"
+#include "SimulatedLiveSource.h"
+#include "StereoCorrelator.h"
+#include "StreamingThreadPool.h"
+
+static void printAudioStreamInfo(const char* filePath)
+{
+    AudioStreamInfo info;
+    GOwnPtr<GError> error;
+    if (!probeAudioFile(filePath, info, &error.outPtr())) {
+        printf("%s: unsupported (%s)\n", filePath, error->message);
+        return;
+    }
+
+    printf("%s: codec %s, %u channels, %u Hz, duration %" GST_TIME_FORMAT ", %sseekable, %u audio tracks\n",
+        filePath, info.codec.c_str(), info.channels, info.sampleRate,
+        GST_TIME_ARGS(info.duration), info.seekable ? "" : "not ", info.audioTracks);
+}
+
+static void printQueueStats(const AudioStreamChannelsReader& reader)
+{
+    for (unsigned channel = 0; channel < 2; ++channel) {
+        AudioChannelQueueStats stats;
+        if (!reader.queueStats(channel, stats))
+            continue;
+        printf("channel %u: queued %" G_GUINT64_FORMAT " consumed %" G_GUINT64_FORMAT " dropped %" G_GUINT64_FORMAT
+            " frames, level %u bytes / %" GST_TIME_FORMAT "\n", channel, stats.framesQueued, stats.framesConsumed,
+            stats.framesDropped, stats.currentLevelBytes, GST_TIME_ARGS(stats.currentLevelTime));
+    }
+}
+
+static gboolean printQueueStatsCallback(gpointer userData)
+{
+    printQueueStats(*static_cast<AudioStreamChannelsReader*>(userData));
+    return TRUE;
+}
+
+static std::unique_ptr<AudioBus> createBusWithReaderOptions(const char* filePath, std::function<void(AudioStreamChannelsReader&)> configure)
+{
+    GRefPtr<GMainContext> context = adoptGRef(g_main_context_new());
+    GRefPtr<GMainLoop> loop = adoptGRef(g_main_loop_new(context.get(), FALSE));
+    GMainLoop* loopPtr = loop.get();
+
+    AudioStreamChannelsReader reader(filePath);
+    configure(reader);
+
+    std::unique_ptr<AudioBus> result;
+    reader.start(44100, false, context.get(), [&result, loopPtr](std::unique_ptr<AudioBus> bus, const GError* error) {
+        if (error)
+            printf("decoding failed: %s (%s %d)\n", error->message, g_quark_to_string(error->domain), error->code);
+        result = std::move(bus);
+        g_main_loop_quit(loopPtr);
+    });
+
+    // The live input never reaches EOS, so report as we go.
+    GRefPtr<GSource> statsSource = adoptGRef(g_timeout_source_new_seconds(1));
+    g_source_set_callback(statsSource.get(), printQueueStatsCallback, &reader, 0);
+    g_source_attach(statsSource.get(), context.get());
+
+    g_main_loop_run(loop.get());
+    g_source_destroy(statsSource.get());
+    printQueueStats(reader);
+    return result;
+}
+
+static void printLoudness(const LoudnessInfo& info)
+{
+    printf("loudness: integrated %.1f LUFS, range %.1f LU, max momentary %.1f LUFS, max short-term %.1f LUFS,"
+        " true peak %.1f dBTP, sample peak %.1f dBFS\n", info.integrated, info.range, info.maxMomentary,
+        info.maxShortTerm, info.truePeak, info.samplePeak);
+}
+
+static void printOnsets(const OnsetInfo& info)
+{
+    printf("onsets: %zu, tempo %.1f BPM\n", info.onsets.size(), info.bpm);
+    for (size_t i = 0; i < info.onsets.size() && i < 16; ++i)
+        printf("  onset at %.3f s\n", static_cast<double>(info.onsets[i]) / GST_SECOND);
+    for (const TempoEstimate& estimate : info.tempo)
+        printf("  tempo at %.1f s: %.1f BPM (confidence %.2f)\n", static_cast<double>(estimate.timestamp) / GST_SECOND, estimate.bpm, estimate.confidence);
+}
+
+static std::unique_ptr<AudioBus> createBusFromSimulatedLiveInput(const char* filePath, unsigned seconds)
+{
+    SimulatedLiveConfig config;
+    config.duration = seconds * GST_SECOND;
+    SimulatedLiveSource source(config);
+    if (filePath && !source.loadFile(filePath))
+        return std::unique_ptr<AudioBus>();
+
+    AudioStreamChannelsReader reader(static_cast<const char*>(0));
+    reader.setLiveSource(source.createElement());
+    return reader.createBus(config.sampleRate, false);
+}
+
+// Runs in the forked consumer process, reading the samples in place.
+static int consumeSharedRing(int fd)
+{
+    std::unique_ptr<SharedAudioRing> ring = SharedAudioRing::attach(fd);
+    if (!ring)
+        return 1;
+
+    uint64_t frames = 0;
+    double peak = 0;
+    while (true) {
+        size_t available = ring->available();
+        if (!available) {
+            if (ring->isClosed())
+                break;
+            ring->waitForData(100);
+            continue;
+        }
+        size_t contiguous = 0;
+        ring->channelData(0, contiguous);
+        contiguous = std::min(contiguous, available);
+        for (unsigned channel = 0; channel < ring->numberOfChannels(); ++channel) {
+            size_t channelFrames;
+            const float* samples = ring->channelData(channel, channelFrames);
+            for (size_t i = 0; i < contiguous; ++i)
+                peak = std::max(peak, static_cast<double>(std::fabs(samples[i])));
+        }
+        ring->consume(contiguous);
+        frames += contiguous;
+    }
+
+    printf("consumer %d: read %" G_GUINT64_FORMAT " frames x %u channels at %u Hz, peak %.3f%s\n", getpid(), frames,
+        ring->numberOfChannels(), ring->sampleRate(), peak, ring->failed() ? ", producer failed" : "");
+    fflush(stdout);
+    return ring->failed();
+}
+
+static bool decodeBatch(gchar** filePaths, const BatchDecoderConfig& config)
+{
+    std::vector<std::string> paths(filePaths, filePaths + g_strv_length(filePaths));
+    BatchDecoder decoder(paths, config);
+    decoder.run([&paths](size_t index, std::unique_ptr<AudioBus> bus, const GError* error) {
+        if (error)
+            printf("%s: %s\n", paths[index].c_str(), error->message);
+        else
+            printf("%s: %zu frames x %u channels\n", paths[index].c_str(), bus->length(), bus->numberOfChannels());
+    });
+
+    const BatchDecoderStats& stats = decoder.stats();
+    printf("batch: %u decoded, %u failed (%u timed out) in %.2f s, %u advised, %u prefetched (%" G_GUINT64_FORMAT " bytes), %u decoded from memory\n",
+        stats.filesDecoded, stats.filesFailed, stats.filesTimedOut, stats.elapsedMicroseconds / 1e6, stats.filesAdvised, stats.filesPrefetched,
+        stats.bytesPrefetched, stats.filesDecodedFromMemory);
+    return !stats.filesFailed;
+}
+
+static gboolean runClosureCallback(gpointer userData)
+{
+    (*static_cast<std::function<void()>*>(userData))();
+    return FALSE;
+}
+
+// The bulk files are submitted first, the interactive ones a moment
+// later while the bulk pipelines are busy.
+static bool scheduleDecodes(gchar** bulkPaths, gchar** interactivePaths, const DecodeSchedulerConfig& config)
+{
+    unsigned pending = (bulkPaths ? g_strv_length(bulkPaths) : 0) + (interactivePaths ? g_strv_length(interactivePaths) : 0);
+    if (!pending)
+        return true;
+
+    GRefPtr<GMainContext> context = adoptGRef(g_main_context_new());
+    GRefPtr<GMainLoop> loop = adoptGRef(g_main_loop_new(context.get(), FALSE));
+    DecodeScheduler scheduler(context.get(), config);
+    static const char* classNames[] = { "interactive", "bulk" };
+    gint64 begin = g_get_monotonic_time();
+    bool succeeded = true;
+
+    std::function<void(const char*, DecodePriority)> submit = [&](const char* path, DecodePriority priority) {
+        scheduler.submit(path, priority, [&, path, priority](std::unique_ptr<AudioBus> bus, const GError* error) {
+            printf("%s %s after %.2f s: ", classNames[priority], path, (g_get_monotonic_time() - begin) / 1e6);
+            if (error) {
+                printf("%s\n", error->message);
+                succeeded = false;
+            } else
+                printf("%zu frames x %u channels\n", bus->length(), bus->numberOfChannels());
+            if (!--pending)
+                g_main_loop_quit(loop.get());
+        });
+    };
+
+    for (gchar** path = bulkPaths; path && *path; ++path)
+        submit(*path, DecodePriorityBulk);
+    std::function<void()> submitInteractive = [&] {
+        for (gchar** path = interactivePaths; path && *path; ++path)
+            submit(*path, DecodePriorityInteractive);
+    };
+    GRefPtr<GSource> source = adoptGRef(g_timeout_source_new(200));
+    g_source_set_callback(source.get(), runClosureCallback, &submitInteractive, 0);
+    g_source_attach(source.get(), context.get());
+
+    g_main_loop_run(loop.get());
+    g_source_destroy(source.get());
+
+    for (unsigned i = 0; i < DecodePriorityCount; ++i) {
+        const DecodeClassStats& stats = scheduler.stats(static_cast<DecodePriority>(i));
+        unsigned finished = stats.completed + stats.failed + stats.cancelled;
+        if (!finished)
+            continue;
+        printf("%s: %u completed, %u failed, %u preemptions, queued %.1f ms avg / %.1f ms max, service %.1f ms avg / %.1f ms max, paused %.1f ms\n",
+            classNames[i], stats.completed, stats.failed, stats.preempted, stats.totalQueueTime / 1e3 / finished, stats.maxQueueTime / 1e3,
+            stats.totalServiceTime / 1e3 / finished, stats.maxServiceTime / 1e3, stats.totalPausedTime / 1e3);
+    }
+    return succeeded;
+}
+
+// Each argument is FILE[,GAIN[,OFFSET[,FADE_IN[,FADE_OUT]]]], times in
+// seconds.
+static bool mixFiles(gchar** arguments)
+{
+    std::vector<MixerSource> sources;
+    for (gchar** argument = arguments; *argument; ++argument) {
+        gchar** fields = g_strsplit(*argument, ",", 5);
+        MixerSource source(fields[0]);
+        GstClockTime* times[] = { &source.offset, &source.fadeIn, &source.fadeOut };
+        if (fields[1]) {
+            source.gain = g_ascii_strtod(fields[1], 0);
+            for (unsigned i = 0; i < G_N_ELEMENTS(times) && fields[i + 2]; ++i)
+                *times[i] = g_ascii_strtod(fields[i + 2], 0) * GST_SECOND;
+        }
+        g_strfreev(fields);
+        sources.push_back(source);
+    }
+
+    AudioMixer mixer(sources);
+    GOwnPtr<GError> error;
+    gint64 begin = g_get_monotonic_time();
+    std::unique_ptr<AudioBus> bus = mixer.mix(&error.outPtr());
+    if (!bus) {
+        printf("mix failed: %s\n", error->message);
+        return false;
+    }
+
+    float peak = 0;
+    for (unsigned channel = 0; channel < bus->numberOfChannels(); ++channel) {
+        const float* samples = bus->channel(channel)->data();
+        for (size_t i = 0; i < bus->length(); ++i)
+            peak = std::max(peak, std::fabs(samples[i]));
+    }
+    printf("mixed %zu sources into %zu frames x %u channels in %.2f s, peak %.3f\n", sources.size(), bus->length(),
+        bus->numberOfChannels(), (g_get_monotonic_time() - begin) / 1e6, peak);
+    return true;
+}
+
+static bool readLazily(const char* filePath)
+{
+    gint64 begin = g_get_monotonic_time();
+    std::unique_ptr<LazyAudioBus> bus = LazyAudioBus::create(filePath, false, 44100);
+    if (!bus)
+        return false;
+
+    std::vector<float> samples(44100);
+    size_t frames = std::min<size_t>(bus->length(), samples.size());
+    if (!bus->read(0, 0, frames, samples.data()))
+        return false;
+    printf("lazy: first %zu frames after %" G_GINT64_FORMAT " us\n", frames, g_get_monotonic_time() - begin);
+
+    for (size_t frame = 0; frame < bus->length(); frame += frames) {
+        frames = std::min(samples.size(), bus->length() - frame);
+        for (unsigned channel = 0; channel < bus->numberOfChannels(); ++channel) {
+            if (!bus->read(channel, frame, frames, samples.data()))
+                return false;
+        }
+    }
+
+    LazyAudioBusStats stats = bus->stats();
+    printf("lazy: read %zu frames in %" G_GINT64_FORMAT " us, %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses, %"
+        G_GUINT64_FORMAT " prefetches, %" G_GUINT64_FORMAT " evictions\n", bus->length(), g_get_monotonic_time() - begin,
+        stats.hits, stats.misses, stats.prefetches, stats.evictions);
+    return true;
+}
+
+static void printStreamingThreadPoolStats()
+{
+    std::vector<StreamingThreadStats> threads = streamingThreadPoolStats();
+    for (auto& thread : threads) {
+        double utilisation = thread.lifetimeMicroseconds ? 100.0 * thread.busyMicroseconds / thread.lifetimeMicroseconds : 0;
+        printf("streaming thread %u: %" G_GUINT64_FORMAT " tasks, %.1f%% busy\n", thread.index, thread.tasksRun, utilisation);
+    }
+
+    StreamingThreadPoolUsage usage = streamingThreadPoolUsage();
+    printf("streaming threads: %u now, %u at most, %" G_GUINT64_FORMAT " started beyond the pool size\n",
+        usage.threads, usage.peakThreads, usage.extraThreadsStarted);
+}
+
+static std::vector<int> parseCpuList(const char* list)
+{
+    // "0-3,8,10-11"
+    std::vector<int> cpus;
+    gchar** ranges = g_strsplit(list, ",", -1);
+    for (gchar** range = ranges; *range; ++range) {
+        int first = 0;
+        int last = 0;
+        int fields = sscanf(*range, "%d-%d", &first, &last);
+        if (fields < 1)
+            continue;
+        if (fields == 1)
+            last = first;
+        for (int cpu = first; cpu <= last; ++cpu)
+            cpus.push_back(cpu);
+    }
+    g_strfreev(ranges);
+    return cpus;
+}
+
+static bool parseResamplerQuality(const char* name, ResamplerQuality& quality)
+{
+    if (!g_strcmp0(name, "fast"))
+        quality = ResamplerFast;
+    else if (!g_strcmp0(name, "medium"))
+        quality = ResamplerMedium;
+    else if (!g_strcmp0(name, "best"))
+        quality = ResamplerBest;
+    else
+        return false;
+    return true;
+}
+
+static bool parseCompactFormat(const char* name, CompactSampleFormat& format)
+{
+    if (!g_strcmp0(name, "float16"))
+        format = CompactFloat16;
+    else if (!g_strcmp0(name, "int16"))
+        format = CompactInt16;
+    else if (!g_strcmp0(name, "lossless"))
+        format = CompactLossless;
+    else
+        return false;
+    return true;
+}
+
+static bool parseStreamFormat(const char* name, PcmStreamFormat& format)
+{
+    if (!g_strcmp0(name, "raw"))
+        format = PcmStreamRaw;
+    else if (!g_strcmp0(name, "framed"))
+        format = PcmStreamFramed;
+    else
+        return false;
+    return true;
+}
+
+// "all" or a comma separated list of track numbers.
+static std::vector<unsigned> parseTracks(const char* spec)
+{
+    std::vector<unsigned> tracks;
+    if (!g_strcmp0(spec, "all"))
+        return tracks;
+
+    gchar** fields = g_strsplit(spec, ",", -1);
+    for (gchar** field = fields; *field; ++field)
+        tracks.push_back(g_ascii_strtoull(*field, 0, 10));
+    g_strfreev(fields);
+    return tracks;
+}
+
+// PREROLL[,FIRST_BUFFER[,STALL]] in seconds, 0 disables a deadline.
+static void parseDeadlines(const char* spec, AudioReaderDeadlines& deadlines)
+{
+    gchar** fields = g_strsplit(spec, ",", 3);
+    GstClockTime* times[] = { &deadlines.preroll, &deadlines.firstBuffer, &deadlines.stall };
+    for (unsigned i = 0; i < G_N_ELEMENTS(times) && fields[i]; ++i) {
+        double seconds = g_ascii_strtod(fields[i], 0);
+        *times[i] = seconds > 0 ? static_cast<GstClockTime>(seconds * GST_SECOND) : GST_CLOCK_TIME_NONE;
+    }
+    g_strfreev(fields);
+}
+
+static bool parseQueuePolicy(const char* name, AudioQueueLimits::OverflowPolicy& policy)
+{
+    if (!g_strcmp0(name, "block"))
+        policy = AudioQueueLimits::BlockProducer;
+    else if (!g_strcmp0(name, "drop-oldest"))
+        policy = AudioQueueLimits::DropOldest;
+    else if (!g_strcmp0(name, "drop-newest"))
+        policy = AudioQueueLimits::DropNewest;
+    else
+        return false;
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    const char *filePath = 0;
+    gboolean probeOnly = FALSE;
+    gint segments = 1;
+    gint queueBytes = 0;
+    gint queueTimeMs = 0;
+    gchar* queuePolicy = 0;
+    gchar* registryPath = 0;
+    gboolean printStartupTimes = FALSE;
+    gchar** outputs = 0;
+    gchar* tracks = 0;
+    gboolean schedule = FALSE;
+    gchar** interactive = 0;
+    gint maxPipelines = 0;
+    gint bulkPipelines = 2;
+    gint threadPoolSize = -1;
+    gchar* threadPoolCpus = 0;
+    gchar* tracePath = 0;
+    gint simulatedLiveSeconds = 0;
+    gchar* resampler = 0;
+    gboolean measureLoudness = FALSE;
+    gboolean detectOnsets = FALSE;
+    gboolean correlate = FALSE;
+    gboolean playlist = FALSE;
+    gboolean mix = FALSE;
+    gboolean sharedOutput = FALSE;
+    gboolean lazy = FALSE;
+    gboolean batch = FALSE;
+    gint batchDecodes = 2;
+    gint readAheadFiles = 2;
+    gchar* deadlines = 0;
+    gchar* compact = 0;
+    gint inputFd = -1;
+    gchar* stdoutFormat = 0;
+    gchar** arguments = 0;
+
+    GOptionEntry entries[] = {
+        { "probe", 'p', 0, G_OPTION_ARG_NONE, &probeOnly, "Only print stream information, don't decode", 0 },
+        { "segments", 's', 0, G_OPTION_ARG_INT, &segments, "Decode the file as N parallel segments (0 for one per core)", "N" },
+        { "queue-bytes", 0, 0, G_OPTION_ARG_INT, &queueBytes, "Per-channel queue budget in bytes", "BYTES" },
+        { "queue-time", 0, 0, G_OPTION_ARG_INT, &queueTimeMs, "Per-channel queue budget in milliseconds", "MS" },
+        { "queue-policy", 0, 0, G_OPTION_ARG_STRING, &queuePolicy, "What to do when a queue is full: block, drop-oldest or drop-newest", "POLICY" },
+        { "registry", 0, 0, G_OPTION_ARG_FILENAME, &registryPath, "Start from this pinned registry cache, without scanning or forking", "FILE" },
+        { "startup-times", 0, 0, G_OPTION_ARG_NONE, &printStartupTimes, "Print how long GStreamer initialization took", 0 },
+        { "output", 'o', 0, G_OPTION_ARG_STRING_ARRAY, &outputs, "Add an output decoded in the same run, can be repeated", "RATE[:mono]" },
+        { "tracks", 0, 0, G_OPTION_ARG_STRING, &tracks, "Decode these audio tracks in one pass, each into its own output", "all|N[,N...]" },
+        { "thread-pool", 0, 0, G_OPTION_ARG_INT, &threadPoolSize, "Run streaming tasks on a shared pool of N threads (0 for one per core)", "N" },
+        { "thread-pool-cpus", 0, 0, G_OPTION_ARG_STRING, &threadPoolCpus, "Pin the pool threads to these CPUs", "0-3,8" },
+        { "trace", 0, 0, G_OPTION_ARG_FILENAME, &tracePath, "Write a Chrome trace of the buffer flow to FILE", "FILE" },
+        { "simulated-live", 0, 0, G_OPTION_ARG_INT, &simulatedLiveSeconds, "Capture S seconds from a simulated live source replaying FILE (or a tone)", "S" },
+        { "resampler", 0, 0, G_OPTION_ARG_STRING, &resampler, "Resample in-process instead of with audioresample: fast, medium or best", "QUALITY" },
+        { "loudness", 'l', 0, G_OPTION_ARG_NONE, &measureLoudness, "Measure EBU R128 loudness and true peak while decoding", 0 },
+        { "onsets", 0, 0, G_OPTION_ARG_NONE, &detectOnsets, "Detect onsets and estimate the tempo while decoding", 0 },
+        { "correlate", 0, 0, G_OPTION_ARG_NONE, &correlate, "Estimate the delay between left and right (GCC-PHAT) while decoding or capturing", 0 },
+        { "playlist", 0, 0, G_OPTION_ARG_NONE, &playlist, "Decode all the FILEs back to back into one output", 0 },
+        { "mix", 0, 0, G_OPTION_ARG_NONE, &mix, "Sum the FILEs into one output, each given as FILE[,GAIN[,OFFSET[,FADE_IN[,FADE_OUT]]]]", 0 },
+        { "fd", 0, 0, G_OPTION_ARG_INT, &inputFd, "Decode what is read from file descriptor N (FILE - is stdin)", "N" },
+        { "stdout", 0, 0, G_OPTION_ARG_STRING, &stdoutFormat, "Stream the samples to stdout as they are decoded: raw (interleaved float32) or framed (planar chunks)", "FORMAT" },
+        { "compact", 0, 0, G_OPTION_ARG_STRING, &compact, "Keep the decoded samples as float16, int16 or lossless", "FORMAT" },
+        { "batch", 0, 0, G_OPTION_ARG_NONE, &batch, "Decode each of the FILEs, reading the next ones ahead", 0 },
+        { "batch-decodes", 0, 0, G_OPTION_ARG_INT, &batchDecodes, "Pipelines in flight in batch mode (default 2)", "N" },
+        { "deadlines", 0, 0, G_OPTION_ARG_STRING, &deadlines, "Give up when prerolling, the first buffer or the next one take longer (seconds, 0 disables)", "PREROLL,FIRST,STALL" },
+        { "schedule", 0, 0, G_OPTION_ARG_NONE, &schedule, "Decode the FILEs as bulk jobs through the priority scheduler", 0 },
+        { "interactive", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &interactive, "Submit FILE as an interactive job once the bulk ones run, can be repeated", "FILE" },
+        { "pipelines", 0, 0, G_OPTION_ARG_INT, &maxPipelines, "Pipelines decoding at once when scheduling (0 for one per core)", "N" },
+        { "bulk-pipelines", 0, 0, G_OPTION_ARG_INT, &bulkPipelines, "Cap on bulk pipelines when scheduling, paused ones included (default 2)", "N" },
+        { "read-ahead", 0, 0, G_OPTION_ARG_INT, &readAheadFiles, "Files read ahead in batch mode (default 2, 0 to disable)", "N" },
+        { "lazy", 0, 0, G_OPTION_ARG_NONE, &lazy, "Decode block by block as the file is read, and print the cache statistics", 0 },
+        { "shared-output", 0, 0, G_OPTION_ARG_NONE, &sharedOutput, "Stream the samples to a child process through shared memory", 0 },
+        { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &arguments, 0, "[FILE...]" },
+        { 0, 0, 0, G_OPTION_ARG_NONE, 0, 0, 0 }
+    };
+
+    GOptionContext* optionContext = g_option_context_new("- read audio channels separately");
+    g_option_context_add_main_entries(optionContext, entries, 0);
+    GOwnPtr<GError> optionError;
+    bool parsed = g_option_context_parse(optionContext, &argc, &argv, &optionError.outPtr());
+    g_option_context_free(optionContext);
+    if (!parsed) {
+        fprintf(stderr, "%s\n", optionError->message);
+        return -1;
+    }
+
+    if (arguments)
+        filePath = arguments[0];
+    if (!g_strcmp0(filePath, "-")) {
+        filePath = 0;
+        inputFd = STDIN_FILENO;
+    }
+
+    AudioQueueLimits queueLimits;
+    queueLimits.maxBytes = std::max(queueBytes, 0);
+    queueLimits.maxTime = std::max(queueTimeMs, 0) * GST_MSECOND;
+    bool hasQueueLimits = queueBytes > 0 || queueTimeMs > 0 || queuePolicy;
+    if (queuePolicy && !parseQueuePolicy(queuePolicy, queueLimits.policy)) {
+        fprintf(stderr, "Unknown queue policy %s\n", queuePolicy);
+        g_free(queuePolicy);
+        g_strfreev(arguments);
+        return -1;
+    }
+    g_free(queuePolicy);
+
+    ResamplerQuality resamplerQuality = ResamplerMedium;
+    bool hasResampler = resampler;
+    if (resampler && !parseResamplerQuality(resampler, resamplerQuality)) {
+        fprintf(stderr, "Unknown resampler quality %s\n", resampler);
+        g_free(resampler);
+        g_strfreev(arguments);
+        return -1;
+    }
+    g_free(resampler);
+
+    CompactSampleFormat compactFormat = CompactFloat16;
+    bool hasCompactFormat = compact;
+    if (compact && !parseCompactFormat(compact, compactFormat)) {
+        fprintf(stderr, "Unknown compact format %s\n", compact);
+        g_free(compact);
+        g_strfreev(arguments);
+        return -1;
+    }
+    g_free(compact);
+
+    AudioReaderDeadlines readerDeadlines;
+    bool hasDeadlines = deadlines;
+    if (deadlines)
+        parseDeadlines(deadlines, readerDeadlines);
+    g_free(deadlines);
+
+    // The samples get the real stdout, everything we print goes to
+    // stderr from here on.
+    std::unique_ptr<PcmStreamWriter> streamWriter;
+    PcmStreamFormat streamFormat = PcmStreamRaw;
+    if (stdoutFormat) {
+        if (!parseStreamFormat(stdoutFormat, streamFormat)) {
+            fprintf(stderr, "Unknown stdout format %s\n", stdoutFormat);
+            g_free(stdoutFormat);
+            g_strfreev(arguments);
+            return -1;
+        }
+        fflush(stdout);
+        int outputFd = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        signal(SIGPIPE, SIG_IGN);
+        streamWriter.reset(new PcmStreamWriter(outputFd, streamFormat, 2, 44100));
+    }
+    g_free(stdoutFormat);
+
+    // The consumer is forked before GStreamer starts any thread.
+    std::unique_ptr<SharedAudioRing> sharedRing;
+    pid_t consumer = -1;
+    if (sharedOutput) {
+        // The reader fills in the rate the decode negotiates.
+        sharedRing = SharedAudioRing::create(2, 44100, 0);
+        if (!sharedRing || (consumer = fork()) < 0) {
+            fprintf(stderr, "Error setting up the shared output\n");
+            g_strfreev(arguments);
+            return -1;
+        }
+        if (!consumer) {
+            // Don't outlive a parent that bails out before closing the ring.
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            _exit(consumeSharedRing(sharedRing->fd()));
+        }
+    }
+
+    gint64 startupBegin = g_get_monotonic_time();
+    bool initialized = registryPath ? initializeGStreamerWithPinnedRegistry(registryPath) : initializeGStreamer();
+    g_free(registryPath);
+    if (!initialized) {
+        fprintf(stderr, "Error trying to initialize gstreamer :(\n");
+        g_strfreev(arguments);
+        return -1;
+    }
+
+    if (threadPoolSize >= 0 || threadPoolCpus) {
+        StreamingThreadPoolConfig poolConfig;
+        poolConfig.maxThreads = std::max(threadPoolSize, 0);
+        if (threadPoolCpus)
+            poolConfig.cpus = parseCpuList(threadPoolCpus);
+        configureStreamingThreadPool(poolConfig);
+    }
+    g_free(threadPoolCpus);
+
+    if (printStartupTimes) {
+        const GStreamerStartupTimes& times = gstreamerStartupTimes();
+        printf("startup: %" G_GINT64_FORMAT " us total, gst_init %" G_GINT64_FORMAT " us (%s registry, %u element factories),"
+            " factory resolution %" G_GINT64_FORMAT " us\n", g_get_monotonic_time() - startupBegin, times.initMicroseconds,
+            times.registryPinned ? "pinned" : "scanned", times.registryFeatureCount, times.factoryResolveMicroseconds);
+    }
+
+    if (probeOnly) {
+        if (!filePath)
+            fprintf(stderr, "--probe needs an audio file\n");
+        else
+            printAudioStreamInfo(filePath);
+        g_strfreev(arguments);
+        return 0;
+    }
+
+    if (outputs && filePath) {
+        std::vector<AudioOutputSpec> specs;
+        for (gchar** output = outputs; *output; ++output)
+            specs.push_back(AudioOutputSpec(g_ascii_strtod(*output, 0), g_str_has_suffix(*output, ":mono")));
+        g_strfreev(outputs);
+
+        std::vector<std::unique_ptr<AudioBus> > buses = createBusesFromAudioFile(filePath, specs);
+        for (auto& outputBus : buses) {
+            if (outputBus)
+                printf("decoded %zu frames x %u channels at %.0f Hz\n", outputBus->length(), outputBus->numberOfChannels(), outputBus->sampleRate());
+        }
+        g_strfreev(arguments);
+        return buses.empty() ? -1 : 0;
+    }
+    g_strfreev(outputs);
+
+    if (tracks && filePath) {
+        std::vector<unsigned> selected = parseTracks(tracks);
+        g_free(tracks);
+
+        std::vector<std::unique_ptr<AudioBus> > buses = createBusesFromAudioTracks(filePath, selected, false, 44100);
+        for (size_t i = 0; i < buses.size(); ++i) {
+            if (buses[i])
+                printf("track %u: decoded %zu frames x %u channels\n", selected.empty() ? static_cast<unsigned>(i) : selected[i], buses[i]->length(), buses[i]->numberOfChannels());
+        }
+        g_strfreev(arguments);
+        return buses.empty() ? -1 : 0;
+    }
+    g_free(tracks);
+
+    if (mix && arguments) {
+        bool succeeded = mixFiles(arguments);
+        g_strfreev(arguments);
+        return succeeded ? 0 : -1;
+    }
+
+    if (schedule) {
+        DecodeSchedulerConfig config;
+        config.maxPipelines = std::max(maxPipelines, 0);
+        config.classLimits[DecodePriorityBulk] = std::max(bulkPipelines, 0);
+        if (hasDeadlines)
+            config.deadlines = readerDeadlines;
+        bool succeeded = scheduleDecodes(arguments, interactive, config);
+        g_strfreev(interactive);
+        g_strfreev(arguments);
+        return succeeded ? 0 : -1;
+    }
+    g_strfreev(interactive);
+
+    if (batch && arguments) {
+        BatchDecoderConfig config;
+        config.concurrentDecodes = std::max(batchDecodes, 1);
+        config.readAheadFiles = std::max(readAheadFiles, 0);
+        if (hasDeadlines)
+            config.deadlines = readerDeadlines;
+        bool succeeded = decodeBatch(arguments, config);
+        g_strfreev(arguments);
+        return succeeded ? 0 : -1;
+    }
+
+    if (hasCompactFormat && filePath) {
+        std::unique_ptr<CompactAudioBus> compactBus = createCompactBusFromAudioFile(filePath, false, 44100, compactFormat);
+        if (compactBus) {
+            printf("decoded %zu frames x %u channels at %.0f Hz into %zu bytes (%zu as float)\n", compactBus->length(),
+                compactBus->numberOfChannels(), compactBus->sampleRate(), compactBus->memoryUsage(),
+                compactBus->length() * compactBus->numberOfChannels() * sizeof(float));
+        }
+        g_strfreev(arguments);
+        return compactBus ? 0 : -1;
+    }
+
+    if (lazy && filePath) {
+        bool succeeded = readLazily(filePath);
+        g_strfreev(arguments);
+        return succeeded ? 0 : -1;
+    }
+
+    std::unique_ptr<AudioBus> bus;
+    if (playlist && arguments) {
+        std::vector<PlaylistItem> items;
+        for (gchar** argument = arguments; *argument; ++argument)
+            items.push_back(PlaylistItem(*argument));
+        std::vector<PlaylistSegment> playlistSegments;
+        bus = createBusFromPlaylist(items, false, 44100, &playlistSegments);
+        for (unsigned i = 0; bus && i < playlistSegments.size(); ++i)
+            printf("%s: frames %" G_GUINT64_FORMAT " to %" G_GUINT64_FORMAT "\n", items[i].filePath.c_str(),
+                playlistSegments[i].offset, playlistSegments[i].offset + playlistSegments[i].length);
+    } else if (simulatedLiveSeconds > 0)
+        bus = createBusFromSimulatedLiveInput(filePath, simulatedLiveSeconds);
+    else if (hasQueueLimits || tracePath || hasResampler || sharedRing || inputFd >= 0 || streamWriter || correlate || hasDeadlines) {
+        GstClockTime nextCorrelationReport = 0;
+        bus = createBusWithReaderOptions(filePath, [&](AudioStreamChannelsReader& reader) {
+            if (correlate) {
+                reader.setStereoCorrelation(StereoCorrelatorConfig(), [&nextCorrelationReport](const StereoCorrelation& result) {
+                    // About a line per second.
+                    if (result.timestamp < nextCorrelationReport)
+                        return;
+                    nextCorrelationReport = result.timestamp + GST_SECOND;
+                    printf("stereo delay at %.1f s: %+.1f us, peak %.2f, coherence %.2f\n",
+                        static_cast<double>(result.timestamp) / GST_SECOND, result.delay * 1e6, result.peak, result.coherence);
+                });
+            }
+            if (inputFd >= 0)
+                reader.setInputFd(inputFd);
+            if (hasDeadlines)
+                reader.setDeadlines(readerDeadlines);
+            if (streamWriter) {
+                PcmStreamWriter* writer = streamWriter.get();
+                AudioStreamChannelsReader* readerPtr = &reader;
+                reader.setCollectsBuffers(false);
+                reader.setSampleObserver([writer, readerPtr](unsigned channel, const float* samples, size_t frames, GstClockTime timestamp) {
+                    // Nobody is reading anymore.
+                    if (!writer->write(channel, samples, frames, timestamp))
+                        readerPtr->cancel();
+                });
+            }
+            if (sharedRing)
+                reader.setSharedOutput(sharedRing.get());
+            if (hasQueueLimits)
+                reader.setQueueLimits(queueLimits);
+            if (tracePath)
+                reader.setTraceFile(tracePath);
+            if (hasResampler)
+                reader.setResampler(resamplerQuality);
+        });
+    }
+    else if (filePath && segments != 1)
+        bus = createBusFromAudioFileInSegments(filePath, false, 44100, std::max(segments, 0));
+    else if (measureLoudness) {
+        LoudnessInfo loudness;
+        bus = createBusFromAudioFile(filePath, false, 44100, &loudness);
+        if (bus)
+            printLoudness(loudness);
+    } else if (detectOnsets) {
+        AudioStreamChannelsReader reader(filePath);
+        reader.setOnsetDetection(OnsetDetectorConfig());
+        bus = reader.createBus(44100, false);
+        OnsetInfo info;
+        if (bus && reader.onsets(info))
+            printOnsets(info);
+    } else
+        bus = createBusFromAudioFile(filePath, false, 44100);
+    if (bus)
+        printf("decoded %zu frames x %u channels at %.0f Hz\n", bus->length(), bus->numberOfChannels(), bus->sampleRate());
+    if (streamWriter) {
+        streamWriter->finish();
+        fprintf(stderr, "streamed %" G_GUINT64_FORMAT " frames to stdout\n", streamWriter->framesWritten());
+    }
+    if (consumer > 0) {
+        // Covers the paths that never touched the ring.
+        sharedRing->close(false);
+        waitpid(consumer, 0, 0);
+    }
+    printStreamingThreadPoolStats();
+    g_free(tracePath);
+    g_strfreev(arguments);
+    printf("finished main!\n");
+    return 0;
+}
@@ -0,0 +1,172 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include <gst/gst.h>
+
+#include "AudioStreamChannelsReader.h"
+#include "GOwnPtr.h"
+#include "GRefPtr.h"
+#include "GStreamerUtilities.h"
+#include "SimulatedLiveSource.h"
+
+// Capture to consumer latency of the live path: a SimulatedLiveSource
+// feeds the reader and every marker is timed from the moment its first
+// sample was captured to the moment the front left appsink hands it to
+// the reader. Markers are identified by their stream position, so a
+// dropped or spurious onset doesn't shift the ones after it.
+struct LatencyCollector {
+    LatencyCollector(const SimulatedLiveSource& source, float sampleRate)
+        : source(source)
+        , sampleRate(sampleRate)
+        , inMarker(false)
+        , lastMarker(-1)
+    {
+    }
+
+    void observe(const float* samples, size_t frames, GstClockTime timestamp)
+    {
+        gint64 now = g_get_monotonic_time();
+        for (size_t i = 0; i < frames; ++i) {
+            if (!SimulatedLiveSource::isMarkerSample(samples[i])) {
+                inMarker = false;
+                continue;
+            }
+            if (inMarker || !GST_CLOCK_TIME_IS_VALID(timestamp))
+                continue;
+            inMarker = true;
+            int marker = source.markerAt(timestamp + gst_util_uint64_scale_round(i, GST_SECOND, sampleRate));
+            if (marker <= lastMarker)
+                continue;
+            lastMarker = marker;
+            gint64 captureTime = source.markerCaptureTime(marker);
+            if (captureTime >= 0)
+                latencies.push_back(now - captureTime);
+        }
+    }
+
+    const SimulatedLiveSource& source;
+    float sampleRate;
+    bool inMarker;
+    int lastMarker;
+    std::vector<gint64> latencies;
+};
+
+static double percentile(const std::vector<gint64>& sorted, double fraction)
+{
+    size_t index = std::min<size_t>(sorted.size() - 1, fraction * sorted.size());
+    return sorted[index] / 1000.0;
+}
+
+static void printLatencies(std::vector<gint64> latencies, unsigned markersEmitted)
+{
+    printf("markers: %u emitted, %zu received\n", markersEmitted, latencies.size());
+    if (latencies.empty())
+        return;
+
+    std::sort(latencies.begin(), latencies.end());
+    double mean = 0;
+    for (gint64 latency : latencies)
+        mean += latency;
+    mean /= latencies.size();
+    double variance = 0;
+    for (gint64 latency : latencies)
+        variance += (latency - mean) * (latency - mean);
+    double jitter = std::sqrt(variance / latencies.size());
+
+    printf("latency (ms): min %.3f p50 %.3f p90 %.3f p99 %.3f max %.3f mean %.3f jitter %.3f\n",
+        latencies.front() / 1000.0, percentile(latencies, 0.5), percentile(latencies, 0.9),
+        percentile(latencies, 0.99), latencies.back() / 1000.0, mean / 1000.0, jitter / 1000.0);
+}
+
+int main(int argc, char** argv)
+{
+    gchar* filePath = 0;
+    gint durationSeconds = 10;
+    gint bufferMs = 10;
+    gint markerMs = 250;
+    gint sampleRate = 44100;
+
+    GOptionEntry entries[] = {
+        { "file", 'f', 0, G_OPTION_ARG_FILENAME, &filePath, "Replay this file instead of a tone", "FILE" },
+        { "duration", 'd', 0, G_OPTION_ARG_INT, &durationSeconds, "Seconds of audio to capture (default 10)", "S" },
+        { "buffer-time", 0, 0, G_OPTION_ARG_INT, &bufferMs, "Capture period in milliseconds (default 10)", "MS" },
+        { "marker-interval", 0, 0, G_OPTION_ARG_INT, &markerMs, "Milliseconds between markers (default 250)", "MS" },
+        { "rate", 'r', 0, G_OPTION_ARG_INT, &sampleRate, "Sample rate of source and reader (default 44100)", "HZ" },
+        { 0, 0, 0, G_OPTION_ARG_NONE, 0, 0, 0 }
+    };
+
+    GOptionContext* optionContext = g_option_context_new("- measure live capture to consumer latency");
+    g_option_context_add_main_entries(optionContext, entries, 0);
+    GOwnPtr<GError> optionError;
+    bool parsed = g_option_context_parse(optionContext, &argc, &argv, &optionError.outPtr());
+    g_option_context_free(optionContext);
+    if (!parsed) {
+        fprintf(stderr, "%s\n", optionError->message);
+        return -1;
+    }
+
+    if (!initializeGStreamer()) {
+        fprintf(stderr, "Error trying to initialize gstreamer :(\n");
+        g_free(filePath);
+        return -1;
+    }
+
+    SimulatedLiveConfig config;
+    config.sampleRate = std::max(sampleRate, 8000);
+    config.bufferDuration = std::max(bufferMs, 1) * GST_MSECOND;
+    config.markerInterval = std::max(markerMs, 1) * GST_MSECOND;
+    config.duration = std::max(durationSeconds, 1) * GST_SECOND;
+
+    SimulatedLiveSource source(config);
+    if (filePath && !source.loadFile(filePath)) {
+        fprintf(stderr, "Could not decode %s\n", filePath);
+        g_free(filePath);
+        return -1;
+    }
+    g_free(filePath);
+
+    LatencyCollector collector(source, config.sampleRate);
+    GRefPtr<GMainContext> context = adoptGRef(g_main_context_new());
+    GRefPtr<GMainLoop> loop = adoptGRef(g_main_loop_new(context.get(), FALSE));
+    GMainLoop* loopPtr = loop.get();
+    bool succeeded = false;
+
+    {
+        AudioStreamChannelsReader reader(static_cast<const char*>(0));
+        reader.setLiveSource(source.createElement());
+        reader.setSampleObserver([&collector](unsigned channel, const float* samples, size_t frames, GstClockTime timestamp) {
+            if (!channel)
+                collector.observe(samples, frames, timestamp);
+        });
+        reader.start(config.sampleRate, false, context.get(), [&succeeded, loopPtr](std::unique_ptr<AudioBus>, const GError* error) {
+            if (error)
+                fprintf(stderr, "Capture failed: %s\n", error->message);
+            succeeded = !error;
+            g_main_loop_quit(loopPtr);
+        });
+        g_main_loop_run(loop.get());
+    }
+
+    printLatencies(collector.latencies, source.markersEmitted());
+    return succeeded ? 0 : -1;
+}
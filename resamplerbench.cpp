@@ -0,0 +1,189 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include <gst/gst.h>
+
+#include "GOwnPtr.h"
+#include "GRefPtr.h"
+#include "GRefPtrGStreamer.h"
+#include "GStreamerUtilities.h"
+#include "PolyphaseResampler.h"
+
+// Accuracy and speed of PolyphaseResampler at each quality preset.
+// Accuracy is the SNR of resampled tones against the same tones
+// generated at the output rate, speed is compared against audioresample
+// at a matching quality setting.
+
+struct RatePair {
+    unsigned input;
+    unsigned output;
+};
+
+static const RatePair gRatePairs[] = {
+    { 44100, 48000 },
+    { 48000, 44100 },
+    { 44100, 16000 },
+    { 22050, 44100 }
+};
+
+static const char* gQualityNames[] = { "fast", "medium", "best" };
+// audioresample quality (0-10) with a comparable filter length.
+static const int gAudioResampleQualities[] = { 2, 4, 8 };
+static const unsigned gSamplesPerBuffer = 4096;
+
+static double toneSNR(const PolyphaseResampler& resampler, const RatePair& rates, double frequency)
+{
+    std::vector<float> input(rates.input);
+    for (size_t i = 0; i < input.size(); ++i)
+        input[i] = 0.5 * std::sin(2 * M_PI * frequency * i / rates.input);
+
+    std::vector<float> output(resampler.outputLength(input.size()));
+    resampler.process(&input[0], input.size(), &output[0]);
+
+    // Leave out the edges, where the kernel runs into the zero padding.
+    double signal = 0;
+    double noise = 0;
+    size_t margin = output.size() / 10;
+    for (size_t i = margin; i < output.size() - margin; ++i) {
+        double reference = 0.5 * std::sin(2 * M_PI * frequency * i / rates.output);
+        signal += reference * reference;
+        noise += (output[i] - reference) * (output[i] - reference);
+    }
+    return 10 * std::log10(signal / std::max(noise, 1e-30));
+}
+
+static double worstToneSNR(const RatePair& rates, ResamplerQuality quality)
+{
+    PolyphaseResampler resampler(rates.input, rates.output, quality);
+    // Tones up to 80% of the lower Nyquist frequency.
+    double bandEdge = 0.4 * std::min(rates.input, rates.output);
+    double worst = HUGE_VAL;
+    for (double frequency = 100; frequency <= bandEdge; frequency *= 2)
+        worst = std::min(worst, toneSNR(resampler, rates, frequency));
+    return worst;
+}
+
+static double polyphaseFramesPerSecond(const RatePair& rates, ResamplerQuality quality, unsigned seconds)
+{
+    PolyphaseResampler resampler(rates.input, rates.output, quality);
+    std::vector<float> input(static_cast<size_t>(rates.input) * seconds);
+    for (size_t i = 0; i < input.size(); ++i)
+        input[i] = 0.5 * std::sin(2 * M_PI * 1000 * i / rates.input);
+    std::vector<float> output(resampler.outputLength(input.size()));
+
+    gint64 start = g_get_monotonic_time();
+    resampler.process(&input[0], input.size(), &output[0]);
+    gint64 elapsed = std::max<gint64>(g_get_monotonic_time() - start, 1);
+    return input.size() * 1e6 / elapsed;
+}
+
+// Microseconds to push seconds of a 1 kHz tone through the pipeline.
+static gint64 runPipeline(const RatePair& rates, int audioResampleQuality, unsigned seconds)
+{
+    unsigned buffers = (rates.input * seconds + gSamplesPerBuffer - 1) / gSamplesPerBuffer;
+#ifdef GST_API_VERSION_1
+    const char* inputCaps = "audio/x-raw,format=F32LE,channels=1";
+    const char* outputCaps = "audio/x-raw";
+#else
+    const char* inputCaps = "audio/x-raw-float,width=32,channels=1";
+    const char* outputCaps = "audio/x-raw-float";
+#endif
+    GOwnPtr<gchar> description;
+    if (audioResampleQuality >= 0) {
+        description.set(g_strdup_printf("audiotestsrc num-buffers=%u samplesperbuffer=%u ! %s,rate=%u ! audioresample quality=%d ! %s,rate=%u ! fakesink",
+            buffers, gSamplesPerBuffer, inputCaps, rates.input, audioResampleQuality, outputCaps, rates.output));
+    } else {
+        description.set(g_strdup_printf("audiotestsrc num-buffers=%u samplesperbuffer=%u ! %s,rate=%u ! fakesink",
+            buffers, gSamplesPerBuffer, inputCaps, rates.input));
+    }
+
+    GOwnPtr<GError> error;
+    GRefPtr<GstElement> pipeline = gst_parse_launch(description.get(), &error.outPtr());
+    if (!pipeline)
+        return -1;
+
+    GRefPtr<GstBus> bus = adoptGRef(gst_element_get_bus(pipeline.get()));
+    gint64 start = g_get_monotonic_time();
+    gst_element_set_state(pipeline.get(), GST_STATE_PLAYING);
+#ifdef GST_API_VERSION_1
+    GstMessage* message = gst_bus_timed_pop_filtered(bus.get(), GST_CLOCK_TIME_NONE, static_cast<GstMessageType>(GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+#else
+    GstMessage* message = gst_bus_poll(bus.get(), static_cast<GstMessageType>(GST_MESSAGE_EOS | GST_MESSAGE_ERROR), -1);
+#endif
+    gint64 elapsed = g_get_monotonic_time() - start;
+    bool succeeded = message && GST_MESSAGE_TYPE(message) == GST_MESSAGE_EOS;
+    if (message)
+        gst_message_unref(message);
+    gst_element_set_state(pipeline.get(), GST_STATE_NULL);
+    return succeeded ? elapsed : -1;
+}
+
+static double audioResampleFramesPerSecond(const RatePair& rates, int quality, unsigned seconds)
+{
+    // The source and the caps negotiation are timed on their own and
+    // left out.
+    gint64 baseline = runPipeline(rates, -1, seconds);
+    gint64 withResampler = runPipeline(rates, quality, seconds);
+    if (baseline < 0 || withResampler < 0)
+        return 0;
+    return static_cast<double>(rates.input) * seconds * 1e6 / std::max<gint64>(withResampler - baseline, 1);
+}
+
+int main(int argc, char** argv)
+{
+    gint seconds = 60;
+
+    GOptionEntry entries[] = {
+        { "seconds", 's', 0, G_OPTION_ARG_INT, &seconds, "Seconds of audio resampled for throughput (default 60)", "S" },
+        { 0, 0, 0, G_OPTION_ARG_NONE, 0, 0, 0 }
+    };
+
+    GOptionContext* optionContext = g_option_context_new("- compare PolyphaseResampler with audioresample");
+    g_option_context_add_main_entries(optionContext, entries, 0);
+    GOwnPtr<GError> optionError;
+    bool parsed = g_option_context_parse(optionContext, &argc, &argv, &optionError.outPtr());
+    g_option_context_free(optionContext);
+    if (!parsed) {
+        fprintf(stderr, "%s\n", optionError->message);
+        return -1;
+    }
+
+    if (!initializeGStreamer()) {
+        fprintf(stderr, "Error trying to initialize gstreamer :(\n");
+        return -1;
+    }
+
+    unsigned duration = std::max(seconds, 1);
+    printf("%-13s %-7s %5s %9s %17s %19s\n", "rates", "quality", "taps", "SNR (dB)", "polyphase (Mf/s)", "audioresample (Mf/s)");
+    for (const RatePair& rates : gRatePairs) {
+        for (unsigned quality = ResamplerFast; quality <= ResamplerBest; ++quality) {
+            ResamplerQuality preset = static_cast<ResamplerQuality>(quality);
+            GOwnPtr<gchar> label(g_strdup_printf("%u>%u", rates.input, rates.output));
+            printf("%-13s %-7s %5u %9.1f %17.1f %19.1f\n", label.get(), gQualityNames[quality],
+                PolyphaseResampler(rates.input, rates.output, preset).tapsPerPhase(), worstToneSNR(rates, preset),
+                polyphaseFramesPerSecond(rates, preset, duration) / 1e6,
+                audioResampleFramesPerSecond(rates, gAudioResampleQualities[quality], duration) / 1e6);
+        }
+    }
+    return 0;
+}
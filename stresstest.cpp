@@ -0,0 +1,369 @@
+/*
+ *  Copyright (C) 2012 Igalia S.L
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include <glib/gstdio.h>
+#include <gst/gst.h>
+
+#include "AudioStreamChannelsReader.h"
+#include "GOwnPtr.h"
+#include "GRefPtr.h"
+#include "GStreamerUtilities.h"
+#include "SimulatedLiveSource.h"
+
+// Soak test for reader construction and teardown: worker threads keep
+// creating, running and destroying readers over a mix of inputs, some
+// of them corrupt and some cancelled mid-decode, while the main thread
+// reports process resources and throughput over time. Slow leaks in
+// the teardown paths show up as steadily growing RSS, fd, thread or
+// GstObject counts, and as throughput drifting away from the first
+// interval.
+
+enum InputKind {
+    FileInput,
+    MemoryInput,
+    SimulatedLiveInput,
+    TruncatedFileInput,
+    GarbageFileInput,
+    GarbageMemoryInput,
+    InputKindCount
+};
+
+static const char* gInputKindNames[InputKindCount] = {
+    "file", "memory", "live", "truncated", "garbage-file", "garbage-memory"
+};
+
+// Corrupt inputs may never error out on their own.
+static const guint gIterationTimeoutMs = 30000;
+// Every Nth decode is cancelled early to exercise that teardown path.
+static const guint64 gCancelEvery = 7;
+static const guint gEarlyCancelMs = 50;
+
+struct StressInputs {
+    const char* filePath;
+    gchar* fileData;
+    gsize fileSize;
+    gchar* truncatedPath;
+    gchar* garbagePath;
+    std::vector<char> garbage;
+};
+
+struct StressCounters {
+    StressCounters()
+        : iterations(0)
+        , failures(0)
+        , cancelled(0)
+        , frames(0)
+    {
+        for (unsigned i = 0; i < InputKindCount; ++i)
+            perKind[i] = 0;
+    }
+
+    std::atomic<guint64> iterations;
+    std::atomic<guint64> failures;
+    std::atomic<guint64> cancelled;
+    std::atomic<guint64> frames;
+    std::atomic<guint64> perKind[InputKindCount];
+};
+
+static gboolean cancelReaderCallback(gpointer userData)
+{
+    static_cast<AudioStreamChannelsReader*>(userData)->cancel();
+    return FALSE;
+}
+
+static void runIteration(GMainContext* context, InputKind kind, bool cancelEarly, const StressInputs& inputs, StressCounters& counters)
+{
+    // Declared first so it outlives the reader pipeline pulling from it.
+    std::unique_ptr<SimulatedLiveSource> liveSource;
+    std::unique_ptr<AudioStreamChannelsReader> reader;
+
+    switch (kind) {
+    case FileInput:
+        reader.reset(new AudioStreamChannelsReader(inputs.filePath));
+        break;
+    case MemoryInput:
+        reader.reset(new AudioStreamChannelsReader(inputs.fileData, inputs.fileSize));
+        break;
+    case SimulatedLiveInput: {
+        SimulatedLiveConfig config;
+        config.duration = GST_SECOND;
+        liveSource.reset(new SimulatedLiveSource(config));
+        reader.reset(new AudioStreamChannelsReader(static_cast<const char*>(0)));
+        reader->setLiveSource(liveSource->createElement());
+        break;
+    }
+    case TruncatedFileInput:
+        reader.reset(new AudioStreamChannelsReader(inputs.truncatedPath));
+        break;
+    case GarbageFileInput:
+        reader.reset(new AudioStreamChannelsReader(inputs.garbagePath));
+        break;
+    case GarbageMemoryInput:
+        reader.reset(new AudioStreamChannelsReader(&inputs.garbage[0], inputs.garbage.size()));
+        break;
+    case InputKindCount:
+        return;
+    }
+
+    bool finished = false;
+    reader->start(44100, false, context, [&finished, &counters](std::unique_ptr<AudioBus> bus, const GError* error) {
+        finished = true;
+        if (error && g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            ++counters.cancelled;
+        else if (error)
+            ++counters.failures;
+        if (bus)
+            counters.frames += bus->length();
+    });
+
+    GRefPtr<GSource> timeout = adoptGRef(g_timeout_source_new(cancelEarly ? gEarlyCancelMs : gIterationTimeoutMs));
+    g_source_set_callback(timeout.get(), cancelReaderCallback, reader.get(), 0);
+    g_source_attach(timeout.get(), context);
+
+    while (!finished)
+        g_main_context_iteration(context, TRUE);
+
+    g_source_destroy(timeout.get());
+    reader.reset();
+    ++counters.iterations;
+    ++counters.perKind[kind];
+}
+
+static void stressWorker(unsigned index, const StressInputs& inputs, StressCounters& counters, const std::atomic<bool>& stopRequested)
+{
+    GRefPtr<GMainContext> context = adoptGRef(g_main_context_new());
+    for (guint64 iteration = index; !stopRequested; ++iteration) {
+        InputKind kind = static_cast<InputKind>(iteration % InputKindCount);
+        runIteration(context.get(), kind, !(iteration % gCancelEvery), inputs, counters);
+    }
+
+    // Drain whatever the last readers left behind on the context.
+    while (g_main_context_iteration(context.get(), FALSE)) { }
+}
+
+static long residentSetKilobytes()
+{
+    long pages = 0;
+    long resident = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (!statm)
+        return -1;
+    if (fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+        resident = -1;
+    fclose(statm);
+    return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int openFileDescriptorCount()
+{
+    GDir* directory = g_dir_open("/proc/self/fd", 0, 0);
+    if (!directory)
+        return -1;
+    int count = 0;
+    while (g_dir_read_name(directory))
+        ++count;
+    g_dir_close(directory);
+    // The descriptor used to list the directory.
+    return count - 1;
+}
+
+static int threadCount()
+{
+    GOwnPtr<gchar> status;
+    if (!g_file_get_contents("/proc/self/status", &status.outPtr(), 0, 0))
+        return -1;
+    const char* threads = strstr(status.get(), "Threads:");
+    return threads ? atoi(threads + strlen("Threads:")) : -1;
+}
+
+static guint64 instanceCount(GType type)
+{
+#if GLIB_CHECK_VERSION(2, 44, 0)
+    guint64 count = g_type_get_instance_count(type);
+    guint childCount = 0;
+    GType* children = g_type_children(type, &childCount);
+    for (guint i = 0; i < childCount; ++i)
+        count += instanceCount(children[i]);
+    g_free(children);
+    return count;
+#else
+    return 0;
+#endif
+}
+
+// Only counted when GObject runs with GOBJECT_DEBUG=instance-count.
+static guint64 liveGstObjectCount()
+{
+    return instanceCount(GST_TYPE_OBJECT);
+}
+
+static bool enableInstanceCounting(char** argv)
+{
+    // GObject reads GOBJECT_DEBUG when the library is loaded, so the
+    // only way to turn counting on is to start over with it set.
+    const char* debug = g_getenv("GOBJECT_DEBUG");
+    if (debug && strstr(debug, "instance-count"))
+        return true;
+
+    GOwnPtr<gchar> value(debug ? g_strconcat(debug, ",instance-count", NULL) : g_strdup("instance-count"));
+    g_setenv("GOBJECT_DEBUG", value.get(), TRUE);
+    execv("/proc/self/exe", argv);
+    return false;
+}
+
+static bool createCorruptInputs(StressInputs& inputs)
+{
+    const gsize headerSize = std::min<gsize>(4096, inputs.fileSize);
+
+    // Stream headers intact, data cut off halfway.
+    inputs.truncatedPath = g_build_filename(g_get_tmp_dir(), "stresstest-truncated.ogg", NULL);
+    if (!g_file_set_contents(inputs.truncatedPath, inputs.fileData, inputs.fileSize / 2, 0))
+        return false;
+
+    // Valid headers followed by noise, and noise alone.
+    inputs.garbage.resize(std::max<gsize>(inputs.fileSize, 65536));
+    GRand* random = g_rand_new_with_seed(0x5eed);
+    for (size_t i = 0; i < inputs.garbage.size(); ++i)
+        inputs.garbage[i] = g_rand_int(random) & 0xff;
+    g_rand_free(random);
+
+    std::vector<char> headerAndGarbage(inputs.garbage);
+    memcpy(&headerAndGarbage[0], inputs.fileData, headerSize);
+    inputs.garbagePath = g_build_filename(g_get_tmp_dir(), "stresstest-garbage.ogg", NULL);
+    return g_file_set_contents(inputs.garbagePath, &headerAndGarbage[0], headerAndGarbage.size(), 0);
+}
+
+int main(int argc, char** argv)
+{
+    bool countingInstances = enableInstanceCounting(argv);
+
+    const char* filePath = 0;
+    gint threads = 8;
+    gint durationSeconds = 3600;
+    gint reportSeconds = 10;
+    gchar** arguments = 0;
+
+    GOptionEntry entries[] = {
+        { "threads", 't', 0, G_OPTION_ARG_INT, &threads, "Concurrent reader threads (default 8)", "N" },
+        { "duration", 'd', 0, G_OPTION_ARG_INT, &durationSeconds, "Seconds to run for (default 3600)", "S" },
+        { "report-interval", 'i', 0, G_OPTION_ARG_INT, &reportSeconds, "Seconds between reports (default 10)", "S" },
+        { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &arguments, 0, "FILE" },
+        { 0, 0, 0, G_OPTION_ARG_NONE, 0, 0, 0 }
+    };
+
+    GOptionContext* optionContext = g_option_context_new("- construct and destroy readers concurrently for a long time");
+    g_option_context_add_main_entries(optionContext, entries, 0);
+    GOwnPtr<GError> optionError;
+    bool parsed = g_option_context_parse(optionContext, &argc, &argv, &optionError.outPtr());
+    g_option_context_free(optionContext);
+    if (!parsed) {
+        fprintf(stderr, "%s\n", optionError->message);
+        return -1;
+    }
+
+    filePath = arguments ? arguments[0] : "chicken.ogg";
+
+    if (!initializeGStreamer()) {
+        fprintf(stderr, "Error trying to initialize gstreamer :(\n");
+        g_strfreev(arguments);
+        return -1;
+    }
+
+    StressInputs inputs;
+    inputs.filePath = filePath;
+    inputs.fileData = 0;
+    inputs.truncatedPath = 0;
+    inputs.garbagePath = 0;
+    GOwnPtr<GError> error;
+    if (!g_file_get_contents(filePath, &inputs.fileData, &inputs.fileSize, &error.outPtr()) || !createCorruptInputs(inputs)) {
+        fprintf(stderr, "Could not prepare inputs from %s\n", filePath);
+        g_strfreev(arguments);
+        return -1;
+    }
+
+    // One run of each kind first, so plugin loading and process-wide
+    // singletons don't count as leaks.
+    StressCounters warmupCounters;
+    GRefPtr<GMainContext> warmupContext = adoptGRef(g_main_context_new());
+    for (unsigned kind = 0; kind < InputKindCount; ++kind)
+        runIteration(warmupContext.get(), static_cast<InputKind>(kind), false, inputs, warmupCounters);
+    while (g_main_context_iteration(warmupContext.get(), FALSE)) { }
+    guint64 baselineObjects = liveGstObjectCount();
+
+    StressCounters counters;
+    std::atomic<bool> stopRequested(false);
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < std::max(threads, 1); ++i)
+        workers.push_back(std::thread(stressWorker, i, std::cref(inputs), std::ref(counters), std::cref(stopRequested)));
+
+    gint64 startTime = g_get_monotonic_time();
+    gint64 endTime = startTime + static_cast<gint64>(std::max(durationSeconds, 1)) * G_USEC_PER_SEC;
+    guint64 lastIterations = 0;
+    double firstRate = 0;
+    printf("elapsed(s) iterations failures cancelled rate(/s) drift rss(kB) fds threads gstobjects\n");
+    while (g_get_monotonic_time() < endTime) {
+        g_usleep(std::min<gint64>(std::max(reportSeconds, 1) * G_USEC_PER_SEC, endTime - g_get_monotonic_time()));
+
+        guint64 iterations = counters.iterations;
+        double rate = static_cast<double>(iterations - lastIterations) / std::max(reportSeconds, 1);
+        lastIterations = iterations;
+        if (!firstRate)
+            firstRate = rate;
+        double drift = firstRate ? 100 * (rate - firstRate) / firstRate : 0;
+
+        printf("%10.0f %10" G_GUINT64_FORMAT " %8" G_GUINT64_FORMAT " %9" G_GUINT64_FORMAT " %9.1f %+5.0f%% %7ld %3d %7d %10" G_GUINT64_FORMAT "\n",
+            (g_get_monotonic_time() - startTime) / 1e6, iterations, static_cast<guint64>(counters.failures),
+            static_cast<guint64>(counters.cancelled), rate, drift, residentSetKilobytes(), openFileDescriptorCount(),
+            threadCount(), liveGstObjectCount());
+        fflush(stdout);
+    }
+
+    stopRequested = true;
+    for (auto& worker : workers)
+        worker.join();
+
+    for (unsigned kind = 0; kind < InputKindCount; ++kind)
+        printf("%s: %" G_GUINT64_FORMAT " runs\n", gInputKindNames[kind], static_cast<guint64>(counters.perKind[kind]));
+    printf("decoded %" G_GUINT64_FORMAT " frames in total\n", static_cast<guint64>(counters.frames));
+
+    g_unlink(inputs.truncatedPath);
+    g_unlink(inputs.garbagePath);
+    g_free(inputs.truncatedPath);
+    g_free(inputs.garbagePath);
+    g_free(inputs.fileData);
+    g_strfreev(arguments);
+
+    if (!countingInstances) {
+        printf("GstObject leaks not checked, run with GOBJECT_DEBUG=instance-count\n");
+        return 0;
+    }
+
+    guint64 liveObjects = liveGstObjectCount();
+    guint64 leakedObjects = liveObjects > baselineObjects ? liveObjects - baselineObjects : 0;
+    printf("%" G_GUINT64_FORMAT " GstObjects leaked\n", leakedObjects);
+    return leakedObjects ? 1 : 0;
+}